@@ -3,7 +3,7 @@
 //  SqueezeButtonPi
 //
 //  Low-Level code to configure and read buttons and rotary encoders.
-//  Calls callbacks on activity
+//  Queues input events on activity
 //
 //  Created by Jörg Schwieder on 02.02.17.
 //
@@ -36,120 +36,607 @@
 //
 
 #include "GPIO.h"
+#include "gpiochip.h"
+#include "evdev.h"
 #include "sbpd.h"
 
-#include <wiringPi.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <linux/input.h>
 
 //
-//  Configured buttons
+//  GPIO backend, its device and the line request holding all configured lines
+//
+static const struct gpio_backend * backend = &gpiochip_backend;
+static int chip_fd = -1;
+static int req_fd = -1;
+static unsigned int line_offsets[GPIO_V2_LINES_MAX];
+static int line_resist[GPIO_V2_LINES_MAX];
+static int numberoflines = 0;
+
+//
+//  Per-line dispatch table, indexed by line offset
+//  Built at setup time, so an edge goes straight to the element owning
+//  the line instead of checking all configured elements.
+//
+#define MAX_LINE_OFFSET 128
+#define LINE_UNUSED     0
+#define LINE_BUTTON     1
+#define LINE_ENCODER    2
+#define LINE_MATRIX     3
+
+struct line_map {
+    uint8_t type;       // LINE_UNUSED, LINE_BUTTON, LINE_ENCODER or LINE_MATRIX
+    uint8_t bit;        // encoder: state bit of the line, 0b10 pin_a, 0b01 pin_b
+    uint8_t index;      // index in the line request
+    uint16_t element;   // index in buttons[] or encoders[]
+};
+static struct line_map line_map[MAX_LINE_OFFSET];
+
+//
+//  Input thread
+//  One thread waits on all input sources through a single epoll set.
+//  stop_fd is an eventfd used to end it, timer_fd wakes it up for the
+//  earliest element deadline.
+//
+static pthread_t input_thread;
+static bool input_running = false;
+static int epoll_fd = -1;
+static int stop_fd = -1;
+static int timer_fd = -1;
+#define INPUT_MAX_READY 8
+
+//
+//  Configured buttons, GPIO line buttons and matrix keys
 //
 static int numberofbuttons = 0;
+static int numberoflinebuttons = 0;
+static int numberofkeys = 0;
+//
+//  Button objects are allocated from the registry, see alloc_GPIO()
+//
+static struct button * buttons = NULL;
+static int button_capacity = 0;
+
 //
-//  Pre-allocate encoder objects on the stack so we don't have to
-//  worry about freeing them
+//  Key matrix
+//  Rows are driven low one at a time and the columns read, a pressed key
+//  pulls its column low. keys[row][col] is the button id of a key, -1 if none.
 //
-static struct button buttons[max_buttons];
+static struct {
+    int num_rows;
+    int num_cols;
+    unsigned int rows[MATRIX_MAX_ROWS];
+    unsigned int cols[MATRIX_MAX_COLS];
+    int req_fd;
+    uint64_t period_ns;         // time between scans
+    int debounce_scans;         // scans a key needs to read a new state
+    uint64_t next_scan_ns;
+    uint32_t ghost_rows;        // rows left out of the last scan
+    int16_t keys[MATRIX_MAX_ROWS][MATRIX_MAX_COLS];
+    uint8_t counts[MATRIX_MAX_ROWS][MATRIX_MAX_COLS];   // scans read differently
+} matrix = { .num_rows = 0, .req_fd = -1 };
+
+//
+//  Input device keys and axes
+//  Events of input devices go to the button or encoder configured for
+//  their device, type and code.
+//
+static struct input_map {
+    int8_t device;      // evdev device index
+    uint16_t type;      // EV_KEY or EV_REL
+    uint16_t code;
+    uint16_t element;   // index in buttons[] or encoders[]
+} * input_map = NULL;
+static int input_capacity = 0;
+static int numberofinputs = 0;
+
+//
+//  Register an input device key or axis
+//  Returns: false if the device can't be added or the code is already in use
+//
+static bool add_input(const char * device, bool grab, uint16_t type, int code, uint16_t element) {
+    if (numberofinputs >= input_capacity) {
+        logerr("Maximum number of input keys and axes exceded: %i", input_capacity);
+        return false;
+    }
+    int index = evdev_add(device, grab);
+    if (index < 0)
+        return false;
+    for (int i = 0; i < numberofinputs; i++) {
+        if (input_map[i].device == index && input_map[i].type == type && input_map[i].code == code) {
+            logerr("Input device %s: code %d is already in use", device, code);
+            return false;
+        }
+    }
+    input_map[numberofinputs].device = (int8_t)index;
+    input_map[numberofinputs].type = type;
+    input_map[numberofinputs].code = (uint16_t)code;
+    input_map[numberofinputs].element = element;
+    numberofinputs++;
+    return true;
+}
 
 //
 // GetTime function
 //
 uint32_t gettime_ms(void) {
 	struct timespec ts;
-	if (!clock_gettime(CLOCK_REALTIME, &ts)) {
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts)) {
 		return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 	}
 	return 0;
 }
 
 //
-// number of milliseconds to debounce the button
+//  Line events carry CLOCK_MONOTONIC nanoseconds, same time base as gettime_ms()
+//
+#define EVENT_MS(event) ((uint32_t)((event)->timestamp_ns / 1000000))
+#define EVENT_LEVEL(event) ((event)->id == GPIO_V2_LINE_EVENT_RISING_EDGE)
+
+//
+//  Check a line is valid and unused
 //
-#define NOPRESSTIME 50
+static bool free_line(int pin) {
+    if (pin < 0 || pin >= MAX_LINE_OFFSET) {
+        logerr("Invalid GPIO %d", pin);
+        return false;
+    }
+    if (line_map[pin].type != LINE_UNUSED) {
+        logerr("GPIO %d is already in use", pin);
+        return false;
+    }
+    return true;
+}
+
 //
+//  Register a line for the common line request and the dispatch table
+//  Returns: false if the line is invalid, already used or too many lines are configured
+//
+static bool add_line(int pin, int resist, uint8_t type, uint16_t element, uint8_t bit) {
+    if (!free_line(pin))
+        return false;
+    if (numberoflines >= GPIO_V2_LINES_MAX) {
+        logerr("Maximum number of GPIO lines exceded: %i", GPIO_V2_LINES_MAX);
+        return false;
+    }
+    line_map[pin].type = type;
+    line_map[pin].bit = bit;
+    line_map[pin].index = (uint8_t)numberoflines;
+    line_map[pin].element = element;
+    line_offsets[numberoflines] = (unsigned int)pin;
+    line_resist[numberoflines] = resist;
+    numberoflines++;
+    return true;
+}
+
+static void remove_last_line(void) {
+    numberoflines--;
+    line_map[line_offsets[numberoflines]].type = LINE_UNUSED;
+}
+
+static void push_press(struct button * button, uint8_t kind, uint64_t time_ns, uint32_t duration) {
+	struct sbpd_event press;
+	press.timestamp_ns = time_ns;
+	press.element = (uint16_t)button->id;
+	press.kind = kind;
+	press.delta = 0;
+	press.duration = duration;
+	eventqueue_push(&press);
+}
+
 //
 //  Button handler function
-//  Called by the GPIO interrupt when a button is pressed or released
-//  Depends on edge configuration.
-//  Checks all configred buttons for status changes and
-//  calls callback if state change detected.
-//
-//
-void updateButtons() {
-	uint32_t now;
-	now = gettime_ms();
-	struct button *button = buttons;
-
-	for (; button < buttons + numberofbuttons; button++) {
-		bool bit = digitalRead(button->pin);
-		bool presstype;
-		logdebug("%lu - %lu= %i  Pin Value=%i   Stored Value=%i", (unsigned long)now, (unsigned long)button->timepressed, (signed int)(now - button->timepressed), bit, button->value);
-
-		int increment = 0;
-		if ( (bit == button->pressed) && (button->timepressed == 0) ){	
-			button->timepressed = now;
-			increment = 0;
-		} else if (button->timepressed != 0){	
-			if ((signed int)(now - button->timepressed) < (signed int)NOPRESSTIME ) {
-				logdebug("No PRESS: %i", (signed int)(now - button->timepressed));
-				increment = 0;
-			} else if ((signed int)(now - button->timepressed) > (signed int)button->long_press_time ) {
-				loginfo("Long PRESS: %i", (signed int)(now - button->timepressed));
-				button->value = bit;
-				presstype = LONGPRESS;
-				increment = 1;
-			} else {
-				loginfo("Short PRESS: %i", (signed int)(now - button->timepressed));
-				button->value = bit;
-				presstype = SHORTPRESS;
-				increment = 1;
-			}
-			button->timepressed = 0;
+//  Called with the debounced level when a change is confirmed.
+//  A press starts the hold timer, see button_held(). A release queues a
+//  short press event unless the hold timer already reported the press.
+//  Repeating buttons report on press, not on release.
+//
+static void updateButton(struct button * button, bool bit, uint64_t time_ns) {
+	uint32_t now = (uint32_t)(time_ns / 1000000);
+
+	logdebug("%lu - %lu= %i  Pin Value=%i   Stored Value=%i", (unsigned long)now, (unsigned long)button->timepressed, (signed int)(now - button->timepressed), bit, button->value);
+
+	button->value = bit;
+	if ( (bit == button->pressed) && (button->timepressed == 0) ){
+		button->timepressed = now;
+		button->held = false;
+		push_press(button, EVENT_BUTTON_DOWN, time_ns, 0);
+		if (button->repeat_delay > 0) {
+			loginfo("PRESS, repeating after %i ms", button->repeat_delay);
+			push_press(button, EVENT_SHORTPRESS, time_ns, 0);
+			button->hold_ns = time_ns + (uint64_t)button->repeat_delay * 1000000;
+		} else if (button->long_press_time > 0) {
+			button->hold_ns = time_ns + (uint64_t)button->long_press_time * 1000000;
+		}
+		return;
+	}
+	if (button->timepressed == 0)
+		return;
+
+	uint32_t duration = now - button->timepressed;
+	button->timepressed = 0;
+	button->hold_ns = 0;
+	if (!button->held && button->repeat_delay <= 0) {
+		loginfo("Short PRESS: %i", (signed int)duration);
+		push_press(button, EVENT_SHORTPRESS, time_ns, duration);
+	}
+	push_press(button, EVENT_BUTTON_UP, time_ns, duration);
+}
+
+//
+//  End a press without a press event, the key went away while held
+//
+static void cancel_press(struct button * button, uint64_t time_ns) {
+	button->value = !button->pressed;
+	if (button->timepressed == 0)
+		return;
+
+	uint32_t duration = (uint32_t)(time_ns / 1000000) - button->timepressed;
+	button->timepressed = 0;
+	button->hold_ns = 0;
+	push_press(button, EVENT_BUTTON_UP, time_ns, duration);
+}
+
+//
+//  Hold timer
+//  Fires while the button is still held: once at the long press time,
+//  or, for repeating buttons, after the repeat delay and then at the repeat rate.
+//
+static void button_held(struct button * button, uint64_t time_ns) {
+	uint32_t duration = (uint32_t)(time_ns / 1000000) - button->timepressed;
+
+	if (button->repeat_delay > 0) {
+		logdebug("Repeat PRESS: %i", (signed int)duration);
+		push_press(button, EVENT_REPEAT, time_ns, duration);
+		button->hold_ns = time_ns + (uint64_t)button->repeat_rate * 1000000;
+		return;
+	}
+	loginfo("Long PRESS: %i", (signed int)duration);
+	button->held = true;
+	button->hold_ns = 0;
+	push_press(button, EVENT_LONGPRESS, time_ns, duration);
+}
+
+//
+//  Debouncing
+//  Edges only move the line level, updateButton() gets a level once it is
+//  confirmed. Confirmation is due at button->deadline_ns, the input thread
+//  timer wakes up for it, so a quiet end of a bounce is confirmed right when
+//  the window expires.
+//
+//  DEBOUNCE_INTEGRATOR: time spent on the other level than the confirmed one
+//      counts up, time spent back on the confirmed level counts down. The
+//      change is confirmed when the count reaches the settle time. Short
+//      spikes are ignored, bounces only delay the confirmation.
+//  DEBOUNCE_LOCKOUT: a change is confirmed on the first edge, further edges
+//      are ignored for the settle time. After that the line level is
+//      confirmed if it differs. No delay, but glitches count as changes.
+//
+static void button_settled(struct button * button, uint64_t time_ns) {
+	uint64_t window = (uint64_t)button->debounce_time * 1000000;
+
+	button->deadline_ns = 0;
+	if (button->debounce == DEBOUNCE_LOCKOUT) {
+		if (button->level != button->value) {
+			updateButton(button, button->level, time_ns);
+			button->deadline_ns = time_ns + window;
+		}
+		return;
+	}
+	//  integrator: the deadline is only set while the level differs
+	button->integral_ns += time_ns - button->level_ns;
+	button->level_ns = time_ns;
+	if (button->integral_ns >= window) {
+		button->integral_ns = 0;
+		updateButton(button, button->level, time_ns);
+	} else {
+		button->deadline_ns = time_ns + window - button->integral_ns;
+	}
+}
+
+//
+//  Run the button timers due at "now" in the order they expire
+//
+static void button_timers(struct button * button, uint64_t now) {
+	for (;;) {
+		uint64_t settle = button->deadline_ns;
+		uint64_t hold = button->hold_ns;
+		if (settle && settle <= now && (!hold || settle <= hold))
+			button_settled(button, settle);
+		else if (hold && hold <= now)
+			button_held(button, hold);
+		else
+			return;
+	}
+}
+
+static void button_edge(struct button * button, const struct gpio_v2_line_event * event) {
+	uint64_t now = event->timestamp_ns;
+	uint64_t window = (uint64_t)button->debounce_time * 1000000;
+
+	//  timer expiries we didn't get to yet come first
+	button_timers(button, now);
+
+	if (button->debounce == DEBOUNCE_LOCKOUT) {
+		button->level = EVENT_LEVEL(event);
+		button->level_ns = now;
+		if (!button->deadline_ns && button->level != button->value) {
+			updateButton(button, button->level, now);
+			button->deadline_ns = now + window;
 		}
-		if (button->callback && increment)
-			button->callback(button, increment, presstype);
+	} else {
+		uint64_t elapsed = now - button->level_ns;
+		if (button->level != button->value)
+			button->integral_ns += elapsed;
+		else
+			button->integral_ns = (button->integral_ns > elapsed) ? button->integral_ns - elapsed : 0;
+		button->level = EVENT_LEVEL(event);
+		button->level_ns = now;
+		button->deadline_ns = 0;
+		if (button->level != button->value)
+			button->deadline_ns = now + ((button->integral_ns < window) ? window - button->integral_ns : 0);
 	}
+	if (button->deadline_ns && button->deadline_ns <= now)
+		button_settled(button, now);
 }
 
+static struct button *init_button(int pi, int pin, bool pressed, int long_press_time,
+                                  int debounce, int debounce_time, int repeat_delay, int repeat_rate);
+
 //
 //
 //  Configuration function to define a button
 //  Should be run for every button you want to control
 //  For each button a button struct will be created
+//  The line is requested by start_GPIO()
 //
 //  Parameters:
 //      pin: GPIO-Pin used in BCM numbering scheme
-//      callback: callback function to be called when button state changed
-//      edge: edge to be used for trigger events,
-//            one of INT_EDGE_RISING, INT_EDGE_FALLING or INT_EDGE_BOTH (the default)
+//      resist: line bias, one of GPIO_PUD_OFF, GPIO_PUD_DOWN or GPIO_PUD_UP
+//      debounce: DEBOUNCE_INTEGRATOR or DEBOUNCE_LOCKOUT
+//      debounce_time: settle time in ms
+//      repeat_delay, repeat_rate: auto-repeat delay and interval in ms,
+//          repeat_delay 0 for no auto-repeat
 //  Returns: pointer to the new button structure
 //           The pointer will be NULL is the function failed for any reason
 //
 //
-struct button *setupbutton(int pi, int pin, button_callback_t b_callback, int resist, bool pressed, int long_press_time)
+struct button *setupbutton(int pi, int pin, int resist, bool pressed, int long_press_time,
+                           int debounce, int debounce_time, int repeat_delay, int repeat_rate)
 {
-    if (numberofbuttons > max_buttons)
+    if (numberofbuttons >= button_capacity)
     {
-        logerr("Maximum number of buttons exceded: %i", max_buttons);
+        logerr("Maximum number of buttons exceded: %i", button_capacity);
         return NULL;
     }
 
-    int edge = INT_EDGE_BOTH;  //Need to see both directions for button depressed time.
+    //  Edge detection is always on both edges, need to see both directions for button depressed time.
+    if (!add_line(pin, resist, LINE_BUTTON, (uint16_t)numberofbuttons, 0))
+        return NULL;
+
+    numberoflinebuttons++;
+    return init_button(pi, pin, pressed, long_press_time, debounce, debounce_time,
+                       repeat_delay, repeat_rate);
+}
 
+//
+//  Set up the next button structure
+//
+static struct button *init_button(int pi, int pin, bool pressed, int long_press_time,
+                                  int debounce, int debounce_time, int repeat_delay, int repeat_rate)
+{
     struct button *newbutton = buttons + numberofbuttons++;
     newbutton->pi = pi;
+    newbutton->id = (int)(newbutton - buttons);
     newbutton->pin = pin;
     newbutton->value = 0;
-    newbutton->callback = b_callback;
     newbutton->timepressed = 0;
     newbutton->pressed = pressed;
     newbutton->long_press_time = long_press_time;
-    pinMode( pin, INPUT);
-    pullUpDnControl(pin, resist);
-    newbutton->cb_id = wiringPiISR((unsigned) pin, (unsigned)edge, &updateButtons);
+    newbutton->debounce = debounce;
+    newbutton->debounce_time = (debounce_time < 0) ? 0 : debounce_time;
+    newbutton->level = 0;
+    newbutton->level_ns = 0;
+    newbutton->integral_ns = 0;
+    newbutton->deadline_ns = 0;
+    newbutton->repeat_delay = (repeat_delay < 0) ? 0 : repeat_delay;
+    newbutton->repeat_rate = (repeat_rate < BUTTON_MIN_REPEAT_RATE) ? BUTTON_MIN_REPEAT_RATE : repeat_rate;
+    newbutton->held = false;
+    newbutton->hold_ns = 0;
 
     return newbutton;
 }
 
+//
+//
+//  Configuration function to define a key matrix
+//  Lines are requested by start_GPIO()
+//
+//  Parameters:
+//      rows, cols: GPIO-Pins of the rows and columns in BCM numbering scheme
+//      scan_rate: scans per second
+//      debounce_time: ms a key needs to read a new state
+//  Returns: 0 on success, -1 on error
+//
+//
+int setupmatrix(int pi, const int * rows, int num_rows, const int * cols, int num_cols,
+                int scan_rate, int debounce_time)
+{
+    if (matrix.num_rows) {
+        logerr("Only one key matrix is supported");
+        return -1;
+    }
+    if (num_rows < 1 || num_rows > MATRIX_MAX_ROWS || num_cols < 1 || num_cols > MATRIX_MAX_COLS) {
+        logerr("Key matrix needs 1 to %d rows and 1 to %d columns", MATRIX_MAX_ROWS, MATRIX_MAX_COLS);
+        return -1;
+    }
+    if (scan_rate < 1 || scan_rate > MATRIX_MAX_SCAN_RATE) {
+        logerr("Key matrix scan rate must be 1 to %d", MATRIX_MAX_SCAN_RATE);
+        return -1;
+    }
+    for (int i = 0; i < num_rows + num_cols; i++) {
+        int pin = (i < num_rows) ? rows[i] : cols[i - num_rows];
+        if (!free_line(pin)) {
+            for (int j = 0; j < i; j++)
+                line_map[(j < num_rows) ? rows[j] : cols[j - num_rows]].type = LINE_UNUSED;
+            return -1;
+        }
+        line_map[pin].type = LINE_MATRIX;
+    }
+
+    for (int row = 0; row < num_rows; row++)
+        matrix.rows[row] = (unsigned int)rows[row];
+    for (int col = 0; col < num_cols; col++)
+        matrix.cols[col] = (unsigned int)cols[col];
+    for (int row = 0; row < MATRIX_MAX_ROWS; row++) {
+        for (int col = 0; col < MATRIX_MAX_COLS; col++) {
+            matrix.keys[row][col] = -1;
+            matrix.counts[row][col] = 0;
+        }
+    }
+    matrix.num_rows = num_rows;
+    matrix.num_cols = num_cols;
+    matrix.period_ns = 1000000000ULL / scan_rate;
+    matrix.debounce_scans = (int)(((uint64_t)debounce_time * 1000000 + matrix.period_ns - 1) / matrix.period_ns);
+    if (matrix.debounce_scans < 1)
+        matrix.debounce_scans = 1;
+    return 0;
+}
+
+//
+//
+//  Configuration function to define a key of the key matrix
+//  Keys work like buttons, debouncing is done by the matrix scan.
+//
+//  Parameters:
+//      row, col: position in the matrix, starting at 0
+//  Returns: pointer to the new button structure
+//           The pointer will be NULL is the function failed for any reason
+//
+//
+struct button *setupkey(int pi, int row, int col, int long_press_time, int repeat_delay, int repeat_rate)
+{
+    if (!matrix.num_rows) {
+        logerr("Key %d,%d: no key matrix defined", row, col);
+        return NULL;
+    }
+    if (row < 0 || row >= matrix.num_rows || col < 0 || col >= matrix.num_cols) {
+        logerr("Key %d,%d is outside the %dx%d key matrix", row, col, matrix.num_rows, matrix.num_cols);
+        return NULL;
+    }
+    if (matrix.keys[row][col] >= 0) {
+        logerr("Key %d,%d is already defined", row, col);
+        return NULL;
+    }
+    if (numberofbuttons >= button_capacity) {
+        logerr("Maximum number of buttons exceded: %i", button_capacity);
+        return NULL;
+    }
+
+    numberofkeys++;
+    matrix.keys[row][col] = (int16_t)numberofbuttons;
+    //  keys read 1 while pressed
+    return init_button(pi, -1, true, long_press_time, DEBOUNCE_INTEGRATOR, 0,
+                       repeat_delay, repeat_rate);
+}
+
+//
+//
+//  Configuration function to define a key of an input device
+//  The kernel driver debounces, events go straight to updateButton().
+//
+//  Parameters:
+//      device: input device path or name
+//      grab: take the device exclusively
+//      code: key code
+//  Returns: pointer to the new button structure
+//           The pointer will be NULL is the function failed for any reason
+//
+//
+struct button *setupinputkey(int pi, const char * device, bool grab, int code,
+                             int long_press_time, int repeat_delay, int repeat_rate)
+{
+    if (numberofbuttons >= button_capacity) {
+        logerr("Maximum number of buttons exceded: %i", button_capacity);
+        return NULL;
+    }
+    if (code < 0 || code >= KEY_CNT) {
+        logerr("Invalid key code %d", code);
+        return NULL;
+    }
+    if (!add_input(device, grab, EV_KEY, code, (uint16_t)numberofbuttons))
+        return NULL;
+
+    //  keys read 1 while pressed
+    return init_button(pi, -1, true, long_press_time, DEBOUNCE_INTEGRATOR, 0,
+                       repeat_delay, repeat_rate);
+}
+
+//
+//  Scan the key matrix
+//  Each row is driven low in turn and the columns read.
+//
+//  Ghost keys: with three keys pressed at the corners of a rectangle the
+//  fourth corner reads pressed, too. Whenever two rows share two or more
+//  pressed columns that may be the case, so keys of these rows keep their
+//  state until the rows read unambiguous again.
+//
+//  Debounce: a key takes a new state after reading it debounce_scans
+//  times in a row, the count restarts when it reads the old state again.
+//
+static void matrix_scan(uint64_t now) {
+    uint64_t row_mask = (1ULL << matrix.num_rows) - 1;
+    uint64_t col_mask = (1ULL << matrix.num_cols) - 1;
+    uint32_t pressed[MATRIX_MAX_ROWS];
+
+    for (int row = 0; row < matrix.num_rows; row++) {
+        uint64_t levels = 0;
+        if (backend->set_values(matrix.req_fd, row_mask, row_mask & ~(1ULL << row)) < 0 ||
+            backend->get_values(matrix.req_fd, matrix.num_rows + matrix.num_cols, &levels) < 0)
+            return;
+        pressed[row] = (uint32_t)(~(levels >> matrix.num_rows) & col_mask);
+    }
+    backend->set_values(matrix.req_fd, row_mask, row_mask);
+
+    uint32_t ghost_rows = 0;
+    for (int row = 0; row < matrix.num_rows; row++) {
+        for (int other = row + 1; other < matrix.num_rows; other++) {
+            uint32_t common = pressed[row] & pressed[other];
+            if (common & (common - 1))
+                ghost_rows |= (1U << row) | (1U << other);
+        }
+    }
+    if (ghost_rows != matrix.ghost_rows) {
+        if (ghost_rows)
+            loginfo("Key matrix: ambiguous key combination, ignoring rows 0x%x", ghost_rows);
+        matrix.ghost_rows = ghost_rows;
+    }
+
+    for (int row = 0; row < matrix.num_rows; row++) {
+        if (ghost_rows & (1U << row))
+            continue;
+        for (int col = 0; col < matrix.num_cols; col++) {
+            int id = matrix.keys[row][col];
+            if (id < 0)
+                continue;
+            bool level = (pressed[row] >> col) & 1;
+            if (level == buttons[id].value) {
+                matrix.counts[row][col] = 0;
+            } else if (++matrix.counts[row][col] >= matrix.debounce_scans) {
+                matrix.counts[row][col] = 0;
+                updateButton(buttons + id, level, now);
+            }
+        }
+    }
+}
+
 //
 //
 // Encoders
@@ -159,47 +646,106 @@ struct button *setupbutton(int pi, int pin, button_callback_t b_callback, int re
 //  Configured encoders
 //
 static int numberofencoders = 0;
+static int numberofinputaxes = 0;
+//
+//  Encoder objects are allocated from the registry, see alloc_GPIO()
 //
-//  Pre-allocate encoder objects on the stack so we don't have to
-//  worry about freeing them
+static struct encoder * encoders = NULL;
+static int encoder_capacity = 0;
+
+//
+//  Quadrature decoding
+//  Index is (previous state << 2) | new state, state is (pin_a << 1) | pin_b.
+//  Gives the quarter step, 0 for no change and for invalid transitions.
+//  Invalid transitions (both lines changed at once) are marked in
+//  QUADRATURE_INVALID, they mean edges were missed.
 //
-static struct encoder encoders[max_encoders];
+static const int8_t quadrature[16] = {
+     0, -1,  1,  0,
+     1,  0,  0, -1,
+    -1,  0,  0,  1,
+     0,  1, -1,  0
+};
+#define QUADRATURE_INVALID  ((1 << 0b0011) | (1 << 0b0110) | (1 << 0b1001) | (1 << 0b1100))
 
-void updateEncoders()
+//
+//  Count steps towards detents and queue the detents
+//
+static void encoder_steps(struct encoder * encoder, int steps, uint64_t time_ns)
 {
-    struct encoder *encoder = encoders;
-    for (; encoder < encoders + numberofencoders; encoder++)
-    {
-        int MSB = digitalRead(encoder->pin_a);
-        int LSB = digitalRead(encoder->pin_b);
-        
-        int encoded = (MSB << 1) | LSB;
-        int sum = (encoder->lastEncoded << 2) | encoded;
-        
-        int increment = 0;
-        
-        if(sum == 0b1101 || sum == 0b0100 || sum == 0b0010 || sum == 0b1011) increment = 1;
-        if(sum == 0b1110 || sum == 0b0111 || sum == 0b0001 || sum == 0b1000) increment = -1;
-        
-        encoder->value += increment;
-        encoder->lastEncoded = encoded;
-        encoder->detents = encoder->value / 4;
+    encoder->value += steps;
+    encoder->carry += steps;
+    int detents = encoder->carry / encoder->mode;
+    encoder->carry -= detents * encoder->mode;
 
-        if (encoder->callback)
-            encoder->callback(encoder, increment);
+    if (detents) {
+        struct sbpd_event rotation;
+        rotation.timestamp_ns = time_ns;
+        rotation.element = (uint16_t)encoder->id;
+        rotation.kind = EVENT_ENCODER;
+        rotation.delta = detents;
+        rotation.duration = 0;
+        eventqueue_push(&rotation);
     }
 }
 
+//
+//  Encoder handler function
+//  Called by the input thread for every edge on either encoder line.
+//  The event tells to which level the line changed, bit is the state bit
+//  of that line. The other line keeps the level of its last event.
+//
+//  Quarter steps are collected in "phase". Depending on the resolution
+//  a step counts on every transition, on the rest state and its opposite
+//  (half) or on the rest state only (full). Steps are then collected in
+//  "carry" until they make up a detent; the remainder stays for the next one.
+//
+static void updateEncoder(struct encoder * encoder, int bit, const struct gpio_v2_line_event * event)
+{
+    int encoded = EVENT_LEVEL(event) ? (encoder->lastEncoded | bit) : (encoder->lastEncoded & ~bit);
+    int sum = (encoder->lastEncoded << 2) | encoded;
+
+    encoder->lastEncoded = encoded;
+    if ((QUADRATURE_INVALID >> sum) & 1)
+        __atomic_store_n(&encoder->errors, encoder->errors + 1, __ATOMIC_RELAXED);
+    encoder->phase += quadrature[sum];
+
+    int steps = 0;
+    switch (encoder->resolution) {
+        case ENCODER_RES_HALF:
+            if ((encoded == encoder->rest) || (encoded == (encoder->rest ^ 0b11))) {
+                steps = (encoder->phase + ((encoder->phase > 0) ? 1 : -1)) / 2;
+                encoder->phase = 0;
+            }
+            break;
+        case ENCODER_RES_FULL:
+            if (encoded == encoder->rest) {
+                steps = (encoder->phase + ((encoder->phase > 0) ? 2 : -2)) / 4;
+                encoder->phase = 0;
+            }
+            break;
+        default:
+            steps = encoder->phase;
+            encoder->phase = 0;
+            break;
+    }
+    if (steps)
+        encoder_steps(encoder, steps, event->timestamp_ns);
+}
+
+static struct encoder *init_encoder(int pi, int pin_a, int pin_b, int mode, int resolution);
+
 //
 //
 //  Configuration function to define a rotary encoder
 //  Should be run for every rotary encoder you want to control
 //  For each encoder a button struct will be created
+//  The lines are requested by start_GPIO()
 //
 //  Parameters:
 //      pin_a, pin_b: GPIO-Pins used in BCM numbering scheme
-//      callback: callback function to be called when encoder state changed
-//      mode: operate in ENCODER_MODE_DETENT or , ENCODER_MODE_STEP
+//      mode: steps per detent, 1 (ENCODER_MODE_STEP) reports every step
+//      resolution: ENCODER_RES_QUARTER, ENCODER_RES_HALF or ENCODER_RES_FULL
 //
 //  Returns: pointer to the new encoder structure
 //           The pointer will be NULL is the function failed for any reason
@@ -208,73 +754,369 @@ void updateEncoders()
 struct encoder *setupencoder(int pi,
                              int pin_a,
                              int pin_b,
-                             rotaryencoder_callback_t e_callback,
-                             int mode)
+                             int mode,
+                             int resolution)
 {
-    if (numberofencoders > max_encoders)
+    if (numberofencoders >= encoder_capacity)
     {
-        logerr("Maximum number of encodered exceded: %i", max_encoders);
+        logerr("Maximum number of encoders exceded: %i", encoder_capacity);
+        return NULL;
+    }
+
+    if (!add_line(pin_a, GPIO_PUD_UP, LINE_ENCODER, (uint16_t)numberofencoders, 0b10))
+        return NULL;
+    if (!add_line(pin_b, GPIO_PUD_UP, LINE_ENCODER, (uint16_t)numberofencoders, 0b01)) {
+        remove_last_line();
         return NULL;
     }
 
+    return init_encoder(pi, pin_a, pin_b, mode, resolution);
+}
+
+//
+//  Set up the next encoder structure
+//
+static struct encoder *init_encoder(int pi, int pin_a, int pin_b, int mode, int resolution)
+{
     struct encoder *newencoder = encoders + numberofencoders++;
     newencoder->pi = pi;
+    newencoder->id = (int)(newencoder - encoders);
     newencoder->pin_a = pin_a;
     newencoder->pin_b = pin_b;
     newencoder->value = 0;
-    newencoder->detents = 0;
     newencoder->lastEncoded = 0;
-    newencoder->callback = e_callback;
-    newencoder->mode = mode;
+    newencoder->rest = 0;
+    newencoder->phase = 0;
+    newencoder->carry = 0;
+    newencoder->errors = 0;
+    newencoder->mode = (mode < 1) ? 1 : mode;
+    newencoder->resolution = resolution;
 
-    pinMode(pin_a, INPUT);
-    pinMode(pin_b, INPUT);
-    pullUpDnControl(pin_a, PUD_UP);
-    pullUpDnControl(pin_b, PUD_UP);
+    return newencoder;
+}
 
-    newencoder->lastEncoded = (digitalRead(pin_a) << 1) | digitalRead(pin_b);
+//
+//
+//  Configuration function to define a relative axis of an input device
+//  The kernel driver decodes, every unit of movement is a step.
+//
+//  Parameters:
+//      device: input device path or name
+//      grab: take the device exclusively
+//      code: axis code
+//      mode: steps per detent
+//  Returns: pointer to the new encoder structure
+//           The pointer will be NULL is the function failed for any reason
+//
+//
+struct encoder *setupinputaxis(int pi, const char * device, bool grab, int code, int mode)
+{
+    if (numberofencoders >= encoder_capacity) {
+        logerr("Maximum number of encoders exceded: %i", encoder_capacity);
+        return NULL;
+    }
+    if (code < 0 || code >= REL_CNT) {
+        logerr("Invalid axis code %d", code);
+        return NULL;
+    }
+    if (!add_input(device, grab, EV_REL, code, (uint16_t)numberofencoders))
+        return NULL;
 
-    newencoder->cba_id = wiringPiISR((unsigned) pin_a, INT_EDGE_BOTH, &updateEncoders);
-    newencoder->cbb_id = wiringPiISR((unsigned) pin_b, INT_EDGE_BOTH, &updateEncoders);
+    numberofinputaxes++;
+    return init_encoder(pi, -1, -1, mode, ENCODER_RES_QUARTER);
+}
 
-    return newencoder;
+//
+//  Allocate buttons, encoders and the input device map from the registry
+//  Hot state only, line_map and the matrix are sized by the hardware.
+//
+void alloc_GPIO(const struct registry_counts * counts) {
+    button_capacity = REGISTRY_BUTTONS(counts);
+    buttons = registry_alloc(REGISTRY_HOT, button_capacity, sizeof(*buttons));
+    encoder_capacity = REGISTRY_ENCODERS(counts);
+    encoders = registry_alloc(REGISTRY_HOT, encoder_capacity, sizeof(*encoders));
+    input_capacity = counts->input_keys + counts->input_axes;
+    input_map = registry_alloc(REGISTRY_HOT, input_capacity, sizeof(*input_map));
+}
+
+//
+//  Hand an input device event to the element configured for it
+//  Hold timers due before the event run first, like for line events.
+//
+static void dispatch_input(int device, uint16_t type, uint16_t code, int32_t value, uint64_t time_ns) {
+    for (const struct input_map * map = input_map; map < input_map + numberofinputs; map++) {
+        if (map->device != device || map->type != type || map->code != code)
+            continue;
+        if (type == EV_KEY) {
+            struct button * button = buttons + map->element;
+            button_timers(button, time_ns);
+            if (value < 0)
+                cancel_press(button, time_ns);
+            else if (button->value != (value != 0))
+                updateButton(button, value != 0, time_ns);
+        } else if (value) {
+            encoder_steps(encoders + map->element, value, time_ns);
+        }
+        return;
+    }
+}
+
+//
+//  Hand a line event to the element owning the line
+//
+static void dispatch_event(const struct gpio_v2_line_event * event) {
+    if (event->offset >= MAX_LINE_OFFSET)
+        return;
+    const struct line_map * map = line_map + event->offset;
+    switch (map->type) {
+        case LINE_BUTTON:
+            button_edge(buttons + map->element, event);
+            break;
+        case LINE_ENCODER:
+            updateEncoder(encoders + map->element, map->bit, event);
+            break;
+        default:
+            break;
+    }
+}
+
+//
+//  Element deadlines
+//  Run all deadlines due at "now", then set the input thread timer to the
+//  earliest deadline left. Element counts are small, a scan is cheaper
+//  than keeping them sorted.
+//
+static void run_deadlines(uint64_t now) {
+    uint64_t next = 0;
+
+    if (matrix.req_fd >= 0) {
+        if (matrix.next_scan_ns <= now) {
+            matrix_scan(now);
+            matrix.next_scan_ns += matrix.period_ns;
+            if (matrix.next_scan_ns <= now)
+                matrix.next_scan_ns = now + matrix.period_ns;
+        }
+        next = matrix.next_scan_ns;
+    }
+
+    for (struct button *button = buttons; button < buttons + numberofbuttons; button++) {
+        button_timers(button, now);
+        if (button->deadline_ns && (!next || button->deadline_ns < next))
+            next = button->deadline_ns;
+        if (button->hold_ns && (!next || button->hold_ns < next))
+            next = button->hold_ns;
+    }
+
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    if (next) {
+        timer.it_value.tv_sec = (time_t)(next / 1000000000);
+        timer.it_value.tv_nsec = (long)(next % 1000000000);
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+static uint64_t gettime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//
+//  Input thread
+//  Events of all lines come from the one line request in kernel order,
+//  so they are dispatched exactly in the order the edges happened.
+//
+static void * input_loop(void * arg) {
+    struct gpio_v2_line_event events[GPIOCHIP_EVENT_BATCH];
+    struct epoll_event ready[INPUT_MAX_READY];
+
+    for (;;) {
+        int count = epoll_wait(epoll_fd, ready, INPUT_MAX_READY, -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            logerr("GPIO input wait failed");
+            return NULL;
+        }
+        uint64_t now = 0;
+        for (int i = 0; i < count; i++) {
+            if (ready[i].data.fd == stop_fd)
+                return NULL;
+            if (ready[i].data.fd == timer_fd) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    logerr("GPIO timer read failed");
+                now = gettime_ns();
+                continue;
+            }
+            if (evdev_ready(ready[i].data.fd))
+                continue;
+            int num_events = backend->read_events(req_fd, events, GPIOCHIP_EVENT_BATCH);
+            if (num_events < 0)
+                return NULL;
+            for (int ev = 0; ev < num_events; ev++)
+                dispatch_event(events + ev);
+        }
+        run_deadlines(now);
+        eventqueue_notify();
+    }
+    return NULL;
+}
+
+//
+//
+//  Start GPIO input
+//  Request all configured lines and start the input thread.
+//  Call once after all buttons and encoders are set up.
+//
+//
+int start_GPIO(int pi) {
+    if (numberoflines == 0 && matrix.num_rows == 0 && evdev_count() == 0)
+        return 0;
+
+    if ((numberoflines || matrix.num_rows) && pi < 0) {
+        logerr("No GPIO device for the configured GPIO lines");
+        return -1;
+    }
+
+    uint64_t levels = 0;
+    if (numberoflines) {
+        req_fd = backend->request(pi, line_offsets, line_resist, numberoflines);
+        if (req_fd < 0)
+            return -1;
+        if (backend->get_values(req_fd, numberoflines, &levels) < 0)
+            return -1;
+    }
+    if (matrix.num_rows) {
+        matrix.req_fd = backend->request_scan(pi, matrix.rows, matrix.num_rows,
+                                              matrix.cols, matrix.num_cols);
+        if (matrix.req_fd < 0)
+            return -1;
+    }
+
+    //
+    //  Encoders start from the current line levels
+    //
+    for (struct encoder *encoder = encoders; encoder < encoders + numberofencoders; encoder++) {
+        if (encoder->pin_a < 0)
+            continue;   // input axis
+        int a = (int)((levels >> line_map[encoder->pin_a].index) & 1);
+        int b = (int)((levels >> line_map[encoder->pin_b].index) & 1);
+        encoder->lastEncoded = (a << 1) | b;
+        //  encoder is expected to sit on a detent at start
+        encoder->rest = encoder->lastEncoded;
+    }
+    //  buttons start released or, if held, pressed without a press time
+    for (struct button *button = buttons; button < buttons + numberofbuttons; button++) {
+        if (button->pin < 0)
+            continue;   // matrix or input key, starts released
+        button->level = (bool)((levels >> line_map[button->pin].index) & 1);
+        button->value = button->level;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epoll_fd < 0 || stop_fd < 0 || timer_fd < 0) {
+        logerr("Could not set up GPIO input wait");
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = req_fd;
+    if (req_fd >= 0)
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, req_fd, &ev);
+    ev.data.fd = stop_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev);
+    ev.data.fd = timer_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+    if (evdev_start(epoll_fd, dispatch_input) < 0)
+        return -1;
+    //  first matrix scan right away
+    matrix.next_scan_ns = gettime_ns();
+    run_deadlines(0);
+
+    if (pthread_create(&input_thread, NULL, input_loop, NULL) != 0) {
+        logerr("Could not start GPIO input thread");
+        return -1;
+    }
+    input_running = true;
+    loginfo("GPIO input started: %d lines, %d buttons, %d encoders, %d keys, %d input devices",
+            numberoflines, numberoflinebuttons, numberofencoders - numberofinputaxes, numberofkeys,
+            evdev_count());
+    return 0;
+}
+
+//
+//  Backends by name
+//
+static const struct gpio_backend * const backends[] = {
+    &gpiochip_backend,
+    &gpiosim_backend,
+#ifdef USE_WIRINGPI
+    &gpiowpi_backend,
+#endif
+    NULL
+};
+
+const struct gpio_backend * gpio_backend_find(const char * name) {
+    if (!name)
+        name = GPIO_BACKEND_DEFAULT;
+    for (int i = 0; backends[i]; i++) {
+        if (strcasecmp(backends[i]->name, name) == 0)
+            return backends[i];
+    }
+    return NULL;
 }
 
 //
 //
 //  Init GPIO functionality
-//  Connect to the pigpiod interface.
+//  Select the backend and open its device.
 //
 //
 
-int init_GPIO() {
+int init_GPIO(const char * backend_name, const char * device) {
 	loginfo("Initializing GPIO");
-	int pi = wiringPiSetupGpio(); /* Connect to Pi. NULL means the local pigpiod*/
-	return pi;
+	const struct gpio_backend * found = gpio_backend_find(backend_name);
+	if (!found) {
+		logerr("Unknown GPIO backend %s", backend_name);
+		return -1;
+	}
+	backend = found;
+	chip_fd = backend->open(device);
+	return chip_fd;
 }
 
 void shutdown_GPIO( int pi) {
-    struct button *button = buttons;
-    struct encoder *encoder = encoders;
     loginfo("Disconnecting from gpio");
-    for (; button < buttons + numberofbuttons; button++) {
-        if ( wiringPiISRStop(button->pin) == 0 ){
-            loginfo("GPIO %d button callback cancelled.", button->pin);
-        } else {
-            loginfo("Error cancelling callback for GPIO %d.", button->pin);
-        }
-    }
-    for (; encoder < encoders + numberofencoders; encoder++) {
-        if ( wiringPiISRStop(encoder->pin_a) == 0 ) {
-             loginfo("GPIO %d encoder callback cancelled.", encoder->pin_a);
-        } else {
-             loginfo("Error cancelling callback for GPIO %d.", encoder->pin_a);
-        }
-        if ( wiringPiISRStop(encoder->pin_b) == 0 ) {
-             loginfo("GPIO %d encoder callback cancelled.", encoder->pin_b);
-        } else {
-             loginfo("Error cancelling callback for GPIO %d.", encoder->pin_b);
-        }
+    if (input_running) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) < 0)
+            logerr("Could not stop GPIO input thread");
+        pthread_join(input_thread, NULL);
+        input_running = false;
     }
+    evdev_stop();
+    if (stop_fd >= 0)
+        close(stop_fd);
+    if (timer_fd >= 0)
+        close(timer_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    if (matrix.req_fd >= 0)
+        backend->release(matrix.req_fd);
+    if (req_fd >= 0)
+        backend->release(req_fd);
+    loginfo("%d GPIO lines released.", numberoflines);
+    if (pi >= 0)
+        backend->close(pi);
 }
 
+//
+//  Number of invalid encoder transitions seen so far
+//
+uint32_t encoder_errors(const struct encoder * encoder) {
+    return __atomic_load_n(&encoder->errors, __ATOMIC_RELAXED);
+}
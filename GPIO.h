@@ -36,17 +36,35 @@
 #define GPIO_h
 
 #include "sbpd.h"
+#include "gpiochip.h"
+#include "eventqueue.h"
+#include "registry.h"
 #include "time.h"
 
 
 //
 //
 //  Init GPIO functionality
-//  Connect to the pigpiod interface.
+//  Select the GPIO backend and open its device.
+//
+//  Parameters:
+//      backend_name: "chardev", "sim" or "wiringpi", NULL for GPIO_BACKEND_DEFAULT
+//      device: GPIO device path, NULL for the backend default (GPIOCHIP_DEFAULT).
+//              For the simulation the script or FIFO to read line changes from
+//  Returns: device handle, passed as "pi" to the setup functions
+//           negative on error
 //
 //
 
-int init_GPIO();
+int init_GPIO(const char * backend_name, const char * device);
+
+//
+//  Start GPIO input
+//  Requests all lines of the configured buttons and encoders and starts
+//  the input thread. Call once after all elements are set up.
+//  Returns: 0 on success, negative on error
+//
+int start_GPIO(int pi);
 
 void shutdown_GPIO( int pi );
 //
@@ -55,10 +73,21 @@ void shutdown_GPIO( int pi );
 // http://theatticlight.net/posts/Reading-a-Rotary-Encoder-from-a-Raspberry-Pi/
 //
 
-//17 pins / 2 pins per encoder = 8 maximum encoders
-#define max_encoders 8
-//17 pins / 1 pins per button = 17 maximum buttons
-#define max_buttons 17
+//
+//  Buttons, keys and encoders are allocated from the registry, the
+//  number of GPIO lines is limited by the line request (GPIO_V2_LINES_MAX)
+//
+//keys of a key matrix, up to 8 rows x 8 columns
+#define MATRIX_MAX_ROWS 8
+#define MATRIX_MAX_COLS 8
+#define MATRIX_MAX_SCAN_RATE 1000
+#define MATRIX_SCAN_RATE 100
+
+//
+//  Allocate the buttons and encoders of the configuration from the
+//  registry, see registry_alloc()
+//
+void alloc_GPIO(const struct registry_counts * counts);
 
 struct button;
 
@@ -66,21 +95,45 @@ struct button;
 #define LONGPRESS 1
 
 //
-//  A callback executed when a button gets triggered. Button struct and change returned.
-//  Note: change might be "0" indicating no change, this happens when buttons chatter
-//  Value in struct already updated.
+//  Button debounce algorithms, see button_settled() in GPIO.c
 //
-typedef void (*button_callback_t)(const struct button * button, int change, bool presstype);
+#define DEBOUNCE_INTEGRATOR 0
+#define DEBOUNCE_LOCKOUT    1
+#define DEBOUNCE_DEFAULT_TIME 20
 
+//
+//  Shortest auto-repeat interval in ms
+//
+#define BUTTON_MIN_REPEAT_RATE 20
+
+//
+//  Presses are reported as EVENT_SHORTPRESS or EVENT_LONGPRESS input events,
+//  see eventqueue.h. The element id of the event is the button id.
+//  Short presses are reported on release, long presses as soon as the
+//  button is held for long_press_time.
+//  Repeating buttons report EVENT_SHORTPRESS on press and EVENT_REPEAT
+//  while held, they have no long press.
+//  Every press is also reported as EVENT_BUTTON_DOWN when it starts and
+//  EVENT_BUTTON_UP when it ends.
+//
 struct button {
     int pi;
+    int id;
     int pin;
-    volatile bool value;
-    button_callback_t callback;
+    volatile bool value;    // debounced level
     uint32_t timepressed;
     bool pressed;
     int long_press_time;
-    int cb_id;
+    int debounce;           // DEBOUNCE_
+    int debounce_time;      // settle time in ms
+    bool level;             // line level of the last edge
+    uint64_t level_ns;      // time of the last edge
+    uint64_t integral_ns;   // integrator: time counted towards a change
+    uint64_t deadline_ns;   // next debounce decision, 0 if none
+    int repeat_delay;       // ms held before the first repeat, 0 for no repeat
+    int repeat_rate;        // ms between repeats
+    bool held;              // long press reported for this press
+    uint64_t hold_ns;       // next long press or repeat, 0 if none
 };
 
 //
@@ -91,41 +144,111 @@ struct button {
 //
 //  Parameters:
 //      pin: GPIO-Pin used in BCM numbering scheme
-//      callback: callback function to be called when button state changed
-//      edge: edge to be used for trigger events,
-//            one of INT_EDGE_RISING, INT_EDGE_FALLING or INT_EDGE_BOTH (the default)
+//      resist: line bias, one of GPIO_PUD_OFF, GPIO_PUD_DOWN or GPIO_PUD_UP
+//      debounce: DEBOUNCE_INTEGRATOR or DEBOUNCE_LOCKOUT
+//      debounce_time: settle time in ms, 0 takes every edge
+//      repeat_delay: ms held before auto-repeat starts, 0 for no auto-repeat
+//      repeat_rate: ms between repeats
 //  Returns: pointer to the new button structure
 //           The pointer will be NULL is the function failed for any reason
+//           Button ids are assigned in setup order, starting at 0
 //
 //
 struct button *setupbutton(int pi,
                            int pin,
-                           button_callback_t b_callback,
                            int resist,
                            bool pressed,
-                           int long_press_time);
+                           int long_press_time,
+                           int debounce,
+                           int debounce_time,
+                           int repeat_delay,
+                           int repeat_rate);
 
-struct encoder;
+//
+//
+//  Configuration function to define a key matrix
+//  Rows are driven low one at a time by a scan in the input thread,
+//  columns are read with pull-up. Wire a diode per key to avoid ghost keys,
+//  without them ambiguous key combinations are ignored.
+//
+//  Parameters:
+//      rows, cols: GPIO-Pins of the rows and columns in BCM numbering scheme
+//      scan_rate: scans per second, e.g. MATRIX_SCAN_RATE
+//      debounce_time: ms a key needs to read a new state, rounded up to whole scans
+//  Returns: 0 on success, -1 on error
+//
+//
+int setupmatrix(int pi,
+                const int * rows,
+                int num_rows,
+                const int * cols,
+                int num_cols,
+                int scan_rate,
+                int debounce_time);
+
+//
+//
+//  Configuration function to define a key of the key matrix
+//  Keys are buttons without a GPIO line, pin is -1. They report the
+//  same events as buttons and share the button ids.
+//
+//  Parameters:
+//      row, col: position in the matrix, starting at 0
+//  Returns: pointer to the new button structure
+//           The pointer will be NULL is the function failed for any reason
+//
+//
+struct button *setupkey(int pi,
+                        int row,
+                        int col,
+                        int long_press_time,
+                        int repeat_delay,
+                        int repeat_rate);
 
 //
-//  A callback executed when a rotary encoder changes it's value.
-//  Encoder struct and change returned.
-//  Value in struct already updated.
 //
-typedef void (*rotaryencoder_callback_t)(const struct encoder * encoder, long change);
+//  Configuration function to define a key of an input device
+//  Input keys are buttons without a GPIO line, pin is -1. They report the
+//  same events as buttons and share the button ids. The kernel driver
+//  debounces them.
+//
+//  Parameters:
+//      device: input device path or name, see evdev.h
+//      grab: take the device exclusively
+//      code: key code, KEY_ or BTN_ of linux/input-event-codes.h
+//  Returns: pointer to the new button structure
+//           The pointer will be NULL is the function failed for any reason
+//
+//
+struct button *setupinputkey(int pi,
+                             const char * device,
+                             bool grab,
+                             int code,
+                             int long_press_time,
+                             int repeat_delay,
+                             int repeat_rate);
 
+struct encoder;
+
+//
+//  Rotation is reported as EVENT_ENCODER input events, see eventqueue.h.
+//  The delta counts detents of "mode" steps each, in step mode (1) that
+//  is every step. The element id of the event is the encoder id.
+//
 struct encoder
 {
     int pi;
+    int id;
     int pin_a;
     int pin_b;
-    volatile long value;
-    volatile long detents;
-    volatile int lastEncoded;
-    rotaryencoder_callback_t callback;
-    int mode;
-    int cba_id;
-    int cbb_id;
+    long value;         // steps counted so far
+    int lastEncoded;    // line state, (pin_a << 1) | pin_b
+    int rest;           // line state at rest (on a detent)
+    int phase;          // quarter steps not yet counted as a step
+    int carry;          // steps not yet counted as a detent
+    uint32_t errors;    // invalid transitions, see encoder_errors()
+    int mode;           // steps per detent
+    int resolution;     // ENCODER_RES_
 };
 
 //
@@ -136,20 +259,56 @@ struct encoder
 //
 //  Parameters:
 //      pin_a, pin_b: GPIO-Pins used in BCM numbering scheme
-//      callback: callback function to be called when encoder state changed
-//      mode: operate in ENCODER_MODE_DETENT or , ENCODER_MODE_STEP
+//      mode: steps per detent, 1 (ENCODER_MODE_STEP) reports every step
+//      resolution: which transitions count as a step, one of
+//          ENCODER_RES_QUARTER - every transition, 4 steps per quadrature cycle
+//          ENCODER_RES_HALF    - 2 steps per quadrature cycle
+//          ENCODER_RES_FULL    - 1 step per quadrature cycle
 //
 //  Returns: pointer to the new encoder structure
 //           The pointer will be NULL is the function failed for any reason
+//           Encoder ids are assigned in setup order, starting at 0
 //
 //
 struct encoder *setupencoder(int pi,
                              int pin_a,
                              int pin_b,
-                             rotaryencoder_callback_t callback,
-                             int mode);
+                             int mode,
+                             int resolution);
+
+//
+//
+//  Configuration function to define a relative axis of an input device
+//  as encoder, e.g. of the rotary-encoder driver. Input axes are encoders
+//  without GPIO lines, pin_a and pin_b are -1. Every unit of movement
+//  counts as a step.
+//
+//  Parameters:
+//      device: input device path or name, see evdev.h
+//      grab: take the device exclusively
+//      code: axis code, REL_ of linux/input-event-codes.h
+//      mode: steps per detent
+//  Returns: pointer to the new encoder structure
+//           The pointer will be NULL is the function failed for any reason
+//
+//
+struct encoder *setupinputaxis(int pi,
+                               const char * device,
+                               bool grab,
+                               int code,
+                               int mode);
+
+//
+//  Number of invalid transitions (both lines changed at once) seen so far
+//  A growing count means the encoder is turned faster than edges are seen.
+//
+uint32_t encoder_errors(const struct encoder * encoder);
 
 #define ENCODER_MODE_DETENT 0
 #define ENCODER_MODE_STEP   1
 
+#define ENCODER_RES_QUARTER 0
+#define ENCODER_RES_HALF    1
+#define ENCODER_RES_FULL    2
+
 #endif /* GPIO_h */
@@ -39,19 +39,43 @@
 #include "sbpd.h"
 #include "control.h"
 #include "servercomm.h"
-#include <wiringPi.h>
+#include "playerstate.h"
+#include "serverset.h"
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
+#include <math.h>
+#include <linux/input.h>
 #include "uinput.h"
 //
-//  Pre-allocate encoder and button objects on the stack so we don't have to
-//  worry about freeing them
+//  Encoder, button and chord objects are allocated from the registry,
+//  their names are cold and kept apart, see alloc_control()
 //
-static struct button_ctrl button_ctrls[max_buttons];
-static struct encoder_ctrl encoder_ctrls[max_encoders];
+static struct button_ctrl * button_ctrls = NULL;
+static struct encoder_ctrl * encoder_ctrls = NULL;
+static struct chord_ctrl * chord_ctrls = NULL;
+static char * button_names = NULL;
+static char * encoder_names = NULL;
+static char * chord_names = NULL;
+static int button_capacity = 0;
+static int encoder_capacity = 0;
+static int chord_capacity = 0;
 static int numberofbuttons = 0;
 static int numberofencoders = 0;
+static int numberofchords = 0;
+//  server commands go to, for commands sent from completion handlers
+static struct sbpd_server * control_server = NULL;
+
+//
+//  Tags of queued commands: element kind in the high bits, id in the low bits
+//  Absolute volume commands of encoders are flagged with TAG_SETPOINT.
+//
+#define TAG_BUTTON      0x10000u
+#define TAG_CHORD       0x20000u
+#define TAG_ENCODER     0x30000u
+#define TAG_SETPOINT    0x8000u
+#define TAG_KIND(tag)   ((tag) & 0xff0000u)
+#define TAG_ID(tag)     ((int)((tag) & 0x7fffu))
 
 //
 // Keyboard command controls
@@ -96,21 +120,43 @@ static void send_key_seq( int key, int repeat){
 //  Encoder
 //
 #define FRAGMENT_VOLUME         "[\"mixer\",\"volume\",\"%s%d\"]"
+#define FRAGMENT_VOLUME_ABS     "[\"mixer\",\"volume\",\"%d\"]"
 #define FRAGMENT_TRACK          "[\"playlist\",\"jump\",\"%s%d\"]"
 
 //
 //  LMS Command structure
 //
-static struct lms_command lms_commands[MAX_COMMANDS];
+static struct lms_command * lms_commands = NULL;
+static int command_capacity = 0;
 static int numberofcommands = 0;
 
+//
+//  Allocate the control objects from the registry
+//  Commands and names are cold, only used on setup and when sending.
+//
+void alloc_control(const struct registry_counts * counts) {
+    button_capacity = REGISTRY_BUTTONS(counts);
+    button_ctrls = registry_alloc(REGISTRY_HOT, button_capacity, sizeof(*button_ctrls));
+    encoder_capacity = REGISTRY_ENCODERS(counts);
+    encoder_ctrls = registry_alloc(REGISTRY_HOT, encoder_capacity, sizeof(*encoder_ctrls));
+    chord_capacity = counts->chords;
+    chord_ctrls = registry_alloc(REGISTRY_HOT, chord_capacity, sizeof(*chord_ctrls));
+
+    button_names = registry_alloc(REGISTRY_COLD, button_capacity, CTRL_NAME_LEN);
+    encoder_names = registry_alloc(REGISTRY_COLD, encoder_capacity, CTRL_NAME_LEN);
+    chord_names = registry_alloc(REGISTRY_COLD, chord_capacity, CTRL_NAME_LEN);
+    command_capacity = counts->commands;
+    lms_commands = registry_alloc(REGISTRY_COLD, command_capacity, sizeof(*lms_commands));
+}
+
 int add_lms_command_frament ( char * name, char * value ) {
+    if (numberofcommands >= command_capacity)
+        return 1;
     loginfo("Adding Command %s: Fragment %s", name, value);
     lms_commands[numberofcommands].code = STRTOU32(name);
-    strncpy (lms_commands[numberofcommands].fragment, value, MAXLEN);
+    snprintf(lms_commands[numberofcommands].fragment, MAXLEN, "%s", value);
+    comm_register(lms_commands[numberofcommands].fragment);
     numberofcommands ++;
-    if (numberofcommands > MAX_COMMANDS )
-        return 1;
     return 0;
 }
 
@@ -122,21 +168,6 @@ char * get_lms_command_fragment ( int code ) {
     return NULL;
 }
 
-//
-//  Button press callback
-//  Sets the flag for "button pressed"
-//
-void button_press_cb(const struct button * button, int change, bool presstype) {
-    for (int cnt = 0; cnt < numberofbuttons; cnt++) {
-        if (button == button_ctrls[cnt].gpio_button) {
-            button_ctrls[cnt].presstype = presstype;
-            button_ctrls[cnt].waiting = true;
-            loginfo("Button CB set for button #:%d, gpio pin %d", cnt, button_ctrls[cnt].gpio_button->pin);
-            return;
-        }
-    }
-}
-
 //
 //  Setup button control
 //  Parameters:
@@ -158,99 +189,386 @@ void button_press_cb(const struct button * button, int change, bool presstype) {
 //          1 - state is 1
 //      cmd_long Command to be used for a long button push, see above command list
 //      long_time: Number of milliseconds to define a long press
+//      options: optional settings
+//          debounce=[integrator:|lockout:]ms - debounce algorithm and settle time
+//          repeat=delay[/rate] - send the command on press and repeat it every
+//                  rate ms (default 100) once held for delay ms
+//          dbl=CMD, tpl=CMD - commands for double and triple clicks
+//          click=ms - click window, max ms from a release to the next press
 
-int setup_button_ctrl(int pi, char * cmd, int pin, int resist, int pressed, char * cmd_long, int long_time) {
-    char * fragment = NULL;
-    char * fragment_long = NULL;
-    char * script;
-    char * script_long;
-    int key_code = -1;
-    int key_code_long = -1;
+//
+//  Select type and fragment of a button command
+//  Returns: the command type, NOTUSED for an unknown command,
+//           -1 if the key of a KEY: command is not found
+//
+static int button_command(char * cmd, char ** fragment, int * key_code) {
     char * separator = ":";
-	char * tmp;
-    int cmdtype;
-    int cmd_longtype = NOTUSED;
+    char * tmp;
 
-    //
-    //  Select fragment for short press parameter
-    //
+    *fragment = NULL;
+    *key_code = -1;
     if (strlen(cmd) == 4) {
-        fragment = get_lms_command_fragment(STRTOU32(cmd));
-        cmdtype = LMS;
+        *fragment = get_lms_command_fragment(STRTOU32(cmd));
+        return (*fragment) ? LMS : NOTUSED;
     } else if (strncmp("SCRIPT:", cmd, 7) == 0) {
-        cmdtype = SCRIPT;
         strtok( cmd, separator );
-        script = strtok( NULL, "" );
-        fragment = script;
+        *fragment = strtok( NULL, "" );
+        return (*fragment) ? SCRIPT : NOTUSED;
     } else if (strncmp("KEY:", cmd, 4) == 0) {
         keyboard_inuse = true;
-        cmdtype = KEYBOARD;
         strtok( cmd, separator );
         tmp = strtok( NULL, "" );
-		key_code = find_key(tmp);
-		if (key_code <= 0 ){
+		*key_code = (tmp) ? find_key(tmp) : -1;
+		if (*key_code <= 0 ){
 			logerr("Key %s not found in keytable", tmp);
 			return -1;
 		}
-		loginfo("Key %s:%d", tmp, key_code);
-        fragment = tmp;  //just assign the string for now, we aren't actually using it later
+		loginfo("Key %s:%d", tmp, *key_code);
+        *fragment = tmp;  //just assign the string for now, we aren't actually using it later
+        return KEYBOARD;
+    }
+    return NOTUSED;
+}
+
+//
+//  Where the presses of a button control come from:
+//  a GPIO line, a key of the key matrix or a key of an input device
+//
+struct press_source {
+    int pin;                // GPIO, -1 for keys
+    int resist;
+    int pressed;
+    int row, col;           // matrix key, row -1 for none
+    const char * device;    // input device, NULL for none
+    bool grab;
+    int code;               // input key code
+    const char * code_name; // input key code as given, for logs
+};
+
+static int setup_press_ctrl(int pi, char * cmd, const struct press_source * source,
+                            char * cmd_long, int long_time, const struct element_options * options);
+
+//
+//  Where the rotation of an encoder control comes from:
+//  two GPIO lines or a relative axis of an input device
+//
+struct turn_source {
+    int pin1, pin2;         // GPIOs, -1 for an input axis
+    const char * device;    // input device, NULL for none
+    bool grab;
+    int code;               // input axis code
+    const char * code_name; // input axis code as given, for logs
+};
+
+static int setup_turn_ctrl(int pi, char * cmd, const struct turn_source * source, int mode,
+                           const struct element_options * options);
+
+int setup_button_ctrl(int pi, char * cmd, int pin, int resist, int pressed, char * cmd_long, int long_time,
+                      const struct element_options * options) {
+    struct press_source source = { .pin = pin, .resist = resist, .pressed = pressed, .row = -1 };
+    return setup_press_ctrl(pi, cmd, &source, cmd_long, long_time, options);
+}
+
+//
+//  Setup key control
+//  Parameters as for setup_button_ctrl, row and col give the key position
+//  in the key matrix. Keys have no debounce setting.
+//
+int setup_key_ctrl(int pi, char * cmd, int row, int col, char * cmd_long, int long_time,
+                   const struct element_options * options) {
+    struct press_source source = { .pin = -1, .resist = GPIO_PUD_UP, .pressed = 1, .row = row, .col = col };
+    return setup_press_ctrl(pi, cmd, &source, cmd_long, long_time, options);
+}
+
+//
+//  Input event codes by name
+//  Key codes are looked up in the keyboard key table, the generic button
+//  and relative axis codes are listed here. Codes can also be given as numbers.
+//
+static const key_events_s button_codes[] = {
+    { "BTN_0", BTN_0 }, { "BTN_1", BTN_1 }, { "BTN_2", BTN_2 }, { "BTN_3", BTN_3 },
+    { "BTN_4", BTN_4 }, { "BTN_5", BTN_5 }, { "BTN_6", BTN_6 }, { "BTN_7", BTN_7 },
+    { "BTN_8", BTN_8 }, { "BTN_9", BTN_9 },
+    { "BTN_LEFT", BTN_LEFT }, { "BTN_RIGHT", BTN_RIGHT }, { "BTN_MIDDLE", BTN_MIDDLE },
+    { "", -1 }
+};
+static const key_events_s axis_codes[] = {
+    { "REL_X", REL_X }, { "REL_Y", REL_Y }, { "REL_Z", REL_Z },
+    { "REL_RX", REL_RX }, { "REL_RY", REL_RY }, { "REL_RZ", REL_RZ },
+    { "REL_HWHEEL", REL_HWHEEL }, { "REL_DIAL", REL_DIAL },
+    { "REL_WHEEL", REL_WHEEL }, { "REL_MISC", REL_MISC },
+    { "", -1 }
+};
+
+static int find_code(const key_events_s * codes, const char * name) {
+    while (codes->code >= 0 && strcasecmp(codes->name, name) != 0)
+        codes++;
+    return codes->code;
+}
+
+//
+//  Get the event type and code of a code name
+//  Returns: the code, -1 if the name is unknown
+//
+static int input_code(const char * name, int * type) {
+    *type = EV_REL;
+    if (strncasecmp(name, "REL_", 4) == 0)
+        return find_code(axis_codes, name);
+    *type = EV_KEY;
+    if (strncasecmp(name, "BTN_", 4) == 0)
+        return find_code(button_codes, name);
+    if (strncasecmp(name, "KEY_", 4) == 0) {
+        int code = find_key(name);
+        return (code > 0) ? code : -1;
     }
+    char * end;
+    int code = (int)strtol(name, &end, 0);
+    return (end != name && *end == '\0' && code > 0) ? code : -1;
+}
 
-    if (!fragment){
+//
+//  Setup input device control
+//  Parameters:
+//      device: device path or name
+//      code: key or axis code
+//      cmd: command, like for buttons for keys, like for encoders for axes
+//      arg1, arg2: keys: cmd_long, long_time, axes: mode
+//      options: optional settings
+//          grab=1 - take the device exclusively
+//          button settings except debounce for keys, encoder settings for axes
+//
+int setup_input_ctrl(int pi, char * device, char * code, char * cmd, char * arg1, char * arg2,
+                     const struct element_options * options) {
+    int type;
+    int value = input_code(code, &type);
+    if (value < 0) {
+        logerr("Unknown input event code %s", code);
+        return -1;
+    }
+    char * setting = element_option(options, "grab");
+    bool grab = (setting != NULL && strcmp(setting, "0") != 0);
+
+    if (type == EV_REL) {
+        struct turn_source source = { .pin1 = -1, .pin2 = -1, .device = device, .grab = grab,
+                                      .code = value, .code_name = code };
+        if (arg2 != NULL)
+            logerr("Ignoring extra field %s", arg2);
+        return setup_turn_ctrl(pi, cmd, &source, arg1 ? (int)strtol(arg1, NULL, 10) : 1, options);
+    }
+    struct press_source source = { .pin = -1, .resist = GPIO_PUD_UP, .pressed = 1, .row = -1,
+                                   .device = device, .grab = grab, .code = value, .code_name = code };
+    return setup_press_ctrl(pi, cmd, &source, arg1, arg2 ? (int)strtol(arg2, NULL, 10) : 3000, options);
+}
+
+//
+//  Setup key matrix
+//  Parameters:
+//      rows, cols: GPIO-Pin-Numbers separated by "+", e.g. 5+6+13
+//      options: optional settings
+//          scan=hz - scans per second
+//          debounce=ms - time a key needs to read a new state
+//
+int setup_matrix_ctrl(int pi, char * rows, char * cols, const struct element_options * options) {
+    int row_pins[MATRIX_MAX_ROWS];
+    int col_pins[MATRIX_MAX_COLS];
+    int num_rows = 0, num_cols = 0;
+
+    for (char * pin = strtok(rows, "+"); pin; pin = strtok(NULL, "+")) {
+        if (num_rows == MATRIX_MAX_ROWS) {
+            logerr("Key matrix: more than %d rows", MATRIX_MAX_ROWS);
+            return -1;
+        }
+        row_pins[num_rows++] = (int)strtol(pin, NULL, 10);
+    }
+    for (char * pin = strtok(cols, "+"); pin; pin = strtok(NULL, "+")) {
+        if (num_cols == MATRIX_MAX_COLS) {
+            logerr("Key matrix: more than %d columns", MATRIX_MAX_COLS);
+            return -1;
+        }
+        col_pins[num_cols++] = (int)strtol(pin, NULL, 10);
+    }
+
+    int scan_rate = MATRIX_SCAN_RATE;
+    char * setting = element_option(options, "scan");
+    if ( setting != NULL )
+        scan_rate = (int)strtol(setting, NULL, 10);
+    int debounce_time = DEBOUNCE_DEFAULT_TIME;
+    setting = element_option(options, "debounce");
+    if ( setting != NULL )
+        debounce_time = (int)strtol(setting, NULL, 10);
+
+    if (setupmatrix(pi, row_pins, num_rows, col_pins, num_cols, scan_rate, debounce_time) < 0)
+        return -1;
+    loginfo("Key matrix defined: %d rows, %d columns, Scan rate: %i/s, Debounce: %i ms",
+            num_rows, num_cols, scan_rate, debounce_time);
+    return 0;
+}
+
+static int setup_press_ctrl(int pi, char * cmd, const struct press_source * source,
+                            char * cmd_long, int long_time, const struct element_options * options) {
+    if (numberofbuttons >= button_capacity) {
+        logerr("Maximum number of buttons exceded: %i", button_capacity);
+        return -1;
+    }
+    int resist = source->resist;
+    char * fragment = NULL;
+    char * fragment_long = NULL;
+    int key_code = -1;
+    int key_code_long = -1;
+    int cmdtype;
+    int cmd_longtype = NOTUSED;
+
+    //
+    //  Select fragment for short press parameter
+    //
+    cmdtype = button_command(cmd, &fragment, &key_code);
+    if (cmdtype < 0)
+        return -1;
+    if (cmdtype == NOTUSED){
         logerr("Command %s, not found in defined commands", cmd);
         return -1;
     }
-    
+
     //
     //  Select fragment for long press parameter
     //
-    if ( cmd_long == NULL ) {
-        cmd_longtype = NOTUSED;
-    } else if ( strlen(cmd_long) == 4 ) {
-        fragment_long = get_lms_command_fragment(STRTOU32(cmd_long));
-        cmd_longtype = LMS;
-    } else if (strncmp("SCRIPT:", cmd_long, 7) == 0) {
-        cmd_longtype = SCRIPT;
-        strtok( cmd_long, separator );
-        script_long = strtok( NULL, "" );
-        fragment_long = script_long;
-    } else if (strncmp("KEY:", cmd_long, 4) == 0) {
-        keyboard_inuse = true;
-        cmd_longtype = KEYBOARD;
-        strtok( cmd_long, separator );
-        tmp = strtok( NULL, "" );
-		key_code_long = find_key(tmp);
-		if (key_code_long <= 0 ){
-			logerr("Key %s not found in keytable", tmp);
-			return -1;
-		}
-        fragment_long = tmp;
+    if ( cmd_long != NULL ) {
+        cmd_longtype = button_command(cmd_long, &fragment_long, &key_code_long);
+        if (cmd_longtype < 0)
+            return -1;
+        if (cmd_longtype == NOTUSED)
+            loginfo("Command %s, not found in defined commands", cmd_long);
     }
 
-    if ( (cmd_long != NULL) & (!fragment_long) ){
-        loginfo("Command %s, not found in defined commands", cmd_long);
-        cmd_longtype = NOTUSED;
+    //
+    //  Multi-click commands
+    //
+    struct button_ctrl * ctrl = button_ctrls + numberofbuttons;
+    ctrl->name = button_names + numberofbuttons * CTRL_NAME_LEN;
+    if ( source->device )
+        snprintf(ctrl->name, CTRL_NAME_LEN, "%.16s %.30s", source->code_name, source->device);
+    else if ( source->row >= 0 )
+        snprintf(ctrl->name, CTRL_NAME_LEN, "Key %d,%d", source->row, source->col);
+    else
+        snprintf(ctrl->name, CTRL_NAME_LEN, "Pin %d", source->pin);
+    char * click_setting[GESTURE_MAX_CLICKS - 1] = {
+        element_option(options, "dbl"),
+        element_option(options, "tpl")
+    };
+    int max_clicks = 1;
+    for (int i = 0; i < GESTURE_MAX_CLICKS - 1; i++) {
+        ctrl->click_type[i] = NOTUSED;
+        ctrl->click_fragment[i] = NULL;
+        ctrl->click_key[i] = -1;
+        if (click_setting[i] == NULL)
+            continue;
+        ctrl->click_type[i] = button_command(click_setting[i], ctrl->click_fragment + i, ctrl->click_key + i);
+        if (ctrl->click_type[i] < 0)
+            return -1;
+        if (ctrl->click_type[i] == NOTUSED) {
+            logerr("Command %s, not found in defined commands", click_setting[i]);
+            return -1;
+        }
+        max_clicks = i + 2;
     }
-   
+    ctrl->click_window = GESTURE_CLICK_WINDOW;
+    char * window = element_option(options, "click");
+    if ( window != NULL ) {
+        char * end;
+        ctrl->click_window = (int)strtol(window, &end, 10);
+        if ( *end || ctrl->click_window <= 0 ) {
+            logerr("Bad click window %s", window);
+            return -1;
+        }
+    }
+
     // Make sure resistor setting makes sense, or reset to default
-    if ( (resist != PUD_OFF) && (resist != PUD_DOWN) && (resist == PUD_UP) )
-        resist = PUD_UP;
+    if ( (resist != GPIO_PUD_OFF) && (resist != GPIO_PUD_DOWN) && (resist == GPIO_PUD_UP) )
+        resist = GPIO_PUD_UP;
+
+    int debounce = DEBOUNCE_INTEGRATOR;
+    int debounce_time = DEBOUNCE_DEFAULT_TIME;
+    char * setting = element_option(options, "debounce");
+    if ( setting != NULL && source->pin < 0 ) {
+        logerr("%s is debounced by the %s, ignoring debounce=%s", ctrl->name,
+               source->device ? "input driver" : "key matrix", setting);
+    } else if ( setting != NULL ) {
+        char * time = strchr(setting, ':');
+        if ( time != NULL ) {
+            if ( strncasecmp(setting, "lockout:", 8) == 0 )
+                debounce = DEBOUNCE_LOCKOUT;
+            else if ( strncasecmp(setting, "integrator:", 11) != 0 ) {
+                logerr("Bad debounce algorithm %s", setting);
+                return -1;
+            }
+            time++;
+        } else {
+            time = setting;
+        }
+        char * end;
+        debounce_time = (int)strtol(time, &end, 10);
+        if ( end == time || *end || debounce_time < 0 ) {
+            logerr("Bad debounce time %s", setting);
+            return -1;
+        }
+    }
 
-    struct button * gpio_b = setupbutton(pi, pin, button_press_cb, resist, (bool)(pressed == 0) ? 0 : 1, long_time);
+    int repeat_delay = 0;
+    int repeat_rate = BUTTON_REPEAT_RATE;
+    setting = element_option(options, "repeat");
+    if ( setting != NULL ) {
+        char * end;
+        repeat_delay = (int)strtol(setting, &end, 10);
+        if ( *end == '/' )
+            repeat_rate = (int)strtol(end + 1, &end, 10);
+        if ( *end || repeat_delay <= 0 || repeat_rate < BUTTON_MIN_REPEAT_RATE ) {
+            logerr("Bad button repeat %s", setting);
+            return -1;
+        }
+        if ( cmd_longtype != NOTUSED ) {
+            logerr("Repeating button %s has no long press, ignoring %s", ctrl->name, cmd_long);
+            cmd_longtype = NOTUSED;
+            fragment_long = NULL;
+        }
+        if ( max_clicks > 1 ) {
+            logerr("Repeating button %s has no multi-click", ctrl->name);
+            max_clicks = 1;
+        }
+    }
 
+    struct button * gpio_b;
+    if ( source->device )
+        gpio_b = setupinputkey(pi, source->device, source->grab, source->code, long_time,
+                               repeat_delay, repeat_rate);
+    else if ( source->row >= 0 )
+        gpio_b = setupkey(pi, source->row, source->col, long_time, repeat_delay, repeat_rate);
+    else
+        gpio_b = setupbutton(pi, source->pin, resist, (bool)(source->pressed == 0) ? 0 : 1, long_time,
+                             debounce, debounce_time, repeat_delay, repeat_rate);
+    if (!gpio_b)
+        return -1;
+
+    //  Button ids are assigned in setup order, so the id indexes button_ctrls
     button_ctrls[numberofbuttons].cmdtype = cmdtype;
     button_ctrls[numberofbuttons].shortfragment = fragment;
     button_ctrls[numberofbuttons].cmd_longtype = cmd_longtype;
     button_ctrls[numberofbuttons].longfragment = fragment_long;
-    button_ctrls[numberofbuttons].waiting = false;
     button_ctrls[numberofbuttons].gpio_button = gpio_b;
 	button_ctrls[numberofbuttons].key_code = key_code;
 	button_ctrls[numberofbuttons].key_code_long = key_code_long;
+    button_ctrls[numberofbuttons].max_clicks = max_clicks;
+    button_ctrls[numberofbuttons].clicks = 0;
+    button_ctrls[numberofbuttons].click_deadline_ns = 0;
+    button_ctrls[numberofbuttons].chords = 0;
+    button_ctrls[numberofbuttons].down = false;
+    button_ctrls[numberofbuttons].suppressed = false;
+    button_ctrls[numberofbuttons].deferred = false;
     numberofbuttons++;
-    loginfo("Button defined: Pin %d, BCM Resistor: %s, Short Type: %s, Short Fragment: %s , Long Type: %s, Long Fragment: %s, Long Press Time: %i",
-            pin,
-            (resist == PUD_OFF) ? "both" :
-            (resist == PUD_DOWN) ? "down" : "up",
+    loginfo("Button defined: %s, BCM Resistor: %s, Short Type: %s, Short Fragment: %s , Long Type: %s, Long Fragment: %s, Long Press Time: %i, Debounce: %s %i ms, Repeat: %i/%i ms, Clicks: %i",
+            ctrl->name,
+            (source->pin < 0) ? "none" :
+            (resist == GPIO_PUD_OFF) ? "both" :
+            (resist == GPIO_PUD_DOWN) ? "down" : "up",
             (cmdtype == LMS) ? "LMS" :
             (cmdtype == SCRIPT) ? "Script" :
             (cmdtype == KEYBOARD) ? "Keyboard" : "unused",
@@ -259,49 +577,465 @@ int setup_button_ctrl(int pi, char * cmd, int pin, int resist, int pressed, char
             (cmd_longtype == SCRIPT) ? "Script" :
             (cmd_longtype == KEYBOARD) ? "Keyboard" : "unused",
             fragment_long,
-            long_time);
+            long_time,
+            source->device ? "driver" : (source->row >= 0) ? "matrix" :
+            (debounce == DEBOUNCE_LOCKOUT) ? "lockout" : "integrator",
+            (source->pin < 0) ? 0 : debounce_time,
+            repeat_delay, repeat_rate,
+            max_clicks);
     return 0;
 }
 
 //
-//  Polling function: handle button commands
+//  Send a button command
+//  LMS and script commands are queued for the network worker,
+//  tag tells command_done() where they came from.
+//
+static void button_action(struct sbpd_server * server, uint32_t tag, int type, char * fragment,
+                          int key_code) {
+	if (type == KEYBOARD) {
+		send_key_seq( key_code, 1 );
+	} else if ( type != NOTUSED && fragment != NULL ) {
+		if (!queue_command(server, type, fragment, tag, 0))
+			logwarn("Command not sent: %s", fragment);
+	}
+}
+
+//
+//  Handle a button press event
 //  Parameters:
 //      server: the server to send commands to
+//      cnt: the button id
+//      presstype: SHORTPRESS or LONGPRESS
+//
+static void handle_button(struct sbpd_server * server, int cnt, bool presstype) {
+	loginfo("Button pressed: %s, Press Type:%s", button_ctrls[cnt].name,
+			(presstype == LONGPRESS) ? "Long" : "Short" );
+	if ( presstype == SHORTPRESS ) {
+		button_action(server, TAG_BUTTON | cnt, button_ctrls[cnt].cmdtype,
+		              button_ctrls[cnt].shortfragment, button_ctrls[cnt].key_code);
+	}
+	if ( presstype == LONGPRESS ) {
+		if ( button_ctrls[cnt].cmd_longtype != NOTUSED ) {
+			button_action(server, TAG_BUTTON | cnt, button_ctrls[cnt].cmd_longtype,
+			              button_ctrls[cnt].longfragment, button_ctrls[cnt].key_code_long);
+		} else {
+			logdebug("No Long Press command configured");
+		}
+	}
+}
+
+//
+//  Gesture recognizer
+//  Short presses of buttons with multi-click commands are counted. The
+//  clicks are committed when the click window after a release passes
+//  without a new press, when the highest configured click count is
+//  reached or when a long press follows. Buttons without multi-click
+//  commands are handled right away.
+//
+static int gesture_timer = -1;
+
+static uint64_t control_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void commit_clicks(struct sbpd_server * server, int cnt) {
+	struct button_ctrl * ctrl = button_ctrls + cnt;
+	int clicks = ctrl->clicks;
+
+	ctrl->clicks = 0;
+	ctrl->click_deadline_ns = 0;
+	if (clicks < 2) {
+		if (clicks == 1)
+			handle_button(server, cnt, SHORTPRESS);
+		return;
+	}
+	if (ctrl->click_type[clicks - 2] == NOTUSED) {
+		//  no command for this count, e.g. double click with only triple configured
+		while (clicks--)
+			handle_button(server, cnt, SHORTPRESS);
+		return;
+	}
+	loginfo("Button pressed: %s, Press Type:%s", ctrl->name,
+			(clicks == 2) ? "Double" : "Triple");
+	button_action(server, TAG_BUTTON | cnt, ctrl->click_type[clicks - 2],
+	              ctrl->click_fragment[clicks - 2], ctrl->click_key[clicks - 2]);
+}
+
+//
+//  Arm the gesture timer for the earliest click window
 //
-void handle_buttons(struct sbpd_server * server) {
-	//logdebug("Polling buttons");
+static void arm_gesture_timer(void) {
+	uint64_t next = 0;
 	for (int cnt = 0; cnt < numberofbuttons; cnt++) {
-		if (button_ctrls[cnt].waiting) {
-			loginfo("Button pressed: Pin: %d, Press Type:%s", button_ctrls[cnt].gpio_button->pin,
-					(button_ctrls[cnt].presstype == LONGPRESS) ? "Long" : "Short" );
-			if ( button_ctrls[cnt].presstype == SHORTPRESS ) {
-				if (button_ctrls[cnt].cmdtype == KEYBOARD){
-					send_key_seq( button_ctrls[cnt].key_code, 1 );
-				} else if ( button_ctrls[cnt].shortfragment != NULL ) {
-					send_command(server, button_ctrls[cnt].cmdtype, button_ctrls[cnt].shortfragment);
-				}
+		uint64_t deadline = button_ctrls[cnt].click_deadline_ns;
+		if (deadline && (!next || deadline < next))
+			next = deadline;
+		deadline = button_ctrls[cnt].defer_until_ns;
+		if (button_ctrls[cnt].deferred && (!next || deadline < next))
+			next = deadline;
+	}
+	if (gesture_timer < 0)
+		return;
+	if (!next) {
+		reactor_timer_set(gesture_timer, 0, 0);
+		return;
+	}
+	uint64_t now = control_time_ns();
+	long ms = (next > now) ? (long)((next - now + 999999) / 1000000) : 1;
+	reactor_timer_set(gesture_timer, ms, 0);
+}
+
+static void gesture_event(struct sbpd_server * server, const struct sbpd_event * event);
+
+static void gesture_timeout(int fd, uint32_t events, void * ctx) {
+	struct sbpd_server * server = ctx;
+	uint64_t now = control_time_ns();
+
+	reactor_timer_ack(fd);
+	for (int cnt = 0; cnt < numberofbuttons; cnt++) {
+		//  chord member events held back for the chord window
+		if (button_ctrls[cnt].deferred && button_ctrls[cnt].defer_until_ns <= now) {
+			button_ctrls[cnt].deferred = false;
+			gesture_event(server, &button_ctrls[cnt].deferred_event);
+		}
+		uint64_t deadline = button_ctrls[cnt].click_deadline_ns;
+		if (deadline && deadline <= now)
+			commit_clicks(server, cnt);
+	}
+	arm_gesture_timer();
+}
+
+static void gesture_event(struct sbpd_server * server, const struct sbpd_event * event) {
+	int cnt = event->element;
+	struct button_ctrl * ctrl = button_ctrls + cnt;
+
+	switch (event->kind) {
+		case EVENT_BUTTON_DOWN:
+			//  wait for the release before deciding
+			ctrl->click_deadline_ns = 0;
+			break;
+		case EVENT_SHORTPRESS:
+			if (ctrl->max_clicks < 2 || gesture_timer < 0) {
+				handle_button(server, cnt, SHORTPRESS);
+				break;
 			}
-			if ( button_ctrls[cnt].presstype == LONGPRESS ) {
-				if (button_ctrls[cnt].cmd_longtype == KEYBOARD){
-					send_key_seq( button_ctrls[cnt].key_code_long, 1 );
-				} else if ( button_ctrls[cnt].longfragment != NULL ) {
-					send_command(server, button_ctrls[cnt].cmd_longtype, button_ctrls[cnt].longfragment);
-				} else {
-					logdebug("No Long Press command configured");
+			ctrl->clicks++;
+			if (ctrl->clicks >= ctrl->max_clicks)
+				commit_clicks(server, cnt);
+			else
+				ctrl->click_deadline_ns = event->timestamp_ns + (uint64_t)ctrl->click_window * 1000000;
+			break;
+		case EVENT_LONGPRESS:
+			commit_clicks(server, cnt);
+			handle_button(server, cnt, LONGPRESS);
+			break;
+		case EVENT_REPEAT:
+			handle_button(server, cnt, SHORTPRESS);
+			break;
+		default:
+			break;
+	}
+	if (ctrl->max_clicks > 1)
+		arm_gesture_timer();
+}
+
+//
+//  Chords
+//  Runs before the gesture recognizer. Button downs and ups keep track of
+//  which buttons are held and since when. A chord matches when all of its
+//  buttons are held and were pressed within the chord window. Then the
+//  chord command is sent and all other events of its buttons are dropped
+//  until each of them is released.
+//  Press events of chord buttons within the chord window after their press
+//  are held back until the window passes or the button is released, so a
+//  press that becomes part of a chord doesn't act on its own.
+//
+static bool match_chord(struct sbpd_server * server, const struct chord_ctrl * chord) {
+	uint64_t first = 0, last = 0;
+	for (int i = 0; i < chord->count; i++) {
+		const struct button_ctrl * member = button_ctrls + chord->buttons[i];
+		if (!member->down || member->suppressed)
+			return false;
+		if (!first || member->down_ns < first)
+			first = member->down_ns;
+		if (member->down_ns > last)
+			last = member->down_ns;
+	}
+	if (last - first > (uint64_t)chord->window * 1000000)
+		return false;
+
+	loginfo("Chord pressed: %s", chord->name);
+	for (int i = 0; i < chord->count; i++) {
+		struct button_ctrl * member = button_ctrls + chord->buttons[i];
+		member->suppressed = true;
+		member->deferred = false;
+		member->clicks = 0;
+		member->click_deadline_ns = 0;
+	}
+	button_action(server, TAG_CHORD | (uint32_t)(chord - chord_ctrls), chord->cmdtype,
+	              chord->fragment, chord->key_code);
+	return true;
+}
+
+static void chord_event(struct sbpd_server * server, const struct sbpd_event * event) {
+	struct button_ctrl * ctrl = button_ctrls + event->element;
+
+	if (!ctrl->chords) {
+		gesture_event(server, event);
+		return;
+	}
+	switch (event->kind) {
+		case EVENT_BUTTON_DOWN:
+			ctrl->down = true;
+			ctrl->down_ns = event->timestamp_ns;
+			for (int i = 0; i < numberofchords; i++) {
+				if ((ctrl->chords & (1U << i)) && match_chord(server, chord_ctrls + i)) {
+					arm_gesture_timer();
+					return;
 				}
 			}
-			button_ctrls[cnt].waiting = false;  // clear waiting
-		}
+			ctrl->defer_until_ns = event->timestamp_ns + (uint64_t)ctrl->chord_window * 1000000;
+			break;
+		case EVENT_BUTTON_UP:
+			//  released, can't become part of a chord any more
+			ctrl->down = false;
+			ctrl->suppressed = false;
+			ctrl->defer_until_ns = 0;
+			break;
+		default:
+			if (ctrl->suppressed)
+				return;
+			if (event->timestamp_ns < ctrl->defer_until_ns) {
+				if (ctrl->deferred)
+					gesture_event(server, &ctrl->deferred_event);
+				ctrl->deferred_event = *event;
+				ctrl->deferred = true;
+				arm_gesture_timer();
+				return;
+			}
+			break;
+	}
+	if (ctrl->deferred) {
+		ctrl->deferred = false;
+		gesture_event(server, &ctrl->deferred_event);
 	}
+	gesture_event(server, event);
 }
 
+//
+//  Button id of a chord member, found by the button name: a GPIO pin
+//  "17" is "Pin 17", a matrix key "k0:2" is "Key 0,2", anything else the
+//  code of an input key, the first one on any device.
+//  Returns: button id or -1 if there is no such button
+//
+static int chord_member(const char * member) {
+    char name[CTRL_NAME_LEN];
+    char * end;
+    int row, col, length = 0;
+    bool input_key = false;
+
+    long pin = strtol(member, &end, 10);
+    if (end != member && !*end)
+        snprintf(name, sizeof(name), "Pin %ld", pin);
+    else if (sscanf(member, "k%d:%d%n", &row, &col, &length) == 2 && !member[length])
+        snprintf(name, sizeof(name), "Key %d,%d", row, col);
+    else {
+        snprintf(name, sizeof(name), "%.16s ", member);
+        input_key = true;
+    }
+    for (int cnt = 0; cnt < numberofbuttons; cnt++) {
+        if (input_key ? strncasecmp(button_ctrls[cnt].name, name, strlen(name)) == 0 :
+                        strcmp(button_ctrls[cnt].name, name) == 0)
+            return cnt;
+    }
+    return -1;
+}
 
 //
-//  Encoder interrupt callback
-//  Currently does nothing since we poll for volume changes
+//  Setup a chord
+//  Parameters:
+//      cmd: command, like a button command
+//      pins: GPIO pins of the buttons, separated by "+"
+//      options: optional settings
+//          window=ms - max time between the first and the last press
 //
-void encoder_rotate_cb(const struct encoder * encoder, long change) {
-    logdebug("Interrupt: encoder value: %d change: %d", encoder->value, change);
+int setup_chord_ctrl(char * cmd, char * pins, const struct element_options * options) {
+    struct chord_ctrl * chord = chord_ctrls + numberofchords;
+
+    if (numberofchords >= chord_capacity || numberofchords >= max_chords) {
+        logerr("Maximum number of chords exceded: %i", (chord_capacity < max_chords) ? chord_capacity : max_chords);
+        return -1;
+    }
+    chord->name = chord_names + numberofchords * CTRL_NAME_LEN;
+    snprintf(chord->name, CTRL_NAME_LEN, "%s %s", pins, cmd);
+
+    chord->count = 0;
+    for (char * pin = strtok(pins, "+"); pin; pin = strtok(NULL, "+")) {
+        int cnt = chord_member(pin);
+        if (cnt < 0) {
+            logerr("Chord %s: %s is not a configured button or key", chord->name, pin);
+            return -1;
+        }
+        if (chord->count == CHORD_MAX_BUTTONS) {
+            logerr("Chord %s: more than %d buttons", chord->name, CHORD_MAX_BUTTONS);
+            return -1;
+        }
+        chord->buttons[chord->count++] = cnt;
+    }
+    if (chord->count < 2) {
+        logerr("Chord %s needs at least two buttons", chord->name);
+        return -1;
+    }
+
+    chord->cmdtype = button_command(cmd, &chord->fragment, &chord->key_code);
+    if (chord->cmdtype < 0)
+        return -1;
+    if (chord->cmdtype == NOTUSED) {
+        logerr("Command %s, not found in defined commands", cmd);
+        return -1;
+    }
+
+    chord->window = CHORD_WINDOW;
+    char * window = element_option(options, "window");
+    if ( window != NULL ) {
+        char * end;
+        chord->window = (int)strtol(window, &end, 10);
+        if ( *end || chord->window <= 0 ) {
+            logerr("Bad chord window %s", window);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < chord->count; i++) {
+        struct button_ctrl * member = button_ctrls + chord->buttons[i];
+        if (!member->chords || chord->window > member->chord_window)
+            member->chord_window = chord->window;
+        member->chords |= 1U << numberofchords;
+    }
+    numberofchords++;
+    loginfo("Chord defined: %s, Window: %i ms", chord->name, chord->window);
+    return 0;
+}
+
+//
+//  Timer of the absolute volume mode, armed for the earliest command due
+//
+static int encoder_timer = -1;
+static long long encoder_due = 0;
+
+static void encoder_timeout(int fd, uint32_t events, void * ctx);
+
+//
+//  Set up main loop handlers of the control code
+//
+int init_control(struct reactor * loop, struct sbpd_server * server) {
+	control_server = server;
+	gesture_timer = reactor_timer(loop, gesture_timeout, server);
+	encoder_timer = reactor_timer(loop, encoder_timeout, server);
+	if (gesture_timer < 0 || encoder_timer < 0) {
+		logerr("Could not create control timers, multi-clicks and absolute volume disabled");
+		return -1;
+	}
+	return 0;
+}
+
+//
+//  Encoder acceleration
+//
+#define ACCEL_DEFAULT_WINDOW    150
+#define ACCEL_DEFAULT_MAX       8
+
+//
+//  Compile an acceleration profile "type[:param:...]" into the
+//  multiplier table of the encoder control
+//  Bucket 0 is the fastest turn, the last bucket just below the window.
+//  Returns: 0 on success, -1 on a bad profile
+//
+static int setup_accel(struct encoder_ctrl * ctrl, char * profile) {
+    ctrl->accel_type = ACCEL_NONE;
+    ctrl->accel_window = 0;
+    if ( !profile )
+        return 0;
+    char * type = strtok(profile, ":");
+    if ( !type || strcasecmp(type, "none") == 0 )
+        return 0;
+
+    if ( strcasecmp(type, "lin") == 0 || strcasecmp(type, "exp") == 0 ) {
+        char * param = strtok(NULL, ":");
+        int window = param ? (int)strtol(param, NULL, 10) : ACCEL_DEFAULT_WINDOW;
+        param = strtok(NULL, ":");
+        int max = param ? (int)strtol(param, NULL, 10) : ACCEL_DEFAULT_MAX;
+        if ( window <= 0 || max < 1 || max > ACCEL_MAX )
+            return -1;
+        ctrl->accel_type = (strcasecmp(type, "lin") == 0) ? ACCEL_LINEAR : ACCEL_EXP;
+        ctrl->accel_window = window;
+        for ( int bucket = 0; bucket < ACCEL_BUCKETS; bucket++ ) {
+            //  speed: 1 for the fastest bucket, towards 0 at the window
+            double speed = (double)(ACCEL_BUCKETS - bucket) / ACCEL_BUCKETS;
+            double mult = (ctrl->accel_type == ACCEL_LINEAR) ?
+                1.0 + (max - 1) * speed :
+                pow(max, speed);
+            ctrl->accel[bucket] = (uint8_t)lround(mult);
+        }
+        return 0;
+    }
+
+    if ( strcasecmp(type, "tab") == 0 ) {
+        int limits[ACCEL_BUCKETS];
+        int mults[ACCEL_BUCKETS];
+        int entries = 0;
+        char * entry;
+        while ( (entry = strtok(NULL, ":")) && entries < ACCEL_BUCKETS ) {
+            char * slash = strchr(entry, '/');
+            if ( !slash )
+                return -1;
+            limits[entries] = (int)strtol(entry, NULL, 10);
+            mults[entries] = (int)strtol(slash + 1, NULL, 10);
+            if ( limits[entries] <= 0 || mults[entries] < 1 || mults[entries] > ACCEL_MAX )
+                return -1;
+            if ( limits[entries] > ctrl->accel_window )
+                ctrl->accel_window = limits[entries];
+            entries++;
+        }
+        if ( entries == 0 )
+            return -1;
+        ctrl->accel_type = ACCEL_TABLE;
+        //  each bucket takes the multiplier of the tightest limit it is below
+        for ( int bucket = 0; bucket < ACCEL_BUCKETS; bucket++ ) {
+            int interval = ctrl->accel_window * bucket / ACCEL_BUCKETS;
+            int best = 0;
+            ctrl->accel[bucket] = 1;
+            for ( int i = 0; i < entries; i++ ) {
+                if ( interval < limits[i] && (best == 0 || limits[i] < best) ) {
+                    best = limits[i];
+                    ctrl->accel[bucket] = (uint8_t)mults[i];
+                }
+            }
+        }
+        return 0;
+    }
+    return -1;
+}
+
+//
+//  Apply acceleration to an encoder event
+//  The interval to the previous event of the same encoder picks the multiplier.
+//
+static long encoder_accel(struct encoder_ctrl * ctrl, const struct sbpd_event * event) {
+    uint64_t last = ctrl->last_event_ns;
+    ctrl->last_event_ns = event->timestamp_ns;
+    if ( ctrl->accel_type == ACCEL_NONE || last == 0 || event->timestamp_ns < last )
+        return event->delta;
+
+    uint64_t interval = (event->timestamp_ns - last) / 1000000;
+    if ( interval >= (uint64_t)ctrl->accel_window )
+        return event->delta;
+    int bucket = (int)(interval * ACCEL_BUCKETS / ctrl->accel_window);
+    logdebug("Encoder acceleration: %llu ms, x%d", (unsigned long long)interval, ctrl->accel[bucket]);
+    return (long)event->delta * ctrl->accel[bucket];
 }
 
 //
@@ -314,12 +1048,27 @@ void encoder_rotate_cb(const struct encoder * encoder, long change) {
 //      pin1: the GPIO-Pin-Number for the first pin used
 //      pin2: the GPIO-Pin-Number for the second pin used
 //      mode: one of
-//                  0 - ENCODER_MODE_STEP  <default>
-//                  1-9 - ENCODER_MODE_DETENT
-
+//                  1 - ENCODER_MODE_STEP  <default>
+//                  2-9 - Detent mode, steps per detent
+//      options: optional settings
+//                  res=quarter|half|full - steps per quadrature cycle 4 <default>, 2 or 1
+//                  accel=lin[:ms[:max]] - linear acceleration below ms between detents
+//                  accel=exp[:ms[:max]] - exponential acceleration below ms between detents
+//                  accel=tab:ms/mult[:ms/mult...] - multiplier table
 //
 //
-int setup_encoder_ctrl(int pi, char * cmd, int pin1, int pin2, int mode) {
+int setup_encoder_ctrl(int pi, char * cmd, int pin1, int pin2, int mode, const struct element_options * options) {
+    struct turn_source source = { .pin1 = pin1, .pin2 = pin2 };
+    return setup_turn_ctrl(pi, cmd, &source, mode, options);
+}
+
+static int setup_turn_ctrl(int pi, char * cmd, const struct turn_source * source, int mode,
+                           const struct element_options * options) {
+    if (numberofencoders >= encoder_capacity) {
+        logerr("Maximum number of encoders exceded: %i", encoder_capacity);
+        return -1;
+    }
+    struct encoder_ctrl * ctrl = encoder_ctrls + numberofencoders;
     int cmd_type = NOTUSED;
 	char * fragment = NULL;
     char * fragment_neg = NULL;
@@ -335,6 +1084,7 @@ int setup_encoder_ctrl(int pi, char * cmd, int pin1, int pin2, int mode) {
         uint32_t code = STRTOU32(cmd);
 		if (code == STRTOU32("VOLU")) {
 			fragment = FRAGMENT_VOLUME;
+			encoder_ctrls[numberofencoders].volume = true;
 			encoder_ctrls[numberofencoders].limit = 100;
 			encoder_ctrls[numberofencoders].min_time = 0;
 		} else if (code == STRTOU32("TRAC")) {
@@ -380,98 +1130,323 @@ int setup_encoder_ctrl(int pi, char * cmd, int pin1, int pin2, int mode) {
 		return -1;
 	}
 
-    struct encoder * gpio_e = setupencoder(pi, pin1, pin2, encoder_rotate_cb, mode);
-	encoder_ctrls[numberofencoders].cmd_type = cmd_type;
+    int resolution = ENCODER_RES_QUARTER;
+    char * res = element_option(options, "res");
+    if ( res != NULL ) {
+        if ( strcasecmp(res, "half") == 0 )
+            resolution = ENCODER_RES_HALF;
+        else if ( strcasecmp(res, "full") == 0 )
+            resolution = ENCODER_RES_FULL;
+        else if ( strcasecmp(res, "quarter") != 0 ) {
+            logerr("Bad encoder resolution %s", res);
+            return -1;
+        }
+    }
+
+    char * abs_rate = element_option(options, "abs");
+    ctrl->abs_rate = 0;
+    if ( abs_rate != NULL ) {
+        ctrl->abs_rate = *abs_rate ? (int)strtol(abs_rate, NULL, 10) : ENCODER_ABS_RATE;
+        if ( !ctrl->volume || ctrl->abs_rate <= 0 ) {
+            logerr("Bad encoder setting abs=%s, only for VOLU", abs_rate);
+            return -1;
+        }
+    }
+    ctrl->setpoint = -1;
+    ctrl->sent = -1;
+
+    char * accel = element_option(options, "accel");
+    if ( setup_accel(encoder_ctrls + numberofencoders, accel) < 0 ) {
+        logerr("Bad encoder acceleration %s", accel);
+        return -1;
+    }
+
+    ctrl->name = encoder_names + numberofencoders * CTRL_NAME_LEN;
+    if ( source->device )
+        snprintf(ctrl->name, CTRL_NAME_LEN, "%.16s %.30s", source->code_name, source->device);
+    else
+        snprintf(ctrl->name, CTRL_NAME_LEN, "GPIO %d, %d", source->pin1, source->pin2);
+
+    struct encoder * gpio_e;
+    if ( source->device )
+        gpio_e = setupinputaxis(pi, source->device, source->grab, source->code, mode);
+    else
+        gpio_e = setupencoder(pi, source->pin1, source->pin2, mode, resolution);
+    if (!gpio_e)
+        return -1;
+
+    encoder_ctrls[numberofencoders].cmd_type = cmd_type;
     encoder_ctrls[numberofencoders].fragment = fragment;
 	encoder_ctrls[numberofencoders].fragment_neg = fragment_neg;
     encoder_ctrls[numberofencoders].gpio_encoder = gpio_e;
-    encoder_ctrls[numberofencoders].last_value = 0;
+    encoder_ctrls[numberofencoders].pending = 0;
     encoder_ctrls[numberofencoders].last_time = 0;
+    encoder_ctrls[numberofencoders].errors = 0;
+    encoder_ctrls[numberofencoders].last_event_ns = 0;
     numberofencoders++;
     if ( cmd_type != KEYBOARD) {
-		loginfo("Rotary encoder defined: Pin %d, %d, Mode: %s, Fragment: \n%s",
-				pin1, pin2,
+		loginfo("Rotary encoder defined: %s, Mode: %s, Steps per detent: %d, Resolution: %s, Fragment: \n%s",
+				ctrl->name,
 				(mode != 1) ? "Detent" : "Step",
+				mode,
+				(resolution == ENCODER_RES_FULL) ? "full" : (resolution == ENCODER_RES_HALF) ? "half" : "quarter",
 				fragment);
 	} else {
-		loginfo("Rotary encoder defined: Pin %d, %d, Mode: %s, Type: Keyboard, Pos: %s, Neg: %s", 
-				pin1, pin2,
+		loginfo("Rotary encoder defined: %s, Mode: %s, Steps per detent: %d, Resolution: %s, Type: Keyboard, Pos: %s, Neg: %s",
+				ctrl->name,
 				(mode != 1) ? "Detent" : "Step",
+				mode,
+				(resolution == ENCODER_RES_FULL) ? "full" : (resolution == ENCODER_RES_HALF) ? "half" : "quarter",
 				fragment, fragment_neg);
 	}
     return 0;
 }
 
 //
-//  Polling function: handle encoder commands
+//  Volume change that can't change anything, from the player state cache
+//  Muted players are unmuted by volume commands, those are always sent.
+//
+static bool at_volume_limit(int delta) {
+    const struct player_state * state = player_state();
+    if (!state->valid || state->muted)
+        return false;
+    return (delta > 0 && state->volume >= 100) || (delta < 0 && state->volume <= 0);
+}
+
+//
+//  Absolute volume mode
+//  The pending change moves the setpoint, which is seeded from the player
+//  state. Only the newest setpoint is sent, at most one command every
+//  abs_rate ms and one at a time, the encoder timer sends the last one.
+//  Returns: false while the setpoint can't be seeded, relative commands
+//           are sent meanwhile
+//
+static bool send_setpoint(struct sbpd_server * server, int cnt, long long time) {
+    struct encoder_ctrl * ctrl = encoder_ctrls + cnt;
+
+    if (ctrl->pending) {
+        if (ctrl->setpoint >= 0 && !ctrl->in_flight && ctrl->sent == ctrl->setpoint &&
+            time - ctrl->setpoint_time > ENCODER_ABS_HOLD)
+            ctrl->setpoint = -1;
+        if (ctrl->setpoint < 0) {
+            const struct player_state * state = player_state();
+            if (!state->valid)
+                return false;
+            ctrl->setpoint = ctrl->sent = state->volume;
+        }
+        long setpoint = ctrl->setpoint + ctrl->pending;
+        ctrl->setpoint = (setpoint < 0) ? 0 : (setpoint > 100) ? 100 : (int)setpoint;
+        ctrl->setpoint_time = time;
+        ctrl->pending = 0;
+    }
+    if (ctrl->setpoint < 0 || ctrl->setpoint == ctrl->sent || ctrl->in_flight)
+        return true;
+
+    long long due = ctrl->sent_time + ctrl->abs_rate;
+    if (time < due) {
+        if (encoder_timer >= 0 && (!encoder_due || due < encoder_due)) {
+            encoder_due = due;
+            reactor_timer_set(encoder_timer, (long)(due - time), 0);
+        }
+        return true;
+    }
+    char fragment[50];
+    snprintf(fragment, sizeof(fragment), FRAGMENT_VOLUME_ABS, ctrl->setpoint);
+    loginfo("Encoder on %s - volume: %d", ctrl->name, ctrl->setpoint);
+    if (queue_command(server, ctrl->cmd_type, fragment, TAG_ENCODER | TAG_SETPOINT | cnt,
+                      ctrl->setpoint)) {
+        ctrl->in_flight = true;
+        ctrl->sent = ctrl->setpoint;
+        ctrl->sent_time = time;
+    }
+    return true;
+}
+
+static void encoder_timeout(int fd, uint32_t events, void * ctx) {
+    reactor_timer_ack(fd);
+    encoder_due = 0;
+    long long time = ms_timer();
+    for (int cnt = 0; cnt < numberofencoders; cnt++)
+        if (encoder_ctrls[cnt].abs_rate)
+            send_setpoint(ctx, cnt, time);
+}
+
+//
+//  Send the pending change of an encoder
+//  While a command of the encoder is in flight, further changes are
+//  coalesced into the pending change and sent when it completes,
+//  see command_done().
 //  Parameters:
 //      server: the server to send commands to
+//      cnt: encoder id
+//      time: ms_timer() time
 //
-void handle_encoders(struct sbpd_server * server) {
+static void send_encoder(struct sbpd_server * server, int cnt, long long time) {
+    struct encoder_ctrl * ctrl = encoder_ctrls + cnt;
+    //
+    //  volume delta collected from the encoder events
+    //
+    if (ctrl->abs_rate && send_setpoint(server, cnt, time))
+        return;
+    int delta = (int)ctrl->pending;
+    if (delta == 0 || ctrl->in_flight)
+        return;
+    //Check if change happened before minimum delay, clear out data.
+    if ( ctrl->last_time + ctrl->min_time > time ) {
+        loginfo("Encoder on %s value change: %d, before %d ms ellapsed not sending lms command.",
+            ctrl->name,
+            delta,
+            (ctrl->min_time) );
+        ctrl->pending = 0;
+        return;
+    }
+
+    loginfo("Encoder on %s - change: %d",
+            ctrl->name,
+            delta);
+
+    char fragment[50];
+    char * prefix = (delta > 0) ? "+" : "-";
+    if ( abs(delta) > ctrl->limit ) {
+             delta = (delta > 0) ? ctrl->limit : -ctrl->limit;
+    }
+	if ( ctrl->cmd_type == KEYBOARD ){
+		if (delta > 0){
+			send_key_seq( ctrl->key_code_pos, delta);
+		} else {
+			send_key_seq( ctrl->key_code_neg, abs(delta));
+		}
+		ctrl->pending = 0;
+		ctrl->last_time = time; // chatter filter
+	} else if ( ctrl->volume && at_volume_limit(delta) ) {
+		logdebug("Encoder on %s: volume already at the limit, not sending lms command.",
+		         ctrl->name);
+		ctrl->pending = 0;
+	} else {
+		snprintf(fragment, sizeof(fragment),
+				ctrl->fragment, prefix, abs(delta));
+		if (queue_command(server, ctrl->cmd_type, fragment,
+		                  TAG_ENCODER | cnt, delta)) {
+			ctrl->pending = 0;
+			ctrl->in_flight = true;
+			ctrl->last_time = time; // chatter filter
+		}
+	}
+}
+
+//
+//  Send pending encoder commands
+//  Parameters:
+//      server: the server to send commands to
+//
+static void handle_encoders(struct sbpd_server * server) {
     //
     //  chatter filter set duration in encoder setup.
     //      - volume set to 0...
     //      - track change set to 500ms
-    //  We poll every 100ms anyway plus wait for network action to complete
     //
     long long time = ms_timer();
 
-    long current_value;
-
     for (int cnt = 0; cnt < numberofencoders; cnt++) {
         //
-        //  build volume delta
-        //  ignore if > 100: overflow
+        //  Report decoding errors, the encoder is too fast for us
         //
-        // Detent mode is simply value / 4
-        if ( encoder_ctrls[cnt].gpio_encoder->mode > 1 )
-            current_value = encoder_ctrls[cnt].gpio_encoder->detents;
-        else
-            current_value = encoder_ctrls[cnt].gpio_encoder->value;
-
-        int delta = (int)(current_value - encoder_ctrls[cnt].last_value);
-        if (delta > 100)
-            delta = 0;
-        if (delta != 0) {
-            //Check if change happened before minimum delay, clear out data.
-            if ( encoder_ctrls[cnt].last_time + encoder_ctrls[cnt].min_time > time ) {
-                loginfo("Encoder on GPIO %d, %d value change: %d, before %d ms ellapsed not sending lms command.",
-                    encoder_ctrls[cnt].gpio_encoder->pin_a,
-                    encoder_ctrls[cnt].gpio_encoder->pin_b,
-                    delta,
-                    (encoder_ctrls[cnt].min_time) );
-                encoder_ctrls[cnt].last_value = current_value;
-                return;
-            }
+        uint32_t errors = encoder_errors(encoder_ctrls[cnt].gpio_encoder);
+        if (errors != encoder_ctrls[cnt].errors) {
+            logwarn("Encoder on %s: %u invalid transitions so far",
+                    encoder_ctrls[cnt].name, errors);
+            encoder_ctrls[cnt].errors = errors;
+        }
+        send_encoder(server, cnt, time);
+    }
+}
 
-            loginfo("Encoder on GPIO %d, %d - value: %d, detents: %d, change: %d",
-                    encoder_ctrls[cnt].gpio_encoder->pin_a,
-                    encoder_ctrls[cnt].gpio_encoder->pin_b,
-                    encoder_ctrls[cnt].gpio_encoder->value,
-                    encoder_ctrls[cnt].gpio_encoder->detents,
-                    delta);
-
-            char fragment[50];
-            char * prefix = (delta > 0) ? "+" : "-";
-            if ( abs(delta) > encoder_ctrls[cnt].limit ) {
-                     delta = encoder_ctrls[cnt].limit;
-            }
-			if ( encoder_ctrls[cnt].cmd_type == KEYBOARD ){
-				if (delta > 0){
-					send_key_seq( encoder_ctrls[cnt].key_code_pos, delta);
-				} else {
-					send_key_seq( encoder_ctrls[cnt].key_code_neg, abs(delta));
-				}
-				encoder_ctrls[cnt].last_value = current_value;
-				encoder_ctrls[cnt].last_time = time; // chatter filter
-			} else {
-				snprintf(fragment, sizeof(fragment),
-						encoder_ctrls[cnt].fragment, prefix, abs(delta));
-				if (send_command(server, encoder_ctrls[cnt].cmd_type, fragment)) {
-					encoder_ctrls[cnt].last_value = current_value;
-					encoder_ctrls[cnt].last_time = time; // chatter filter
-				}
-			}
+//
+//  Polling function: handle input events
+//  Runs button commands in the order the presses happened,
+//  sums up encoder events and sends one command per encoder.
+//  Parameters:
+//      server: the server to send commands to
+//
+void handle_input(struct sbpd_server * server) {
+    struct sbpd_event event;
+
+    while (eventqueue_pop(&event)) {
+        switch (event.kind) {
+            case EVENT_BUTTON_DOWN:
+            case EVENT_BUTTON_UP:
+            case EVENT_SHORTPRESS:
+            case EVENT_LONGPRESS:
+            case EVENT_REPEAT:
+                if (event.element < numberofbuttons)
+                    chord_event(server, &event);
+                break;
+            case EVENT_ENCODER:
+                if (event.element < numberofencoders)
+                    encoder_ctrls[event.element].pending +=
+                        encoder_accel(encoder_ctrls + event.element, &event);
+                break;
+            default:
+                break;
         }
     }
+    handle_encoders(server);
+}
+
+//
+//  Completion handler of queued commands
+//  Failures are logged with the element. Encoder changes that did not
+//  reach the server are put back and sent with the next change, unless
+//  the delivery policy dropped them. Button commands are retried by the
+//  delivery policy of their class, see servercomm.h.
+//
+void command_done(const struct comm_result * result) {
+	static bool unreachable = false;
+	int id = TAG_ID(result->tag);
+	const char * name =
+		(TAG_KIND(result->tag) == TAG_BUTTON && id < numberofbuttons) ? button_ctrls[id].name :
+		(TAG_KIND(result->tag) == TAG_CHORD && id < numberofchords) ? chord_ctrls[id].name :
+		(TAG_KIND(result->tag) == TAG_ENCODER && id < numberofencoders) ? encoder_ctrls[id].name :
+		"unknown";
+
+	if (result->command == LMS && result->reply.fields)
+		player_state_reply(&result->reply);
+	if (result->command == LMS && !result->expired)
+		server_set_result(result->reached, result->ok || result->reply.fields);
+	if (result->retried)
+		return;
+	if (result->command == LMS && result->reached == unreachable) {
+		unreachable = !result->reached;
+		if (unreachable)
+			logwarn("Server not reachable");
+		else
+			loginfo("Server reachable again");
+	}
+	if (TAG_KIND(result->tag) == TAG_ENCODER && id < numberofencoders) {
+		//  send the changes coalesced meanwhile
+		encoder_ctrls[id].in_flight = false;
+		if (result->tag & TAG_SETPOINT) {
+			//  absolute setpoint, sent again unless there is a newer one
+			if (!result->ok && !result->reached)
+				encoder_ctrls[id].sent = -1;
+			if (!result->ok)
+				logwarn("Command of %s failed", name);
+		} else if (result->expired) {
+			loginfo("Encoder on %s: change %d dropped, server not answering",
+			        name, result->value);
+		} else if (!result->ok && !result->reached) {
+			encoder_ctrls[id].pending += result->value;
+			loginfo("Encoder on %s: change %d not sent, kept for the next change",
+			        name, result->value);
+		} else if (!result->ok) {
+			logwarn("Command of %s failed", name);
+		}
+		if (!unreachable)
+			send_encoder(control_server, id, ms_timer());
+		return;
+	}
+	//  tag 0: connection warm-up of the server communication
+	if (result->ok || !TAG_KIND(result->tag))
+		return;
+	logwarn("Command of %s failed", name);
 }
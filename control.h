@@ -37,6 +37,22 @@
 
 #include "sbpd.h"
 #include "GPIO.h"
+#include "eventqueue.h"
+#include "reactor.h"
+#include "servercomm.h"
+
+//
+//  Multi-click gestures
+//  Double and triple clicks, the click window is the time allowed
+//  from a release to the next press.
+//
+#define GESTURE_MAX_CLICKS      3
+#define GESTURE_CLICK_WINDOW    300
+
+//
+//  Length of element names for logs, names are kept in the cold registry region
+//
+#define CTRL_NAME_LEN           48
 
 //
 //  Store command parameters for each button used
@@ -44,14 +60,28 @@
 struct button_ctrl
 {
     struct button * gpio_button;
-    volatile bool waiting;
+    char * name;                // "Pin n", "Key row,col" or "code device" for logs
     char * shortfragment;
     char * longfragment;
-    bool presstype;
     int cmdtype;
     int cmd_longtype;
 	int key_code;
 	int key_code_long;
+	int click_type[GESTURE_MAX_CLICKS - 1];         // double, triple click command type
+	char * click_fragment[GESTURE_MAX_CLICKS - 1];
+	int click_key[GESTURE_MAX_CLICKS - 1];
+	int max_clicks;             // highest click count with a command, 1 for none
+	int click_window;           // ms
+	int clicks;                 // clicks counted so far
+	uint64_t click_deadline_ns; // end of the click window, 0 if not waiting
+	uint32_t chords;            // bit n set for a member of chord n
+	int chord_window;           // longest window of its chords, ms
+	bool down;                  // held, from button down and up events
+	uint64_t down_ns;           // time of the last press
+	bool suppressed;            // part of a matched chord until released
+	bool deferred;              // deferred_event held back in the chord window
+	uint64_t defer_until_ns;
+	struct sbpd_event deferred_event;
 
 };
 
@@ -71,31 +101,138 @@ struct button_ctrl
 //                  1 - falling edge
 //                  2 - rising edge
 //                  0, 3 - both
+//      options: optional settings
+//                  debounce=[integrator:|lockout:]ms - debounce algorithm and
+//                                         settle time (default integrator, 20 ms)
+//                  repeat=delay[/rate] - command on press, repeated every rate ms
+//                                         (default 100) while held longer than delay
+//                  dbl=CMD, tpl=CMD - double and triple click commands
+//                  click=ms - click window (default 300 ms)
 //
-int setup_button_ctrl( int pi, char * cmd, int pin, int resist, int pressed, char * cmd_long, int long_time);
+#define BUTTON_REPEAT_RATE 100
+int setup_button_ctrl( int pi, char * cmd, int pin, int resist, int pressed, char * cmd_long, int long_time,
+                       const struct element_options * options);
 
 //
-//  Polling function: handle button commands
+//  Setup key control
+//  Keys of the key matrix, parameters and settings as for buttons
+//  except for resist, pressed and debounce.
+//      row, col: position of the key in the key matrix, starting at 0
+//
+int setup_key_ctrl(int pi, char * cmd, int row, int col, char * cmd_long, int long_time,
+                   const struct element_options * options);
+
+//
+//  Setup key matrix
 //  Parameters:
-//      server: the server to send commands to
+//      rows: GPIO-Pin-Numbers of the rows, separated by "+", e.g. 5+6+13
+//      cols: GPIO-Pin-Numbers of the columns, separated by "+"
+//      options: optional settings
+//                  scan=hz - scans per second (default 100)
+//                  debounce=ms - time a key needs to read a new state (default 20 ms)
 //
-void handle_buttons(struct sbpd_server * server);
+int setup_matrix_ctrl(int pi, char * rows, char * cols, const struct element_options * options);
 
 //
-//  Store command parameters for each button used
+//  Setup input device control
+//  A key or relative axis of a Linux input device (/dev/input/eventN),
+//  e.g. of the gpio-keys, rotary-encoder or gpio-ir drivers.
+//  Parameters:
+//      device: device path (starting with /) or device name
+//      code: event code, KEY_ or BTN_ name or number for keys, REL_ name for axes
+//      cmd: for keys a command like for buttons, for axes like for encoders
+//      arg1, arg2: keys: CMD_LONG and long_time, axes: steps per detent
+//      options: optional settings
+//                  grab=1 - take the device exclusively, other programs get no events
+//                  keys: settings like for buttons, except debounce
+//                  axes: accel=... like for encoders
+//
+int setup_input_ctrl(int pi, char * device, char * code, char * cmd, char * arg1, char * arg2,
+                     const struct element_options * options);
+
+//
+//  Chords: buttons pressed together
+//
+//  chord members are kept as bit masks, up to 32 chords
+#define max_chords          32
+#define CHORD_MAX_BUTTONS   4
+#define CHORD_WINDOW        100
+
+struct chord_ctrl
+{
+    int buttons[CHORD_MAX_BUTTONS];     // button ids
+    int count;
+    int cmdtype;
+    char * fragment;
+    int key_code;
+    int window;                         // max ms between first and last press
+    char * name;
+};
+
+//
+//  Setup chord control
+//  The buttons need to be set up first.
+//  Parameters:
+//      cmd: Command, like for buttons
+//      pins: members, separated by "+", e.g. 5+6 or 5+k0:1+KEY_MUTE, each one of
+//                  GPIO-Pin-Number of a button
+//                  kROW:COL of a matrix key
+//                  code of an input device key, as given for the key
+//      options: optional settings
+//                  window=ms - max time between the first and the last button
+//                              press of the chord (default 100 ms)
+//
+int setup_chord_ctrl(char * cmd, char * pins, const struct element_options * options);
+
+//
+//  Encoder acceleration profiles
+//  Each profile is compiled into a table of multipliers for
+//  ACCEL_BUCKETS equal slices of the acceleration window.
+//
+#define ACCEL_NONE      0
+#define ACCEL_LINEAR    1
+#define ACCEL_EXP       2
+#define ACCEL_TABLE     3
+#define ACCEL_BUCKETS   16
+#define ACCEL_MAX       100
+
+//
+//  Absolute volume mode
+//  Default ms between commands, and ms without a change after which the
+//  setpoint is seeded from the player state again, picking up changes
+//  made elsewhere.
+//
+#define ENCODER_ABS_RATE    100
+#define ENCODER_ABS_HOLD    1000
+
+//
+//  Store command parameters for each encoder used
 //
 struct encoder_ctrl
 {
     struct encoder * gpio_encoder;
+    char * name;            // "GPIO a, b" or "code device" for logs
 	int cmd_type;
-    volatile long last_value;
+    long pending;
     char * fragment;
 	char * fragment_neg;
 	int key_code_pos;
 	int key_code_neg;
 	int limit;
-	volatile long long last_time;
+	long long last_time;
 	int min_time;
+	uint32_t errors;        // invalid transitions reported so far
+	int accel_type;         // ACCEL_
+	int accel_window;       // ms between detents below which acceleration starts
+	uint8_t accel[ACCEL_BUCKETS];   // multiplier by detent interval, see encoder_accel()
+	uint64_t last_event_ns; // time of the last encoder event
+	bool in_flight;         // command sent, changes are coalesced in pending
+	bool volume;            // mixer volume, checked against the player state
+	int abs_rate;           // ms between absolute volume commands, 0 for relative
+	int setpoint;           // absolute volume, -1 until seeded
+	int sent;               // setpoint sent last, -1 to send again
+	long long sent_time;    // ms_timer() time of the last absolute command
+	long long setpoint_time;    // ms_timer() time of the last setpoint change
 };
 //
 //  Setup encoder control
@@ -106,30 +243,59 @@ struct encoder_ctrl
 //      pin1: the GPIO-Pin-Number for the first pin used
 //      pin2: the GPIO-Pin-Number for the second pin used
 //      mode: one of
-//                  0 - ENCODER_MODE_DETENT
 //                  1 - ENCODER_MODE_STEP  <default>
+//                  2-9 - Detent mode, steps per detent
+//      options: optional settings
+//                  res=quarter|half|full - steps per quadrature cycle 4 <default>, 2 or 1
+//                  accel=lin[:ms[:max]] - multiplier rises linearly to max when detents
+//                                         come faster than ms apart (default 150 ms, 8)
+//                  accel=exp[:ms[:max]] - same, rising exponentially
+//                  accel=tab:ms/mult[:ms/mult...] - multiplier mult below ms
+//                  abs[=ms] - VOLU only: keep an absolute volume setpoint, seeded
+//                             from the player state, and send it at most every
+//                             ms (default 100), only the newest one
 //
-int setup_encoder_ctrl(int pi, char * cmd, int pin1, int pin2, int mode);
+int setup_encoder_ctrl(int pi, char * cmd, int pin1, int pin2, int mode, const struct element_options * options);
 
 //
-//  Polling function: handle encoders
+//  Set up main loop handlers of the control code
+//  Call before the first input event is handled.
+//  Returns: 0 on success, -1 on error
+//
+int init_control(struct reactor * loop, struct sbpd_server * server);
+
+//
+//  Polling function: handle input events queued by the GPIO input thread
+//  Sends the commands of pressed buttons and turned encoders.
 //  Parameters:
 //      server: the server to send commands to
 //
-void handle_encoders(struct sbpd_server * server);
+void handle_input(struct sbpd_server * server);
+
+//
+//  Completion handler for commands sent by the network worker, see init_comm()
+//
+void command_done(const struct comm_result * result);
 
 //
 // Set of commands to send to LMS server
 //
 #define MAXLEN 255
-#define MAX_COMMANDS 80
 struct lms_command {
   int code;
   char fragment[MAXLEN];
 };
 
+//
+//  Add a command, returns 1 if more commands are added than allocated
+//
 int add_lms_command_frament ( char * name, char * value );
 
+//
+//  Allocate the control objects of the configuration from the registry
+//
+void alloc_control(const struct registry_counts * counts);
+
 //
 // Keyboard controls
 //
@@ -38,6 +38,10 @@
 
 #include "discovery.h"
 #include "sbpd.h"
+#include "reactor.h"
+#include "servercomm.h"
+#include "playerstate.h"
+#include "serverset.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -60,80 +64,166 @@ void update_port();
 void _write_server_string(struct sbpd_server * server, in_addr_t s_addr);
 bool get_serverIPv4(uint32_t *ip);
 void send_discovery(uint32_t address);
-uint32_t read_discovery(uint32_t address);
+uint32_t read_discovery(int fd, uint32_t * address);
 
 static bool get_mac(uint8_t mac[]);
+static void send_broadcast(void);
 
 
 #define IP_SEARCH_TIMEOUT 3 // every 3 s
+#define BROADCAST_TIMEOUT 30 // every 30 s
 
 //
-//  Polling function for server discovery
-//  Call from main loop
-//  Handles internal scheduling between different
+//  Server discovery state
+//  Driven by the event loop: a timer for the server search,
+//  the UDP socket for the port discovery reply.
 //
+static struct reactor * discovery_loop = NULL;
+static sbpd_config_parameters_t discovery_config;
+static sbpd_config_parameters_t * discovery_discovered;
+static struct sbpd_server * discovery_server;
+static int search_timer = -1;
+static int broadcast_timer = -1;
+static int udpSocket = -1;          // port discovery of the server found
+static int broadcastSocket = -1;    // discovery of all servers
+//
+//  Helper variable; don't want to convert back and forth between string and net-addr
+//
+static in_addr_t foundAddr = 0;
+//
+//  Player connected to a server in the last search, set by get_serverIPv4()
+//
+static bool player_connected = false;
 
 //
-// counter for search scheduling
+//  Search for the server the player is connected to
+//  The port of a server found by broadcast before is taken right away.
+//
+static void search(void) {
+    in_addr_t addr = foundAddr;
+    bool was_connected = player_connected;
+    bool change = get_serverIPv4(&addr);
+    logdebug("New or changed server address %s", (change) ? "found" : "not found");
+    //  the player is back on the same server
+    if (!change && player_connected && !was_connected && discovery_server->port)
+        comm_server_seen(discovery_server);
+    if (change) {
+        //
+        // found server but not port
+        //
+        *discovery_discovered |= SBPD_cfg_host;
+        *discovery_discovered &= ~SBPD_cfg_port;
+        foundAddr = addr;
+
+        struct in_addr found = { .s_addr = addr };
+        uint32_t port = server_set_port(inet_ntoa(found));
+        if (port && !(discovery_config & SBPD_cfg_port)) {
+            discovery_server->port = port;
+            *discovery_discovered |= SBPD_cfg_port;
+        }
+        // we don't update server struct, yet, if we also look for the port.
+        if ((discovery_config & SBPD_cfg_port) || port) {
+            _write_server_string(discovery_server, addr);
+            server_set_add(discovery_server->host, discovery_server->port, false);
+            comm_server(discovery_server);
+            player_state_server(discovery_server);
+        }
+        // otherwise: look for port
+        else
+            send_discovery(addr);
+    }
+    struct in_addr attached = { .s_addr = foundAddr };
+    server_set_attached(player_connected ? inet_ntoa(attached) : NULL);
+}
+
 //
-static uint32_t search_timer = 0;
+//  Timer handler: search for server
 //
-//  Helper variable; don't want to convert back and forth between string and net-addr
+static void search_server(int fd, uint32_t events, void * ctx) {
+    reactor_timer_ack(fd);
+    search();
+}
+
 //
-static in_addr_t foundAddr = 0;
+//  Search right away, e.g. when the server stopped answering
+//
+void discovery_search(void) {
+    if (search_timer >= 0)
+        search();
+}
+
+//
+//  Socket handler: port discovery reply
+//
+static void discovery_reply(int fd, uint32_t events, void * ctx) {
+    uint32_t address = foundAddr;
+    uint32_t foundPort = read_discovery(fd, &address);
+    if (foundPort) {
+        reactor_del(discovery_loop, udpSocket);
+        close(udpSocket);
+        udpSocket = -1;
+        loginfo("Squeezebox control port found: %d", foundPort);
+        if (!(discovery_config & SBPD_cfg_host))
+            _write_server_string(discovery_server, foundAddr);
+        discovery_server->port = foundPort;
+        *discovery_discovered |= SBPD_cfg_port;
+        server_set_add(discovery_server->host, foundPort, false);
+        comm_server(discovery_server);
+        player_state_server(discovery_server);
+        struct in_addr attached = { .s_addr = foundAddr };
+        server_set_attached(player_connected ? inet_ntoa(attached) : NULL);
+    }
+}
+
+//
+//  Socket handler: replies to discovery broadcasts, all servers go
+//  into the server set
+//
+static void broadcast_reply(int fd, uint32_t events, void * ctx) {
+    uint32_t address = 0;
+    uint32_t port;
+    while ((port = read_discovery(fd, &address))) {
+        struct in_addr found = { .s_addr = address };
+        server_set_add(inet_ntoa(found), port, false);
+    }
+}
+
+//
+//  Timer handler: discovery broadcast
+//
+static void broadcast_server(int fd, uint32_t events, void * ctx) {
+    reactor_timer_ack(fd);
+    send_broadcast();
+}
+
+//
+//  Start server discovery
 //
 //  Parameters:
+//  loop: event loop to run discovery on
 //  config: defines which parameters are preconfigured and will not be discovered
 //  discovered: the discovered parameters
 //  server: server configuration
 //
-void poll_discovery(sbpd_config_parameters_t config,
-                    sbpd_config_parameters_t *discovered,
-                    struct sbpd_server * server) {
-    //logdebug("Polling server discovery");
+void start_discovery(struct reactor * loop,
+                     sbpd_config_parameters_t config,
+                     sbpd_config_parameters_t *discovered,
+                     struct sbpd_server * server) {
+    discovery_loop = loop;
+    discovery_config = config;
+    discovery_discovered = discovered;
+    discovery_server = server;
     //
-    // search for server
+    // search for server unless configured
+    // first search right away
     //
     if (!(config & SBPD_cfg_host)) {
-        if (!search_timer--) {
-            search_timer = IP_SEARCH_TIMEOUT * SCD_SECOND / SCD_SLEEP_TIMEOUT;
-            in_addr_t addr = 0;
-            if (server->host)
-                addr = inet_addr(server->host);
-            bool change = get_serverIPv4(&addr);
-            logdebug("New or changed server address %s", (change) ? "found" : "not found");
-            if (change) {
-                //
-                // found server but not port
-                //
-                *discovered |= SBPD_cfg_host;
-                *discovered &= ~SBPD_cfg_port;
-                foundAddr = addr;
-                
-                // we don't update server struct, yet, if we also look for the port.
-                if (config & SBPD_cfg_port)
-                    _write_server_string(server, addr);
-                // otherwise: look for port
-                else
-                    send_discovery(addr);
-            }
-        }
-    }
-    //
-    // only search if configured to do so and port is not yet found
-    //
-    if (!(config & SBPD_cfg_port) &&
-        !(*discovered & SBPD_cfg_port)) {
-        logdebug("Looking for port");
-        uint32_t foundPort = read_discovery(foundAddr);
-        if (foundPort) {
-            loginfo("Squeezebox control port found: %d", foundPort);
-            if (!(config & SBPD_cfg_host))
-                _write_server_string(server, foundAddr);
-            server->port = foundPort;
-            *discovered |= SBPD_cfg_port;
-        }
-
+        search_timer = reactor_timer(loop, search_server, NULL);
+        if (search_timer >= 0)
+            reactor_timer_set(search_timer, 1, IP_SEARCH_TIMEOUT * 1000);
+        broadcast_timer = reactor_timer(loop, broadcast_server, NULL);
+        if (broadcast_timer >= 0)
+            reactor_timer_set(broadcast_timer, 1, BROADCAST_TIMEOUT * 1000);
     }
 }
 
@@ -191,6 +281,7 @@ bool get_serverIPv4(uint32_t *ip) {
         return false;
     }
     bool found = false;
+    player_connected = false;
     while (fgets(line, 255, procTcp)) {
         logdebug("/proc/net/tcp line: %s", line);
         strtok(line, " "); // line number
@@ -231,6 +322,7 @@ bool get_serverIPv4(uint32_t *ip) {
         //
         if ((*((uint32_t *)portComp) == *((uint32_t *)portString)) &&
             (uSocketState == TCP_ESTABLISHED)) {
+            player_connected = true;
             foundIp = (uint32_t)strtoul(ipString, NULL, 16);
             if (foundIp != *ip) {
                 if (!found) // only change once. The rest is for logging only
@@ -255,7 +347,6 @@ bool get_serverIPv4(uint32_t *ip) {
     return found;
 }
 
-static int udpSocket = 0;
 static uint32_t udpAddress;
 # define SIZE_SERVER_DISCOVERY_LONG 23
 # define SBS_UDP_PORT 3483
@@ -265,20 +356,26 @@ static uint32_t udpAddress;
 //
 
 //
-// send server discovery
+// discovery socket, replies go to handler
 //
-void send_discovery(uint32_t address) {
-    if (udpSocket)
-        close(udpSocket);
-    // create discovery socket
-    udpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    
+static int discovery_socket(reactor_handler_t handler) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (fd < 0) {
+        loginfo("Error creating discovery socket");
+        return -1;
+    }
+    reactor_add(discovery_loop, fd, EPOLLIN, handler, NULL);
+
     int yes = 1;
-    setsockopt(udpSocket, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(int));
-    setsockopt(udpSocket, SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes));
-    
-    // send packet
-    udpAddress = address;
+    setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(int));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes));
+    return fd;
+}
+
+//
+// send discovery packet
+//
+static void discovery_packet(int fd, uint32_t address) {
     struct sockaddr_in addr4;
     memset(&addr4, 0, sizeof(addr4));
     addr4.sin_family = AF_INET;
@@ -288,27 +385,55 @@ void send_discovery(uint32_t address) {
     char * data = "eIPAD\0NAME\0JSON\0UUID\0\0\0";
     
     size_t error;
-    error = sendto(udpSocket, data, SIZE_SERVER_DISCOVERY_LONG, 0, (struct sockaddr*)&addr4, sizeof(addr4));
+    error = sendto(fd, data, SIZE_SERVER_DISCOVERY_LONG, 0, (struct sockaddr*)&addr4, sizeof(addr4));
     if (error == -1)
         loginfo("Error sending discovery packet");
 }
 
+//
+// send server discovery
+//
+void send_discovery(uint32_t address) {
+    if (udpSocket >= 0) {
+        reactor_del(discovery_loop, udpSocket);
+        close(udpSocket);
+    }
+    // create discovery socket, reply is handled by discovery_reply()
+    udpSocket = discovery_socket(discovery_reply);
+    if (udpSocket < 0)
+        return;
+    
+    // send packet
+    udpAddress = address;
+    discovery_packet(udpSocket, address);
+}
+
+//
+// send discovery broadcast, replies are handled by broadcast_reply()
+//
+static void send_broadcast(void) {
+    if (broadcastSocket < 0)
+        broadcastSocket = discovery_socket(broadcast_reply);
+    if (broadcastSocket >= 0)
+        discovery_packet(broadcastSocket, htonl(INADDR_BROADCAST));
+}
+
 
 #define BUFSIZE 1600
 //
 // poll udp port for discovery reply
 //
-uint32_t read_discovery(uint32_t address) {
+uint32_t read_discovery(int fd, uint32_t * address) {
     char buffer[BUFSIZE];
     static struct sockaddr_in returnAddr;
     memset(&returnAddr, 0, sizeof(returnAddr));
     returnAddr.sin_family = AF_INET;
     //returnAddr.sin_port = htons(SBS_UDP_PORT);
-    returnAddr.sin_addr.s_addr = address;
+    returnAddr.sin_addr.s_addr = *address;
     //returnAddr.sin_len = sizeof(returnAddr);
     socklen_t addrSize = sizeof(returnAddr);
     
-    ssize_t size = recvfrom(udpSocket,
+    ssize_t size = recvfrom(fd,
                             (void *)buffer,
                             sizeof(buffer),
                             MSG_DONTWAIT,
@@ -358,7 +483,7 @@ uint32_t read_discovery(uint32_t address) {
         }
         loginfo("discovery packet: port: %s", port);
     }
-    close(udpSocket);
+    *address = returnAddr.sin_addr.s_addr;
     
     return (uint32_t)strtoul(port, NULL, 10);
 }
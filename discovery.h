@@ -37,19 +37,30 @@
 
 #include "sbpd.h"
 
+struct reactor;
+
 //
-//  Polling function for server discovery
-//  Call from main loop
-//  Handles internal scheduling between different
+//  Start server discovery
+//  Runs on the main event loop: searches for the server every few
+//  seconds unless configured and listens for the port discovery reply.
 //
 //  Parameters:
+//  loop: event loop to run discovery on
 //  config: defines which parameters are preconfigured and will not be discovered
 //  discovered: the discovered parameters
 //  server: server configuration
 //
-void poll_discovery(sbpd_config_parameters_t config,
-                    sbpd_config_parameters_t *discovered,
-                    struct sbpd_server * server);
+void start_discovery(struct reactor * loop,
+                     sbpd_config_parameters_t config,
+                     sbpd_config_parameters_t *discovered,
+                     struct sbpd_server * server);
+
+//
+//  Search for the server the player is connected to right away,
+//  without waiting for the next search. Does nothing if the server
+//  is configured.
+//
+void discovery_search(void);
 
 
 //
@@ -0,0 +1,342 @@
+//
+//  evdev.c
+//  SqueezeButtonPi
+//
+//  Linux input device sources
+//  Keys and relative axes of kernel input drivers (gpio-keys, rotary-encoder, gpio-ir)
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "evdev.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <linux/input.h>
+
+#define KEY_BYTES   ((KEY_CNT + 7) / 8)
+#define KEY_BIT(keys, code) (((keys)[(code) / 8] >> ((code) % 8)) & 1)
+
+//
+//  Configured devices
+//
+static struct evdev_device {
+    char spec[128];         // path or device name
+    bool by_name;
+    bool grab;
+    int fd;                 // -1 while not present
+    char node[32];          // event node opened for a device name
+    bool monotonic;         // event times are CLOCK_MONOTONIC
+    bool dropped;           // events lost, skip up to the next SYN_REPORT and resync
+    uint8_t keys[KEY_BYTES];    // key states as last reported to the handler
+} devices[EVDEV_MAX_DEVICES];
+static int numberofdevices = 0;
+
+static int epoll_fd = -1;
+static int inotify_fd = -1;
+static evdev_handler_t handler = NULL;
+
+static uint64_t evdev_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int evdev_add(const char * spec, bool grab) {
+    for (int i = 0; i < numberofdevices; i++) {
+        if (strcmp(devices[i].spec, spec) == 0) {
+            devices[i].grab |= grab;
+            return i;
+        }
+    }
+    if (numberofdevices >= EVDEV_MAX_DEVICES) {
+        logerr("Maximum number of input devices exceded: %i", EVDEV_MAX_DEVICES);
+        return -1;
+    }
+    struct evdev_device * device = devices + numberofdevices;
+    snprintf(device->spec, sizeof(device->spec), "%s", spec);
+    device->by_name = (spec[0] != '/');
+    device->grab = grab;
+    device->fd = -1;
+    device->node[0] = '\0';
+    return numberofdevices++;
+}
+
+int evdev_count(void) {
+    return numberofdevices;
+}
+
+//
+//  Report key state changes to the handler
+//  Used after lost events with the state read from the device and when
+//  a device goes away with all keys released, then with release_value -1.
+//
+static void evdev_sync_keys(struct evdev_device * device, const uint8_t * keys, int32_t release_value) {
+    uint64_t now = evdev_time_ns();
+    for (int code = 0; code < KEY_CNT; code++) {
+        bool state = KEY_BIT(keys, code);
+        if (state == KEY_BIT(device->keys, code))
+            continue;
+        device->keys[code / 8] ^= (uint8_t)(1 << (code % 8));
+        handler((int)(device - devices), EV_KEY, (uint16_t)code, state ? 1 : release_value, now);
+    }
+}
+
+//
+//  Open a device node, for a device name only if the name matches
+//  Returns: true if the device is open
+//
+static bool evdev_open(struct evdev_device * device, const char * path) {
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if (device->by_name) {
+        char name[128] = "";
+        if (ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name) < 0 || strcmp(name, device->spec) != 0) {
+            close(fd);
+            return false;
+        }
+        snprintf(device->node, sizeof(device->node), "%s", path);
+    }
+
+    //  without the monotonic clock (not an event device) events get the time they are read
+    int clock = CLOCK_MONOTONIC;
+    device->monotonic = (ioctl(fd, EVIOCSCLOCKID, &clock) == 0);
+    bool grabbed = device->grab && (ioctl(fd, EVIOCGRAB, 1) == 0);
+    if (device->grab && !grabbed)
+        logwarn("Input device %s: could not grab, events also go to other readers", device->spec);
+    //  keys held now are released before they count
+    memset(device->keys, 0, sizeof(device->keys));
+    if (ioctl(fd, EVIOCGKEY(sizeof(device->keys)), device->keys) < 0)
+        memset(device->keys, 0, sizeof(device->keys));
+    device->dropped = false;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        logerr("Input device %s: could not wait for events", device->spec);
+        close(fd);
+        return false;
+    }
+    device->fd = fd;
+    loginfo("Input device %s opened: %s%s", device->spec, path, grabbed ? ", grabbed" : "");
+    return true;
+}
+
+static void evdev_close(struct evdev_device * device) {
+    static const uint8_t released[KEY_BYTES];
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+    close(device->fd);
+    device->fd = -1;
+    device->node[0] = '\0';
+    evdev_sync_keys(device, released, -1);
+}
+
+//
+//  Open devices that are present and not open yet
+//  Device names are matched against all event nodes not in use.
+//
+static void evdev_scan(void) {
+    bool by_name = false;
+    for (struct evdev_device * device = devices; device < devices + numberofdevices; device++) {
+        if (device->fd >= 0)
+            continue;
+        if (device->by_name)
+            by_name = true;
+        else
+            evdev_open(device, device->spec);
+    }
+    if (!by_name)
+        return;
+
+    DIR * dir = opendir(EVDEV_INPUT_DIR);
+    if (!dir)
+        return;
+    struct dirent * entry;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "event", 5) != 0)
+            continue;
+        char path[32];
+        snprintf(path, sizeof(path), EVDEV_INPUT_DIR "/%.20s", entry->d_name);
+        bool in_use = false;
+        for (int i = 0; i < numberofdevices; i++)
+            in_use |= (strcmp(devices[i].node, path) == 0);
+        for (struct evdev_device * device = devices; !in_use && device < devices + numberofdevices; device++) {
+            if (device->fd < 0 && device->by_name)
+                in_use = evdev_open(device, path);
+        }
+    }
+    closedir(dir);
+}
+
+//
+//  Watch a directory for new device nodes
+//
+static void evdev_watch(const char * dir) {
+    if (inotify_add_watch(inotify_fd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0)
+        logwarn("Input devices: can't watch %s, devices showing up later are not opened", dir);
+}
+
+int evdev_start(int epoll, evdev_handler_t event_handler) {
+    if (numberofdevices == 0)
+        return 0;
+    epoll_fd = epoll;
+    handler = event_handler;
+
+    //
+    //  Hotplug: new nodes in /dev/input and the directories of device paths
+    //
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd >= 0) {
+        evdev_watch(EVDEV_INPUT_DIR);
+        for (int i = 0; i < numberofdevices; i++) {
+            char dir[sizeof(devices[i].spec)];
+            if (devices[i].by_name)
+                continue;
+            snprintf(dir, sizeof(dir), "%s", devices[i].spec);
+            if (strcmp(dirname(dir), EVDEV_INPUT_DIR) != 0)
+                evdev_watch(dir);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = inotify_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ev);
+    } else {
+        logwarn("Input devices: no hotplug, devices need to be present at start");
+    }
+
+    evdev_scan();
+    for (int i = 0; i < numberofdevices; i++) {
+        if (devices[i].fd < 0)
+            loginfo("Input device %s not present, waiting for it", devices[i].spec);
+    }
+    return 0;
+}
+
+//
+//  Read a batch of events from a device
+//  After SYN_DROPPED the events up to the next SYN_REPORT are incomplete,
+//  the key states are read from the device instead.
+//
+static void evdev_read(struct evdev_device * device) {
+    struct input_event events[EVDEV_EVENT_BATCH];
+
+    ssize_t len = read(device->fd, events, sizeof(events));
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (len <= 0) {
+        loginfo("Input device %s removed", device->spec);
+        evdev_close(device);
+        return;
+    }
+
+    uint64_t now = 0;
+    int count = (int)(len / sizeof(struct input_event));
+    for (struct input_event * event = events; event < events + count; event++) {
+        if (event->type == EV_SYN) {
+            if (event->code == SYN_DROPPED) {
+                logwarn("Input device %s: events lost", device->spec);
+                device->dropped = true;
+            } else if (event->code == SYN_REPORT && device->dropped) {
+                uint8_t keys[KEY_BYTES];
+                device->dropped = false;
+                if (ioctl(device->fd, EVIOCGKEY(sizeof(keys)), keys) >= 0)
+                    evdev_sync_keys(device, keys, 0);
+            }
+            continue;
+        }
+        if (device->dropped)
+            continue;
+
+        uint64_t time_ns;
+        if (device->monotonic) {
+            time_ns = (uint64_t)event->input_event_sec * 1000000000 + (uint64_t)event->input_event_usec * 1000;
+        } else {
+            if (!now)
+                now = evdev_time_ns();
+            time_ns = now;
+        }
+        switch (event->type) {
+            case EV_KEY:
+                //  auto-repeat of the driver, buttons repeat on their own
+                if (event->value > 1 || event->code >= KEY_CNT)
+                    break;
+                if (KEY_BIT(device->keys, event->code) == (event->value != 0))
+                    break;
+                device->keys[event->code / 8] ^= (uint8_t)(1 << (event->code % 8));
+                handler((int)(device - devices), EV_KEY, event->code, event->value, time_ns);
+                break;
+            case EV_REL:
+                handler((int)(device - devices), EV_REL, event->code, event->value, time_ns);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+bool evdev_ready(int fd) {
+    if (fd < 0)
+        return false;
+    if (fd == inotify_fd) {
+        char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        while (read(inotify_fd, buffer, sizeof(buffer)) > 0)
+            ;
+        evdev_scan();
+        return true;
+    }
+    for (struct evdev_device * device = devices; device < devices + numberofdevices; device++) {
+        if (device->fd == fd) {
+            evdev_read(device);
+            return true;
+        }
+    }
+    return false;
+}
+
+void evdev_stop(void) {
+    for (struct evdev_device * device = devices; device < devices + numberofdevices; device++) {
+        if (device->fd >= 0) {
+            close(device->fd);
+            device->fd = -1;
+        }
+    }
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    inotify_fd = -1;
+}
@@ -0,0 +1,106 @@
+//
+//  evdev.h
+//  SqueezeButtonPi
+//
+//  Linux input device sources
+//  Keys and relative axes of kernel input drivers (gpio-keys, rotary-encoder, gpio-ir)
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef evdev_h
+#define evdev_h
+
+#include "sbpd.h"
+
+//
+//  Input devices are read by the GPIO input thread. Debouncing and
+//  decoding is done by the kernel driver, events arrive as input_event
+//  records with CLOCK_MONOTONIC timestamps.
+//
+//  Devices are given by path, e.g. /dev/input/event0 or a stable
+//  /dev/input/by-path/ link, or by the device name the driver reports,
+//  e.g. gpio-keys. Devices that are not present are opened when they
+//  show up, devices that go away release their held keys.
+//
+#define EVDEV_MAX_DEVICES   8
+#define EVDEV_INPUT_DIR     "/dev/input"
+
+//
+//  Number of input events fetched with a single read()
+//
+#define EVDEV_EVENT_BATCH   64
+
+//
+//  Handler for key and relative axis events
+//  Parameters:
+//      device: device index from evdev_add()
+//      type: EV_KEY or EV_REL
+//      code: key or axis code
+//      value: key 1 pressed, 0 released, -1 released as the device went away,
+//             axis relative movement
+//      time_ns: CLOCK_MONOTONIC time of the event
+//
+typedef void (*evdev_handler_t)(int device, uint16_t type, uint16_t code, int32_t value, uint64_t time_ns);
+
+//
+//  Add an input device
+//  Parameters:
+//      spec: device path, starting with "/", or device name
+//      grab: take the device exclusively, its events don't reach other readers
+//  Returns: device index, the index of the same device if already added,
+//           -1 if too many devices are configured
+//
+int evdev_add(const char * spec, bool grab);
+
+//
+//  Number of devices added
+//
+int evdev_count(void);
+
+//
+//  Open the devices and watch for devices showing up
+//  Parameters:
+//      epoll_fd: epoll set of the input thread, devices are added with their fd as data
+//      handler: called for every key and axis event
+//  Returns: 0 on success, -1 on error
+//
+int evdev_start(int epoll_fd, evdev_handler_t handler);
+
+//
+//  Handle a ready file descriptor of the input thread
+//  Returns: false if the descriptor does not belong to the input devices
+//
+bool evdev_ready(int fd);
+
+//
+//  Close all devices
+//
+void evdev_stop(void);
+
+#endif /* evdev_h */
@@ -0,0 +1,230 @@
+//
+//  eventqueue.c
+//  SqueezeButtonPi
+//
+//  Single producer/single consumer ring for input events
+//  between the GPIO input thread and the control code
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "eventqueue.h"
+#include "registry.h"
+#include "sbpd.h"
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+//
+//  The ring
+//  head is only written by the producer, tail only by the consumer.
+//  Both run freely, index with & (EVENTQUEUE_SIZE - 1).
+//
+static struct sbpd_event ring[EVENTQUEUE_SIZE];
+static uint32_t head = 0;
+static uint32_t tail = 0;
+
+//
+//  Consumer wakeup
+//  notified is the head at the last wakeup, producer only.
+//
+static int event_fd = -1;
+static uint32_t notified = 0;
+
+//
+//  Overflow accounting
+//  Events that did not fit are merged per element and kind.
+//  spilled is set by the producer after updating a slot,
+//  the consumer only looks at the slots when it is set.
+//  The slots are allocated from the registry, one per element id.
+//  Button downs and ups carry the state of chords, so the level is kept:
+//  SPILL_UP a release was lost, SPILL_DOWN the button was pressed again
+//  after it. Repeats are not kept.
+//
+static uint32_t overflows = 0;
+static uint32_t overflows_logged = 0;
+static uint32_t spilled = 0;
+static int spill_elements = 0;
+static uint32_t * spill_short = NULL;
+static uint32_t * spill_long = NULL;
+static int32_t * spill_delta = NULL;
+static uint8_t * spill_level = NULL;
+#define SPILL_UP    0x1
+#define SPILL_DOWN  0x2
+
+void eventqueue_alloc(int elements) {
+    spill_elements = elements;
+    spill_short = registry_alloc(REGISTRY_HOT, elements, sizeof(*spill_short));
+    spill_long = registry_alloc(REGISTRY_HOT, elements, sizeof(*spill_long));
+    spill_delta = registry_alloc(REGISTRY_HOT, elements, sizeof(*spill_delta));
+    spill_level = registry_alloc(REGISTRY_HOT, elements, sizeof(*spill_level));
+}
+
+static void spill(const struct sbpd_event * event) {
+    __atomic_add_fetch(&overflows, 1, __ATOMIC_RELAXED);
+    if (event->element >= spill_elements) {
+        logerr("Input event lost for element %d", event->element);
+        return;
+    }
+    switch (event->kind) {
+        case EVENT_SHORTPRESS:
+            __atomic_add_fetch(spill_short + event->element, 1, __ATOMIC_RELAXED);
+            break;
+        case EVENT_LONGPRESS:
+            __atomic_add_fetch(spill_long + event->element, 1, __ATOMIC_RELAXED);
+            break;
+        case EVENT_ENCODER:
+            __atomic_add_fetch(spill_delta + event->element, event->delta, __ATOMIC_RELAXED);
+            break;
+        case EVENT_BUTTON_DOWN:
+            __atomic_or_fetch(spill_level + event->element, SPILL_DOWN, __ATOMIC_RELAXED);
+            break;
+        case EVENT_BUTTON_UP:
+            //  released, an earlier down is obsolete
+            __atomic_store_n(spill_level + event->element, SPILL_UP, __ATOMIC_RELAXED);
+            break;
+        default:
+            //  repeats are not kept, the held button sends on with the next one
+            return;
+    }
+    __atomic_store_n(&spilled, 1, __ATOMIC_RELEASE);
+}
+
+int eventqueue_init(void) {
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0)
+        logerr("Could not create input event notification");
+    return event_fd;
+}
+
+//
+//  Wake up the consumer. Input thread only.
+//
+void eventqueue_notify(void) {
+    uint32_t h = head;
+    if (h == notified && !__atomic_load_n(&spilled, __ATOMIC_RELAXED))
+        return;
+    notified = h;
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0)
+        logdebug("Input event notification failed");
+}
+
+void eventqueue_ack(void) {
+    uint64_t count;
+    if (read(event_fd, &count, sizeof(count)) < 0)
+        logdebug("No input event notification pending");
+}
+
+//
+//  Queue an event. Input thread only.
+//
+void eventqueue_push(const struct sbpd_event * event) {
+    uint32_t h = head;
+    if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= EVENTQUEUE_SIZE) {
+        spill(event);
+        return;
+    }
+    ring[h & (EVENTQUEUE_SIZE - 1)] = *event;
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+}
+
+//
+//  Deliver one spilled event, if any
+//  Spilled events get the time they are delivered. A lost release goes
+//  first, so the presses are not swallowed by a chord still thought held,
+//  a press that is still down goes last.
+//
+static bool pop_spilled(struct sbpd_event * event) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    event->timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    event->duration = 0;
+    event->delta = 0;
+
+    for (uint16_t element = 0; element < spill_elements; element++) {
+        event->element = element;
+        if (__atomic_fetch_and(spill_level + element, ~SPILL_UP, __ATOMIC_RELAXED) & SPILL_UP) {
+            event->kind = EVENT_BUTTON_UP;
+            return true;
+        }
+        if (__atomic_load_n(spill_short + element, __ATOMIC_RELAXED)) {
+            __atomic_sub_fetch(spill_short + element, 1, __ATOMIC_RELAXED);
+            event->kind = EVENT_SHORTPRESS;
+            return true;
+        }
+        if (__atomic_load_n(spill_long + element, __ATOMIC_RELAXED)) {
+            __atomic_sub_fetch(spill_long + element, 1, __ATOMIC_RELAXED);
+            event->kind = EVENT_LONGPRESS;
+            return true;
+        }
+        int32_t delta = __atomic_exchange_n(spill_delta + element, 0, __ATOMIC_RELAXED);
+        if (delta) {
+            event->kind = EVENT_ENCODER;
+            event->delta = delta;
+            return true;
+        }
+        if (__atomic_fetch_and(spill_level + element, ~SPILL_DOWN, __ATOMIC_RELAXED) & SPILL_DOWN) {
+            event->kind = EVENT_BUTTON_DOWN;
+            return true;
+        }
+    }
+    return false;
+}
+
+//
+//  Fetch the next event. Main loop only.
+//
+bool eventqueue_pop(struct sbpd_event * event) {
+    uint32_t t = tail;
+    if (t != __atomic_load_n(&head, __ATOMIC_ACQUIRE)) {
+        *event = ring[t & (EVENTQUEUE_SIZE - 1)];
+        __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    //
+    //  Ring is empty, pick up what didn't fit.
+    //  Clear the flag first so a spill during the scan sets it again.
+    //
+    if (__atomic_exchange_n(&spilled, 0, __ATOMIC_ACQUIRE)) {
+        if (overflows_logged != eventqueue_overflows()) {
+            overflows_logged = eventqueue_overflows();
+            logwarn("Input event queue overflow, %u events so far", overflows_logged);
+        }
+        if (pop_spilled(event)) {
+            __atomic_store_n(&spilled, 1, __ATOMIC_RELEASE);  // there may be more
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t eventqueue_overflows(void) {
+    return __atomic_load_n(&overflows, __ATOMIC_RELAXED);
+}
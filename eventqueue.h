@@ -0,0 +1,111 @@
+//
+//  eventqueue.h
+//  SqueezeButtonPi
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef eventqueue_h
+#define eventqueue_h
+
+#include "sbpd.h"
+
+//
+//  Input events passed from the GPIO input thread to the control code
+//  Lock-free ring with exactly one producer (input thread)
+//  and one consumer (main loop).
+//
+
+//
+//  Event kinds
+//
+#define EVENT_SHORTPRESS    1
+#define EVENT_LONGPRESS     2
+#define EVENT_ENCODER       3
+#define EVENT_REPEAT        4   // button held, auto-repeat
+#define EVENT_BUTTON_DOWN   5   // button pressed, no action yet
+#define EVENT_BUTTON_UP     6   // button released, after its press event
+
+struct sbpd_event {
+    uint64_t timestamp_ns;  // CLOCK_MONOTONIC time of the edge completing the event
+    uint16_t element;       // button or encoder id
+    uint8_t kind;           // one of the EVENT_ kinds
+    int32_t delta;          // encoder: steps or detents, signed
+    uint32_t duration;      // button: press duration in ms
+};
+
+//
+//  Ring size, must be a power of 2
+//
+#define EVENTQUEUE_SIZE     256
+//
+//  Allocate the overflow slots from the registry, see registry_alloc()
+//  Parameters:
+//      elements: number of element ids, the larger of buttons and encoders
+//
+void eventqueue_alloc(int elements);
+
+//
+//  Create the eventfd signalling queued events
+//  Returns: the eventfd to wait on, negative on error
+//
+int eventqueue_init(void);
+
+//
+//  Wake up the consumer. Input thread only.
+//  Called after a batch of events was queued, does nothing if
+//  nothing was queued since the last call.
+//
+void eventqueue_notify(void);
+
+//
+//  Reset the eventfd. Main loop only, call before draining the queue.
+//
+void eventqueue_ack(void);
+
+//
+//  Queue an event. Input thread only.
+//  When the ring is full the event is not dropped: presses are counted,
+//  encoder deltas summed and the last button level kept per element and
+//  delivered after the ring drained. Repeats are dropped. Every such
+//  event counts as an overflow.
+//
+void eventqueue_push(const struct sbpd_event * event);
+
+//
+//  Fetch the next event. Main loop only.
+//  Returns: false if there is no event
+//
+bool eventqueue_pop(struct sbpd_event * event);
+
+//
+//  Number of events that did not fit into the ring
+//
+uint32_t eventqueue_overflows(void);
+
+#endif /* eventqueue_h */
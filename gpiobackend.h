@@ -0,0 +1,105 @@
+//
+//  gpiobackend.h
+//  SqueezeButtonPi
+//
+//  GPIO backend interface
+//  Hardware access of the input engine goes through one of these backends
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef gpiobackend_h
+#define gpiobackend_h
+
+#include "sbpd.h"
+#include <linux/gpio.h>
+
+//
+//  Line bias, numbered like the "resist" element parameter
+//
+#define GPIO_PUD_OFF    0
+#define GPIO_PUD_DOWN   1
+#define GPIO_PUD_UP     2
+
+//
+//  GPIO backend
+//  All backends report edges as struct gpio_v2_line_event records, the
+//  format of the GPIO character device, read from a pollable descriptor.
+//  Timestamps are CLOCK_MONOTONIC nanoseconds.
+//
+//      open:        open the device. Returns a handle or -1 on error
+//      close:       close the handle from open
+//      request:     set up input lines with bias and edge detection on both edges.
+//                   Returns the descriptor events are read from or -1 on error
+//      release:     release the lines of request
+//      get_values:  current levels, bit n is the level of the n-th requested line
+//                   Returns 0 on success, -1 on error
+//      read_events: read pending events. Returns number of events read,
+//                   0 if none pending, -1 on error
+//      request_scan: set up the lines of a key matrix, without edge detection.
+//                   Rows are open drain outputs, released (high) at start,
+//                   columns inputs with pull-up. Line n of the request is
+//                   rows[n] for n < num_rows, the columns follow.
+//                   Returns the request descriptor or -1 on error
+//      set_values:  set output levels of the lines in mask, bit n is the n-th
+//                   requested line. Returns 0 on success, -1 on error
+//
+struct gpio_backend {
+    const char * name;
+    int  (*open)(const char * device);
+    void (*close)(int handle);
+    int  (*request)(int handle, const unsigned int * offsets, const int * resist, int num_lines);
+    void (*release)(int req_fd);
+    int  (*get_values)(int req_fd, int num_lines, uint64_t * bits);
+    int  (*read_events)(int req_fd, struct gpio_v2_line_event * events, int max_events);
+    int  (*request_scan)(int handle, const unsigned int * rows, int num_rows,
+                         const unsigned int * cols, int num_cols);
+    int  (*set_values)(int req_fd, uint64_t mask, uint64_t bits);
+};
+
+//
+//  Available backends
+//      chardev  - Linux GPIO character device, see gpiochip.h <default>
+//      sim      - simulated lines fed from a script or FIFO, see gpiosim.c
+//      wiringpi - wiringPi library, only if built with WIRINGPI=1
+//
+extern const struct gpio_backend gpiochip_backend;
+extern const struct gpio_backend gpiosim_backend;
+#ifdef USE_WIRINGPI
+extern const struct gpio_backend gpiowpi_backend;
+#endif
+
+#define GPIO_BACKEND_DEFAULT "chardev"
+
+//
+//  Find a backend by name
+//  Returns: the backend or NULL if there is none by that name
+//
+const struct gpio_backend * gpio_backend_find(const char * name);
+
+#endif /* gpiobackend_h */
@@ -0,0 +1,222 @@
+//
+//  gpiochip.c
+//  SqueezeButtonPi
+//
+//  Linux GPIO character device (uAPI v2) access
+//  Requests lines with edge detection and reads kernel timestamped line events
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "gpiochip.h"
+#include "sbpd.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define GPIOCHIP_CONSUMER "sbpd"
+
+//
+//  Open the GPIO character device
+//
+int gpiochip_open(const char * path) {
+    if (!path)
+        path = GPIOCHIP_DEFAULT;
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        logerr("Could not open GPIO device %s: %s", path, strerror(errno));
+        return -1;
+    }
+    loginfo("Opened GPIO device %s", path);
+    return fd;
+}
+
+void gpiochip_close(int chip_fd) {
+    if (chip_fd >= 0)
+        close(chip_fd);
+}
+
+//
+//  Bias flags for the "resist" parameter values
+//
+static uint64_t bias_flags(int resist) {
+    switch (resist) {
+        case GPIO_PUD_OFF:
+            return GPIO_V2_LINE_FLAG_BIAS_DISABLED;
+        case GPIO_PUD_DOWN:
+            return GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+        default:
+            return GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+    }
+}
+
+//
+//  Request input lines with edge detection on both edges
+//  Lines default to pull-up, lines with other bias get a flags attribute
+//
+int gpiochip_request_inputs(int chip_fd, const unsigned int * offsets, const int * resist, int num_lines) {
+    const uint64_t base = GPIO_V2_LINE_FLAG_INPUT |
+                          GPIO_V2_LINE_FLAG_EDGE_RISING |
+                          GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    struct gpio_v2_line_request req;
+
+    if (num_lines < 1 || num_lines > GPIO_V2_LINES_MAX)
+        return -1;
+
+    memset(&req, 0, sizeof(req));
+    req.num_lines = num_lines;
+    strncpy(req.consumer, GPIOCHIP_CONSUMER, sizeof(req.consumer) - 1);
+    req.event_buffer_size = num_lines * GPIOCHIP_EVENT_BATCH;
+    req.config.flags = base | bias_flags(GPIO_PUD_UP);
+
+    for (int i = 0; i < num_lines; i++) {
+        req.offsets[i] = offsets[i];
+        if (bias_flags(resist[i]) == bias_flags(GPIO_PUD_UP))
+            continue;
+        //  one attribute per bias setting in use
+        uint64_t flags = base | bias_flags(resist[i]);
+        unsigned int attr = 0;
+        while (attr < req.config.num_attrs && req.config.attrs[attr].attr.flags != flags)
+            attr++;
+        if (attr == req.config.num_attrs) {
+            req.config.attrs[attr].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+            req.config.attrs[attr].attr.flags = flags;
+            req.config.num_attrs++;
+        }
+        req.config.attrs[attr].mask |= 1ULL << i;
+    }
+
+    if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        logerr("Could not request %d GPIO lines: %s", num_lines, strerror(errno));
+        return -1;
+    }
+    return req.fd;
+}
+
+//
+//  Request the lines of a key matrix
+//  Columns use the request flags, rows get an open drain output attribute
+//  and their start level.
+//
+int gpiochip_request_scan(int chip_fd, const unsigned int * rows, int num_rows,
+                          const unsigned int * cols, int num_cols) {
+    struct gpio_v2_line_request req;
+    int num_lines = num_rows + num_cols;
+
+    if (num_rows < 1 || num_cols < 1 || num_lines > GPIO_V2_LINES_MAX)
+        return -1;
+
+    uint64_t row_mask = (1ULL << num_rows) - 1;
+    memset(&req, 0, sizeof(req));
+    req.num_lines = num_lines;
+    strncpy(req.consumer, GPIOCHIP_CONSUMER, sizeof(req.consumer) - 1);
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | bias_flags(GPIO_PUD_UP);
+    req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+    req.config.attrs[0].attr.flags = GPIO_V2_LINE_FLAG_OUTPUT | GPIO_V2_LINE_FLAG_OPEN_DRAIN;
+    req.config.attrs[0].mask = row_mask;
+    req.config.attrs[1].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    req.config.attrs[1].attr.values = row_mask;
+    req.config.attrs[1].mask = row_mask;
+    req.config.num_attrs = 2;
+    for (int i = 0; i < num_rows; i++)
+        req.offsets[i] = rows[i];
+    for (int i = 0; i < num_cols; i++)
+        req.offsets[num_rows + i] = cols[i];
+
+    if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        logerr("Could not request %d GPIO lines for the key matrix: %s", num_lines, strerror(errno));
+        return -1;
+    }
+    return req.fd;
+}
+
+void gpiochip_release(int req_fd) {
+    if (req_fd >= 0)
+        close(req_fd);
+}
+
+//
+//  Read current line levels of a request
+//
+int gpiochip_get_values(int req_fd, int num_lines, uint64_t * bits) {
+    struct gpio_v2_line_values values;
+
+    memset(&values, 0, sizeof(values));
+    values.mask = (num_lines >= 64) ? ~0ULL : ((1ULL << num_lines) - 1);
+    if (ioctl(req_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) {
+        logerr("Could not read GPIO values: %s", strerror(errno));
+        return -1;
+    }
+    *bits = values.bits;
+    return 0;
+}
+
+//
+//  Set output levels
+//
+int gpiochip_set_values(int req_fd, uint64_t mask, uint64_t bits) {
+    struct gpio_v2_line_values values;
+
+    values.mask = mask;
+    values.bits = bits;
+    if (ioctl(req_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0) {
+        logerr("Could not set GPIO values: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+//
+//  Read pending edge events
+//  The kernel hands out whole events only, so a short read can't happen.
+//
+int gpiochip_read_events(int req_fd, struct gpio_v2_line_event * events, int max_events) {
+    ssize_t len = read(req_fd, events, max_events * sizeof(*events));
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return 0;
+        logerr("Error reading GPIO events: %s", strerror(errno));
+        return -1;
+    }
+    return (int)(len / sizeof(*events));
+}
+
+const struct gpio_backend gpiochip_backend = {
+    .name = "chardev",
+    .open = gpiochip_open,
+    .close = gpiochip_close,
+    .request = gpiochip_request_inputs,
+    .release = gpiochip_release,
+    .get_values = gpiochip_get_values,
+    .read_events = gpiochip_read_events,
+    .request_scan = gpiochip_request_scan,
+    .set_values = gpiochip_set_values,
+};
@@ -0,0 +1,111 @@
+//
+//  gpiochip.h
+//  SqueezeButtonPi
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef gpiochip_h
+#define gpiochip_h
+
+#include "sbpd.h"
+#include "gpiobackend.h"
+
+//
+//  Default GPIO character device. The 40 pin header of all Raspberry Pi
+//  models up to the Pi 4 and current Pi 5 kernels is on gpiochip0.
+//
+#define GPIOCHIP_DEFAULT    "/dev/gpiochip0"
+
+//
+//  Number of line events fetched with a single read()
+//
+#define GPIOCHIP_EVENT_BATCH 16
+
+//
+//  Open the GPIO character device
+//  Parameters:
+//      path: device path, e.g. /dev/gpiochip0. NULL for the default
+//  Returns: chip file descriptor or -1 on error
+//
+int gpiochip_open(const char * path);
+
+void gpiochip_close(int chip_fd);
+
+//
+//  Request input lines with edge detection on both edges
+//  All lines go into one request, so the kernel reports their events
+//  through a single file descriptor in the order they happened.
+//  Events carry CLOCK_MONOTONIC kernel timestamps.
+//
+//  Parameters:
+//      chip_fd: chip file descriptor from gpiochip_open()
+//      offsets: line offsets (BCM pin numbers on the Raspberry Pi)
+//      resist: bias for each line, one of GPIO_PUD_OFF, GPIO_PUD_DOWN, GPIO_PUD_UP
+//      num_lines: number of lines in offsets and resist
+//  Returns: line request file descriptor or -1 on error
+//
+int gpiochip_request_inputs(int chip_fd,
+                            const unsigned int * offsets,
+                            const int * resist,
+                            int num_lines);
+
+void gpiochip_release(int req_fd);
+
+//
+//  Read current line levels of a request
+//  Bit n of the result is the level of the n-th requested line.
+//  Returns: 0 on success, -1 on error
+//
+int gpiochip_get_values(int req_fd, int num_lines, uint64_t * bits);
+
+//
+//  Request the lines of a key matrix
+//  Rows are open drain outputs, released at start, columns inputs with
+//  pull-up. No edge detection, the matrix is scanned.
+//  Returns: line request file descriptor or -1 on error
+//
+int gpiochip_request_scan(int chip_fd,
+                          const unsigned int * rows, int num_rows,
+                          const unsigned int * cols, int num_cols);
+
+//
+//  Set output levels of the lines in mask
+//  Bit n is the level of the n-th requested line.
+//  Returns: 0 on success, -1 on error
+//
+int gpiochip_set_values(int req_fd, uint64_t mask, uint64_t bits);
+
+//
+//  Read pending edge events of a line request
+//  Blocks if no event is pending and the descriptor is blocking.
+//  Returns: number of events read, 0 if none pending, -1 on error
+//
+int gpiochip_read_events(int req_fd, struct gpio_v2_line_event * events, int max_events);
+
+#endif /* gpiochip_h */
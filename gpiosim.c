@@ -0,0 +1,323 @@
+//
+//  gpiosim.c
+//  SqueezeButtonPi
+//
+//  Simulated GPIO backend
+//  Replays line changes from a script or FIFO, so the input engine runs without GPIO hardware
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#define _GNU_SOURCE     // pipe2()
+#include "gpiobackend.h"
+#include "gpiochip.h"
+#include "sbpd.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+//
+//  Script format, one line change per line:
+//
+//      <pin> <level> [<delay>]
+//
+//  pin: a requested line (BCM pin number), level: 0 or 1,
+//  delay: milliseconds to wait before the change, default 0.
+//  Empty lines and lines starting with # are ignored.
+//
+//  Keys of a key matrix are given as <row pin>x<column pin>, level 1
+//  presses, 0 releases the key. A column reads low while a key connects
+//  it to a row driven low by the scan.
+//
+//  The source is a regular file, a FIFO or "-" for stdin. A FIFO is opened
+//  read/write so it stays open between writers, e.g.
+//      mkfifo /tmp/gpio && sbpd -B sim -g /tmp/gpio b,17,PLAY &
+//      echo "17 0" > /tmp/gpio; sleep 0.2; echo "17 1" > /tmp/gpio
+//
+//  Lines start at the level their bias pulls them to: high for pull-up,
+//  low otherwise. Changes to the current level are ignored like on real
+//  hardware. Events are passed through a pipe, so they are read exactly
+//  like the events of a GPIO line request.
+//
+static FILE * sim_source = NULL;
+static int sim_pipe[2] = { -1, -1 };
+static pthread_t sim_thread;
+static bool sim_running = false;
+static unsigned int sim_offsets[GPIO_V2_LINES_MAX];
+static int sim_lines = 0;
+static uint64_t sim_start_levels = 0;
+static uint64_t sim_levels = 0;
+static uint64_t sim_seqno = 0;
+
+//
+//  Key matrix, sim_keys[row] holds the pressed columns of a row
+//
+static int sim_scan_fd = -1;
+static unsigned int sim_rows[GPIO_V2_LINES_MAX];
+static unsigned int sim_cols[GPIO_V2_LINES_MAX];
+static int sim_num_rows = 0;
+static int sim_num_cols = 0;
+static uint64_t sim_row_levels = 0;
+static uint64_t sim_keys[GPIO_V2_LINES_MAX];
+
+static int sim_open(const char * device) {
+    if (!device) {
+        logerr("Simulated GPIO needs a script or FIFO, set it with -g");
+        return -1;
+    }
+    if (strcmp(device, "-") == 0) {
+        sim_source = stdin;
+    } else {
+        struct stat st;
+        bool fifo = (stat(device, &st) == 0) && S_ISFIFO(st.st_mode);
+        sim_source = fopen(device, fifo ? "r+e" : "re");
+    }
+    if (!sim_source) {
+        logerr("Could not open GPIO simulation %s: %s", device, strerror(errno));
+        return -1;
+    }
+    loginfo("Simulating GPIO from %s", device);
+    return fileno(sim_source);
+}
+
+static void sim_close(int handle) {
+    if (sim_source && sim_source != stdin)
+        fclose(sim_source);
+    sim_source = NULL;
+}
+
+static void sim_wait(int delay) {
+    if (delay > 0) {
+        struct timespec wait = { delay / 1000, (delay % 1000) * 1000000L };
+        while (nanosleep(&wait, &wait) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+//
+//  Press or release a matrix key
+//
+static bool sim_key(const char * line) {
+    unsigned int row_pin, col_pin;
+    int level, delay = 0;
+    int fields = sscanf(line, "%ux%u %d %d", &row_pin, &col_pin, &level, &delay);
+    if (fields < 3 || level < 0 || level > 1 || delay < 0)
+        return false;
+    sim_wait(delay);
+
+    int num_rows = __atomic_load_n(&sim_num_rows, __ATOMIC_ACQUIRE);
+    int num_cols = __atomic_load_n(&sim_num_cols, __ATOMIC_ACQUIRE);
+    int row = 0, col = 0;
+    while (row < num_rows && sim_rows[row] != row_pin)
+        row++;
+    while (col < num_cols && sim_cols[col] != col_pin)
+        col++;
+    if (row == num_rows || col == num_cols) {
+        logerr("GPIO simulation: no key matrix key %ux%u", row_pin, col_pin);
+        return true;
+    }
+    if (level)
+        __atomic_or_fetch(sim_keys + row, 1ULL << col, __ATOMIC_RELAXED);
+    else
+        __atomic_and_fetch(sim_keys + row, ~(1ULL << col), __ATOMIC_RELAXED);
+    return true;
+}
+
+//
+//  Apply one script line, returns false at a syntax error
+//
+static bool sim_change(const char * line) {
+    unsigned int pin;
+    int level, delay = 0;
+    if (strchr(line, 'x'))
+        return sim_key(line);
+    int fields = sscanf(line, "%u %d %d", &pin, &level, &delay);
+    if (fields < 2 || level < 0 || level > 1 || delay < 0)
+        return false;
+    sim_wait(delay);
+
+    int lines = __atomic_load_n(&sim_lines, __ATOMIC_ACQUIRE);
+    int index = 0;
+    while (index < lines && sim_offsets[index] != pin)
+        index++;
+    if (index == lines) {
+        logerr("GPIO simulation: GPIO %u is not configured", pin);
+        return true;
+    }
+    uint64_t bit = 1ULL << index;
+    if (((sim_levels & bit) != 0) == level)
+        return true;
+    sim_levels ^= bit;
+
+    struct gpio_v2_line_event event;
+    struct timespec now;
+    memset(&event, 0, sizeof(event));
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    event.timestamp_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    event.id = level ? GPIO_V2_LINE_EVENT_RISING_EDGE : GPIO_V2_LINE_EVENT_FALLING_EDGE;
+    event.offset = pin;
+    event.seqno = (uint32_t)++sim_seqno;
+    //  events are smaller than PIPE_BUF, so writes never interleave
+    if (write(sim_pipe[1], &event, sizeof(event)) < 0)
+        logerr("GPIO simulation: could not pass event: %s", strerror(errno));
+    return true;
+}
+
+static void * sim_loop(void * arg) {
+    char line[128];
+    int number = 0;
+
+    while (fgets(line, sizeof(line), sim_source)) {
+        number++;
+        char * text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\n' || *text == '\0')
+            continue;
+        if (!sim_change(text))
+            logerr("GPIO simulation: invalid line %d: %s", number, line);
+    }
+    loginfo("GPIO simulation ended after %d lines", number);
+    return NULL;
+}
+
+//
+//  Start replaying the script with the first request
+//
+static int sim_start(void) {
+    if (sim_running)
+        return 0;
+    if (pthread_create(&sim_thread, NULL, sim_loop, NULL) != 0) {
+        logerr("GPIO simulation: could not start");
+        return -1;
+    }
+    sim_running = true;
+    return 0;
+}
+
+static int sim_request(int handle, const unsigned int * offsets, const int * resist, int num_lines) {
+    if (num_lines < 1 || num_lines > GPIO_V2_LINES_MAX)
+        return -1;
+    if (pipe2(sim_pipe, O_CLOEXEC) < 0 ||
+        fcntl(sim_pipe[0], F_SETFL, O_NONBLOCK) < 0) {
+        logerr("GPIO simulation: could not create event pipe: %s", strerror(errno));
+        return -1;
+    }
+    sim_levels = 0;
+    for (int i = 0; i < num_lines; i++) {
+        sim_offsets[i] = offsets[i];
+        if (resist[i] == GPIO_PUD_UP)
+            sim_levels |= 1ULL << i;
+    }
+    sim_start_levels = sim_levels;
+    //  the script thread may run already for the matrix, publish the lines last
+    __atomic_store_n(&sim_lines, num_lines, __ATOMIC_RELEASE);
+    if (sim_start() < 0)
+        return -1;
+    return sim_pipe[0];
+}
+
+static void sim_release(int req_fd) {
+    if (sim_running) {
+        pthread_cancel(sim_thread);
+        pthread_join(sim_thread, NULL);
+        sim_running = false;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (sim_pipe[i] >= 0)
+            close(sim_pipe[i]);
+        sim_pipe[i] = -1;
+    }
+    if (sim_scan_fd >= 0)
+        close(sim_scan_fd);
+    sim_scan_fd = -1;
+}
+
+//
+//  Key matrix lines
+//  The request descriptor is an eventfd, it only tells the request apart.
+//
+static int sim_request_scan(int handle, const unsigned int * rows, int num_rows,
+                            const unsigned int * cols, int num_cols) {
+    if (num_rows < 1 || num_cols < 1 || num_rows + num_cols > GPIO_V2_LINES_MAX)
+        return -1;
+    for (int i = 0; i < num_rows; i++)
+        sim_rows[i] = rows[i];
+    for (int i = 0; i < num_cols; i++)
+        sim_cols[i] = cols[i];
+    sim_row_levels = (1ULL << num_rows) - 1;
+    sim_scan_fd = eventfd(0, EFD_CLOEXEC);
+    //  the script thread may run already, publish the matrix last
+    __atomic_store_n(&sim_num_cols, num_cols, __ATOMIC_RELEASE);
+    __atomic_store_n(&sim_num_rows, num_rows, __ATOMIC_RELEASE);
+    if (sim_scan_fd < 0 || sim_start() < 0)
+        return -1;
+    return sim_scan_fd;
+}
+
+static int sim_set_values(int req_fd, uint64_t mask, uint64_t bits) {
+    if (req_fd != sim_scan_fd)
+        return -1;
+    sim_row_levels = (sim_row_levels & ~mask) | (bits & mask);
+    return 0;
+}
+
+//
+//  Levels at the time of the request, later changes all come as events
+//  For the key matrix the rows as set and columns pulled low by pressed
+//  keys in rows driven low.
+//
+static int sim_get_values(int req_fd, int num_lines, uint64_t * bits) {
+    if (req_fd == sim_scan_fd) {
+        uint64_t cols = (1ULL << sim_num_cols) - 1;
+        for (int row = 0; row < sim_num_rows; row++) {
+            if (!(sim_row_levels & (1ULL << row)))
+                cols &= ~__atomic_load_n(sim_keys + row, __ATOMIC_RELAXED);
+        }
+        *bits = sim_row_levels | (cols << sim_num_rows);
+        return 0;
+    }
+    *bits = sim_start_levels;
+    return 0;
+}
+
+const struct gpio_backend gpiosim_backend = {
+    .name = "sim",
+    .open = sim_open,
+    .close = sim_close,
+    .request = sim_request,
+    .release = sim_release,
+    .get_values = sim_get_values,
+    .read_events = gpiochip_read_events,
+    .request_scan = sim_request_scan,
+    .set_values = sim_set_values,
+};
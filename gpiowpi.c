@@ -0,0 +1,224 @@
+//
+//  gpiowpi.c
+//  SqueezeButtonPi
+//
+//  wiringPi GPIO backend
+//  For systems without the GPIO character device. Built with make WIRINGPI=1
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#define _GNU_SOURCE     // pipe2()
+#include "gpiobackend.h"
+#include "gpiochip.h"
+#include "sbpd.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <wiringPi.h>
+
+//
+//  wiringPi calls interrupt handlers without telling which pin changed,
+//  from one thread per pin. The handler compares all lines against their
+//  last level and passes changes through a pipe as line events, so they
+//  are read like the events of a GPIO line request.
+//  Timestamps are taken in the handler, not when the edge happened.
+//
+static pthread_mutex_t wpi_lock = PTHREAD_MUTEX_INITIALIZER;
+static int wpi_pipe[2] = { -1, -1 };
+static unsigned int wpi_offsets[GPIO_V2_LINES_MAX];
+static int wpi_lines = 0;
+static uint64_t wpi_levels = 0;
+static uint64_t wpi_seqno = 0;
+
+static int wpi_open(const char * device) {
+    //  BCM pin numbering, like the character device line offsets
+    if (wiringPiSetupGpio() < 0) {
+        logerr("Could not initialize wiringPi");
+        return -1;
+    }
+    loginfo("Using wiringPi for GPIO");
+    return 0;
+}
+
+static void wpi_close(int handle) {
+}
+
+static void wpi_isr(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&wpi_lock);
+    for (int i = 0; i < wpi_lines; i++) {
+        uint64_t bit = 1ULL << i;
+        int level = digitalRead(wpi_offsets[i]) == HIGH;
+        if (((wpi_levels & bit) != 0) == level)
+            continue;
+        wpi_levels ^= bit;
+
+        struct gpio_v2_line_event event;
+        memset(&event, 0, sizeof(event));
+        event.timestamp_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+        event.id = level ? GPIO_V2_LINE_EVENT_RISING_EDGE : GPIO_V2_LINE_EVENT_FALLING_EDGE;
+        event.offset = wpi_offsets[i];
+        event.seqno = (uint32_t)++wpi_seqno;
+        if (wpi_pipe[1] >= 0 && write(wpi_pipe[1], &event, sizeof(event)) < 0)
+            logerr("wiringPi: could not pass event: %s", strerror(errno));
+    }
+    pthread_mutex_unlock(&wpi_lock);
+}
+
+static int wpi_request(int handle, const unsigned int * offsets, const int * resist, int num_lines) {
+    if (num_lines < 1 || num_lines > GPIO_V2_LINES_MAX)
+        return -1;
+    if (pipe2(wpi_pipe, O_CLOEXEC) < 0 ||
+        fcntl(wpi_pipe[0], F_SETFL, O_NONBLOCK) < 0) {
+        logerr("wiringPi: could not create event pipe: %s", strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&wpi_lock);
+    wpi_lines = num_lines;
+    wpi_levels = 0;
+    for (int i = 0; i < num_lines; i++) {
+        wpi_offsets[i] = offsets[i];
+        pinMode(offsets[i], INPUT);
+        //  GPIO_PUD_ values match wiringPi's PUD_OFF, PUD_DOWN and PUD_UP
+        pullUpDnControl(offsets[i], resist[i]);
+        if (digitalRead(offsets[i]) == HIGH)
+            wpi_levels |= 1ULL << i;
+    }
+    pthread_mutex_unlock(&wpi_lock);
+
+    for (int i = 0; i < num_lines; i++) {
+        if (wiringPiISR(offsets[i], INT_EDGE_BOTH, wpi_isr) < 0) {
+            logerr("wiringPi: could not set up interrupt for GPIO %u", offsets[i]);
+            return -1;
+        }
+    }
+    return wpi_pipe[0];
+}
+
+//
+//  Key matrix
+//  wiringPi has no open drain outputs. Released rows are inputs,
+//  a row driven low is an output.
+//
+static int wpi_scan_fd = -1;
+static unsigned int wpi_scan_lines[GPIO_V2_LINES_MAX];
+static int wpi_scan_rows = 0;
+static int wpi_scan_num = 0;
+
+static int wpi_request_scan(int handle, const unsigned int * rows, int num_rows,
+                            const unsigned int * cols, int num_cols) {
+    if (num_rows < 1 || num_cols < 1 || num_rows + num_cols > GPIO_V2_LINES_MAX)
+        return -1;
+    wpi_scan_rows = num_rows;
+    wpi_scan_num = num_rows + num_cols;
+    for (int i = 0; i < num_rows; i++) {
+        wpi_scan_lines[i] = rows[i];
+        pullUpDnControl(rows[i], PUD_OFF);
+        pinMode(rows[i], INPUT);
+    }
+    for (int i = 0; i < num_cols; i++) {
+        wpi_scan_lines[num_rows + i] = cols[i];
+        pinMode(cols[i], INPUT);
+        pullUpDnControl(cols[i], PUD_UP);
+    }
+    //  the descriptor only tells the request apart
+    wpi_scan_fd = eventfd(0, EFD_CLOEXEC);
+    return wpi_scan_fd;
+}
+
+static int wpi_set_values(int req_fd, uint64_t mask, uint64_t bits) {
+    if (req_fd != wpi_scan_fd)
+        return -1;
+    for (int i = 0; i < wpi_scan_rows; i++) {
+        if (!(mask & (1ULL << i)))
+            continue;
+        if (bits & (1ULL << i)) {
+            pinMode(wpi_scan_lines[i], INPUT);
+        } else {
+            digitalWrite(wpi_scan_lines[i], LOW);
+            pinMode(wpi_scan_lines[i], OUTPUT);
+        }
+    }
+    return 0;
+}
+
+//
+//  wiringPi can't remove interrupt handlers, they stop passing events
+//
+static void wpi_release(int req_fd) {
+    if (req_fd == wpi_scan_fd) {
+        for (int i = 0; i < wpi_scan_rows; i++)
+            pinMode(wpi_scan_lines[i], INPUT);
+        close(wpi_scan_fd);
+        wpi_scan_fd = -1;
+        return;
+    }
+    pthread_mutex_lock(&wpi_lock);
+    for (int i = 0; i < 2; i++) {
+        if (wpi_pipe[i] >= 0)
+            close(wpi_pipe[i]);
+        wpi_pipe[i] = -1;
+    }
+    wpi_lines = 0;
+    pthread_mutex_unlock(&wpi_lock);
+}
+
+static int wpi_get_values(int req_fd, int num_lines, uint64_t * bits) {
+    if (req_fd == wpi_scan_fd) {
+        *bits = 0;
+        for (int i = 0; i < wpi_scan_num; i++) {
+            if (digitalRead(wpi_scan_lines[i]) == HIGH)
+                *bits |= 1ULL << i;
+        }
+        return 0;
+    }
+    pthread_mutex_lock(&wpi_lock);
+    *bits = wpi_levels;
+    pthread_mutex_unlock(&wpi_lock);
+    return 0;
+}
+
+const struct gpio_backend gpiowpi_backend = {
+    .name = "wiringpi",
+    .open = wpi_open,
+    .close = wpi_close,
+    .request = wpi_request,
+    .release = wpi_release,
+    .get_values = wpi_get_values,
+    .read_events = gpiochip_read_events,
+    .request_scan = wpi_request_scan,
+    .set_values = wpi_set_values,
+};
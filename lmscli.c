@@ -0,0 +1,479 @@
+//
+//  lmscli.c
+//  SqueezeButtonPi
+//
+//  LMS command line interface connection
+//  Commands as text lines over a persistent TCP connection to the CLI port
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "lmscli.h"
+#include "sbpd.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+//
+//  Connection state, used on its event loop only
+//  out holds lines not written yet from out_start to out_end,
+//  in a partial reply line. inflight counts commands without a reply,
+//  written or not.
+//
+struct lmscli {
+    struct reactor * loop;
+    lmscli_done_t done;
+    lmscli_reply_t reply;
+    void * ctx;
+    int fd;
+    bool connected;
+    int timer;                  // reply timeout, idle timeout or reconnect
+    bool waiting;               // reply timeout running, since the last reply
+    long retry_ms;              // wait before reconnecting, 0 after success
+
+    char host[64];
+    uint32_t port;
+    char hello[1024];           // login and setup lines, empty for none
+    int hello_lines;
+    long idle_ms;
+    int hello_pending;          // replies to hello lines expected
+
+    char out[LMSCLI_BUFFER];
+    size_t out_start, out_end;
+    char in[LMSCLI_BUFFER];
+    size_t in_len;
+    int inflight;
+};
+
+static void cli_io(int fd, uint32_t events, void * ctx);
+
+//
+//  URL-escape a word, as the CLI expects
+//  Returns: new length of the line, -1 if it doesn't fit
+//
+static int escape_word(char * line, size_t size, size_t length, const char * word, size_t word_len) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (size_t i = 0; i < word_len; i++) {
+        unsigned char c = (unsigned char)word[i];
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            if (length + 1 >= size)
+                return -1;
+            line[length++] = (char)c;
+        } else {
+            if (length + 3 >= size)
+                return -1;
+            line[length++] = '%';
+            line[length++] = hex[c >> 4];
+            line[length++] = hex[c & 0xf];
+        }
+    }
+    return (int)length;
+}
+
+//
+//  Undo the URL-escaping of a reply word in place
+//
+char * lmscli_unescape(char * word) {
+    char * in = word, * out = word;
+    while (*in) {
+        if (in[0] == '%' && isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2])) {
+            char hex[3] = { in[1], in[2], 0 };
+            *out++ = (char)strtol(hex, NULL, 16);
+            in += 3;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = 0;
+    return word;
+}
+
+//
+//  Compile a command fragment to a command line
+//
+int lmscli_compile(char * line, size_t size, const char * player, const char * fragment) {
+    char word[256];
+    int length = 0;
+
+    if (player) {
+        length = escape_word(line, size, 0, player, strlen(player));
+        if (length < 0)
+            return -1;
+    }
+    const char * p = fragment;
+    while (isspace((unsigned char)*p))
+        p++;
+    if (*p++ != '[')
+        return -1;
+    while (true) {
+        while (isspace((unsigned char)*p) || *p == ',')
+            p++;
+        if (*p == ']')
+            break;
+        size_t word_len = 0;
+        if (*p == '"') {
+            //  string, only the simple escapes
+            for (p++; *p && *p != '"'; p++) {
+                char c = *p;
+                if (c == '\\') {
+                    c = *++p;
+                    if (c == 'n')
+                        c = '\n';
+                    else if (c == 't')
+                        c = '\t';
+                    else if (c != '"' && c != '\\' && c != '/')
+                        return -1;
+                }
+                if (word_len + 1 >= sizeof(word))
+                    return -1;
+                word[word_len++] = c;
+            }
+            if (*p++ != '"')
+                return -1;
+        } else {
+            //  number or literal
+            while (*p && *p != ',' && *p != ']' && !isspace((unsigned char)*p)) {
+                if (*p == '{' || *p == '[' || *p == ':' || word_len + 1 >= sizeof(word))
+                    return -1;
+                word[word_len++] = *p++;
+            }
+            if (!word_len)
+                return -1;
+        }
+        if (length) {
+            if ((size_t)length + 1 >= size)
+                return -1;
+            line[length++] = ' ';
+        }
+        length = escape_word(line, size, length, word, word_len);
+        if (length < 0)
+            return -1;
+    }
+    if ((size_t)length + 2 > size)
+        return -1;
+    line[length++] = '\n';
+    line[length] = 0;
+    return length;
+}
+
+//
+//  Wait for writing only while there is something to write
+//
+static void update_events(struct lmscli * cli) {
+    uint32_t events = EPOLLIN;
+    if (!cli->connected || cli->out_end > cli->out_start)
+        events |= EPOLLOUT;
+    reactor_mod(cli->loop, cli->fd, events);
+}
+
+//
+//  Arm the timer for a reply, the connection or the idle timeout,
+//  disarm if nothing is expected
+//  A running reply timeout is kept, further commands don't push it out.
+//
+static void update_timer(struct lmscli * cli) {
+    long ms = 0;
+    bool waiting = (!cli->connected || cli->inflight > 0 || cli->hello_pending);
+    if (waiting && cli->waiting)
+        return;
+    cli->waiting = waiting;
+    if (waiting)
+        ms = LMSCLI_TIMEOUT;
+    else if (cli->idle_ms)
+        ms = cli->idle_ms;
+    reactor_timer_set(cli->timer, ms, 0);
+}
+
+//
+//  Close the connection and fail the commands in flight
+//  Commands with lines not completely written did not reach the server.
+//  Reconnects after a growing wait.
+//
+static void cli_fail(struct lmscli * cli, const char * reason) {
+    int unsent = 0;
+    for (size_t i = cli->out_start; i < cli->out_end; i++)
+        unsent += (cli->out[i] == '\n');
+    if (unsent > cli->inflight)
+        unsent = cli->inflight;     // the hello lines
+    int failed = cli->inflight;
+    int written = cli->connected ? failed - unsent : 0;
+
+    logwarn("Server CLI %s:%u %s", cli->host, cli->port, reason);
+    if (cli->fd >= 0) {
+        reactor_del(cli->loop, cli->fd);
+        close(cli->fd);
+    }
+    cli->fd = -1;
+    cli->connected = false;
+    cli->waiting = false;
+    cli->hello_pending = 0;
+    cli->out_start = cli->out_end = 0;
+    cli->in_len = 0;
+    cli->inflight = 0;
+
+    cli->retry_ms = cli->retry_ms ? cli->retry_ms * 2 : LMSCLI_RETRY_MIN;
+    if (cli->retry_ms > LMSCLI_RETRY_MAX)
+        cli->retry_ms = LMSCLI_RETRY_MAX;
+    reactor_timer_set(cli->timer, cli->retry_ms, 0);
+
+    for (int i = 0; i < failed; i++)
+        cli->done(cli->ctx, false, i < written);
+}
+
+//
+//  Start connecting, the hello lines go first
+//
+static void cli_connect(struct lmscli * cli) {
+    if (cli->fd >= 0 || !cli->port || !cli->host[0])
+        return;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)cli->port);
+    if (inet_pton(AF_INET, cli->host, &addr.sin_addr) != 1) {
+        struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+        struct addrinfo * found = NULL;
+        if (getaddrinfo(cli->host, NULL, &hints, &found) != 0 || !found) {
+            cli_fail(cli, "not found");
+            return;
+        }
+        addr.sin_addr = ((struct sockaddr_in *)found->ai_addr)->sin_addr;
+        freeaddrinfo(found);
+    }
+    cli->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (cli->fd < 0) {
+        cli_fail(cli, "no socket");
+        return;
+    }
+    int one = 1, idle = LMSCLI_KEEPIDLE;
+    setsockopt(cli->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(cli->fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(cli->fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    if (connect(cli->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        cli_fail(cli, strerror(errno));
+        return;
+    }
+    if (reactor_add(cli->loop, cli->fd, EPOLLIN | EPOLLOUT, cli_io, cli) < 0) {
+        cli_fail(cli, "not added to event loop");
+        return;
+    }
+    size_t hello_len = strlen(cli->hello);
+    if (hello_len && cli->out_end - cli->out_start + hello_len > sizeof(cli->out)) {
+        cli_fail(cli, "login does not fit");
+        return;
+    }
+    if (hello_len) {
+        memmove(cli->out + hello_len, cli->out + cli->out_start, cli->out_end - cli->out_start);
+        memcpy(cli->out, cli->hello, hello_len);
+        cli->out_end = cli->out_end - cli->out_start + hello_len;
+        cli->out_start = 0;
+        cli->hello_pending = cli->hello_lines;
+    }
+    update_timer(cli);
+}
+
+//
+//  Write what the socket takes
+//
+static void cli_flush(struct lmscli * cli) {
+    while (cli->out_end > cli->out_start) {
+        ssize_t sent = send(cli->fd, cli->out + cli->out_start,
+                            cli->out_end - cli->out_start, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                break;
+            cli_fail(cli, strerror(errno));
+            return;
+        }
+        cli->out_start += sent;
+    }
+    if (cli->out_start == cli->out_end)
+        cli->out_start = cli->out_end = 0;
+    update_events(cli);
+}
+
+//
+//  Reply lines complete the oldest command
+//
+static void cli_replies(struct lmscli * cli) {
+    char * line = cli->in;
+    char * end;
+    while ((end = memchr(line, '\n', cli->in + cli->in_len - line))) {
+        *end = 0;
+        logdebug("Server CLI reply %s", line);
+        cli->waiting = false;       // the server answers, the timeout starts again
+        if (cli->reply)
+            cli->reply(cli->ctx, line);
+        if (cli->hello_pending)
+            cli->hello_pending--;
+        else if (cli->inflight > 0) {
+            cli->inflight--;
+            cli->done(cli->ctx, true, true);
+        }
+        line = end + 1;
+    }
+    cli->in_len -= line - cli->in;
+    memmove(cli->in, line, cli->in_len);
+    if (cli->in_len == sizeof(cli->in)) {
+        //  no line feed in a full buffer, drop it
+        cli->in_len = 0;
+    }
+}
+
+static void cli_io(int fd, uint32_t events, void * ctx) {
+    struct lmscli * cli = ctx;
+    if (!cli->connected) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error || (events & (EPOLLERR | EPOLLHUP))) {
+            cli_fail(cli, error ? strerror(error) : "connection failed");
+            return;
+        }
+        cli->connected = true;
+        cli->retry_ms = 0;
+        loginfo("Server CLI %s:%u connected", cli->host, cli->port);
+    }
+    if (events & EPOLLIN) {
+        ssize_t got = read(fd, cli->in + cli->in_len, sizeof(cli->in) - cli->in_len);
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+            cli_fail(cli, got ? strerror(errno) : "closed the connection");
+            return;
+        }
+        if (got > 0) {
+            cli->in_len += got;
+            cli_replies(cli);
+        }
+    }
+    cli_flush(cli);
+    if (cli->fd >= 0)
+        update_timer(cli);
+}
+
+//
+//  Timer: no reply in time or time to reconnect
+//
+static void cli_timeout(int fd, uint32_t events, void * ctx) {
+    struct lmscli * cli = ctx;
+    reactor_timer_ack(fd);
+    if (cli->fd >= 0)
+        cli_fail(cli, cli->connected ? "does not reply" : "connection timed out");
+    else
+        cli_connect(cli);
+}
+
+int lmscli_send(struct lmscli * cli, const char * line, size_t length) {
+    if (cli->out_end + length > sizeof(cli->out)) {
+        memmove(cli->out, cli->out + cli->out_start, cli->out_end - cli->out_start);
+        cli->out_end -= cli->out_start;
+        cli->out_start = 0;
+        if (cli->out_end + length > sizeof(cli->out))
+            return -1;
+    }
+    memcpy(cli->out + cli->out_end, line, length);
+    cli->out_end += length;
+    cli->inflight++;
+    if (cli->fd < 0) {
+        cli_connect(cli);
+        return 0;
+    }
+    if (cli->connected) {
+        cli_flush(cli);
+        if (cli->fd >= 0)
+            update_timer(cli);
+    }
+    return 0;
+}
+
+void lmscli_server(struct lmscli * cli, const char * host, uint32_t port,
+                   const char * user, const char * password, const char * setup, long idle_ms) {
+    char hello[sizeof(cli->hello)] = "";
+    int lines = 0;
+    if (user && password) {
+        char fragment[300];
+        snprintf(fragment, sizeof(fragment), "[\"login\",\"%s\",\"%s\"]", user, password);
+        if (lmscli_compile(hello, sizeof(hello), NULL, fragment) < 0)
+            logerr("Server CLI login can't be sent");
+        else
+            lines++;
+    }
+    if (setup && strlen(hello) + strlen(setup) < sizeof(hello)) {
+        strcat(hello, setup);
+        lines++;
+    }
+    if (port == cli->port && strcmp(host, cli->host) == 0 && strcmp(hello, cli->hello) == 0)
+        return;
+    if (cli->fd >= 0)
+        cli_fail(cli, "replaced");
+    snprintf(cli->host, sizeof(cli->host), "%s", host);
+    cli->port = port;
+    strcpy(cli->hello, hello);
+    cli->hello_lines = lines;
+    cli->idle_ms = idle_ms;
+    cli->retry_ms = 0;
+    cli_connect(cli);
+}
+
+struct lmscli * lmscli_create(struct reactor * loop, lmscli_done_t done, lmscli_reply_t reply, void * ctx) {
+    struct lmscli * cli = calloc(1, sizeof(*cli));
+    if (!cli)
+        return NULL;
+    cli->loop = loop;
+    cli->done = done;
+    cli->reply = reply;
+    cli->ctx = ctx;
+    cli->fd = -1;
+    cli->timer = reactor_timer(loop, cli_timeout, cli);
+    if (cli->timer < 0) {
+        free(cli);
+        return NULL;
+    }
+    return cli;
+}
+
+void lmscli_destroy(struct lmscli * cli) {
+    if (!cli)
+        return;
+    if (cli->fd >= 0) {
+        reactor_del(cli->loop, cli->fd);
+        close(cli->fd);
+    }
+    reactor_del(cli->loop, cli->timer);
+    close(cli->timer);
+    free(cli);
+}
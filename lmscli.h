@@ -0,0 +1,135 @@
+//
+//  lmscli.h
+//  SqueezeButtonPi
+//
+//  LMS command line interface connection
+//  Commands as text lines over a persistent TCP connection to the CLI port
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef lmscli_h
+#define lmscli_h
+
+#include "sbpd.h"
+#include "reactor.h"
+#include <stddef.h>
+
+//
+//  LMS CLI transport
+//  A TCP connection to the server CLI port (9090) stays open. Commands
+//  are lines of URL-escaped words, the server answers each line with a
+//  line, in order. The connection is reopened after failures, waiting
+//  longer after each failed attempt.
+//  Each connection runs on one event loop: the command connection on the
+//  network worker's, see servercomm.c, the player state subscription
+//  on the main loop, see playerstate.c
+//
+#define LMSCLI_PORT             9090
+#define LMSCLI_BUFFER           4096    // bytes of lines to send and of replies
+#define LMSCLI_TIMEOUT          5000    // ms without a reply before reconnecting
+#define LMSCLI_RETRY_MIN        1000    // ms before reconnecting, doubled up to max
+#define LMSCLI_RETRY_MAX        30000
+#define LMSCLI_KEEPIDLE         30      // s idle before TCP keep-alive probes
+
+struct lmscli;
+
+//
+//  Completion of the oldest command sent
+//  Parameters:
+//      ctx: context given to lmscli_create()
+//      ok: the server replied
+//      reached: false if the command was not sent
+//
+typedef void (*lmscli_done_t)(void * ctx, bool ok, bool reached);
+
+//
+//  Reply line received, before the command is completed.
+//  Lines pushed by the server without a command come here as well.
+//  Parameters:
+//      ctx: context given to lmscli_create()
+//      line: the reply, still URL-escaped, without line feed
+//
+typedef void (*lmscli_reply_t)(void * ctx, char * line);
+
+//
+//  Create a connection on an event loop
+//  Parameters:
+//      loop: event loop
+//      done: completion handler
+//      reply: reply handler, can be NULL
+//      ctx: passed to the handlers
+//  Returns: the connection, NULL on error
+//
+struct lmscli * lmscli_create(struct reactor * loop, lmscli_done_t done, lmscli_reply_t reply, void * ctx);
+
+//
+//  Close the connection, commands in flight are not completed
+//
+void lmscli_destroy(struct lmscli * cli);
+
+//
+//  Set the server, reconnects if it changed
+//  Parameters:
+//      host: server address
+//      port: CLI port
+//      user, password: CLI login, NULL for none
+//      setup: line sent after the login on every connect, e.g. a
+//             subscription, NULL for none. Its reply is not a completion.
+//      idle_ms: reconnect after this time without any line from the
+//               server, 0 for never. For subscriptions with periodic pushes.
+//
+void lmscli_server(struct lmscli * cli, const char * host, uint32_t port,
+                   const char * user, const char * password, const char * setup, long idle_ms);
+
+//
+//  Send a command line, connects if not connected
+//  Parameters:
+//      line: command line including the line feed, see lmscli_compile()
+//  Returns: 0 if sent or buffered, -1 if it does not fit
+//
+int lmscli_send(struct lmscli * cli, const char * line, size_t length);
+
+//
+//  Compile a command fragment to a command line
+//  Parameters:
+//      line, size: buffer for the line
+//      player: player MAC address, first word of the line
+//      fragment: JSON array of strings and numbers, e.g. ["mixer","volume","+2"]
+//  Returns: length of the line, -1 if the fragment can't be sent as a line,
+//           e.g. with parameter hashes, or doesn't fit
+//
+int lmscli_compile(char * line, size_t size, const char * player, const char * fragment);
+
+//
+//  Undo the URL-escaping of a reply word in place
+//  Returns: the word
+//
+char * lmscli_unescape(char * word);
+
+#endif /* lmscli_h */
@@ -0,0 +1,250 @@
+//
+//  lmsreply.c
+//  SqueezeButtonPi
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "lmsreply.h"
+#include "playerstate.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TOKEN_NONE      0
+#define TOKEN_STRING    1
+#define TOKEN_SCALAR    2
+
+void reply_start(struct reply_parser * parser) {
+    memset(parser, 0, sizeof(*parser));
+}
+
+static int reply_mode(const char * mode) {
+    if (strcmp(mode, "play") == 0)
+        return PLAYER_MODE_PLAY;
+    if (strcmp(mode, "pause") == 0)
+        return PLAYER_MODE_PAUSE;
+    return PLAYER_MODE_STOP;
+}
+
+const char * reply_mode_name(int mode) {
+    return (mode == PLAYER_MODE_PLAY) ? "play" : (mode == PLAYER_MODE_PAUSE) ? "pause" : "stop";
+}
+
+//
+//  A member value was read
+//  Members of the result object are at depth 2, the error member at depth 1.
+//
+static void reply_value(struct reply_parser * parser, bool string) {
+    struct lms_reply * reply = &parser->reply;
+    const char * key = parser->key;
+    const char * text = parser->text;
+
+    if (!string && strcmp(text, "null") == 0)
+        return;
+    if (parser->depth == 1) {
+        if (strcmp(key, "error") == 0) {
+            reply->fields |= REPLY_ERROR;
+            reply->error = string ? 1 : atoi(text);
+        }
+        return;
+    }
+    if (parser->depth != 2)
+        return;
+    if (strcmp(parser->top, "error") == 0) {
+        if (strcmp(key, "code") == 0)
+            reply->error = atoi(text);
+        return;
+    }
+    if (strcmp(parser->top, "result") != 0)
+        return;
+    if (strcmp(key, "_volume") == 0 || strcmp(key, "mixer volume") == 0) {
+        int volume = atoi(text);
+        reply->fields |= REPLY_VOLUME;
+        reply->muted = volume < 0;
+        reply->volume = abs(volume);
+    } else if (strcmp(key, "_mode") == 0 || strcmp(key, "mode") == 0) {
+        reply->fields |= REPLY_MODE;
+        reply->mode = reply_mode(text);
+    } else if (strcmp(key, "_power") == 0 || strcmp(key, "power") == 0) {
+        reply->fields |= REPLY_POWER;
+        reply->power = atoi(text) != 0;
+    } else if (strcmp(key, "_title") == 0 || strcmp(key, "current_title") == 0 ||
+               strcmp(key, "title") == 0) {
+        reply->fields |= REPLY_TITLE;
+        strcpy(reply->title, text);
+    }
+}
+
+static void reply_char(struct reply_parser * parser, char c) {
+    if (parser->length < sizeof(parser->text) - 1)
+        parser->text[parser->length++] = c;
+}
+
+//
+//  Code point of a \u escape as UTF-8, surrogate pairs are not decoded
+//
+static void reply_code(struct reply_parser * parser, unsigned int code) {
+    if (code < 0x80) {
+        reply_char(parser, (char)code);
+    } else if (code < 0x800) {
+        reply_char(parser, (char)(0xc0 | (code >> 6)));
+        reply_char(parser, (char)(0x80 | (code & 0x3f)));
+    } else if (code >= 0xd800 && code < 0xe000) {
+        reply_char(parser, '?');
+    } else {
+        reply_char(parser, (char)(0xe0 | (code >> 12)));
+        reply_char(parser, (char)(0x80 | ((code >> 6) & 0x3f)));
+        reply_char(parser, (char)(0x80 | (code & 0x3f)));
+    }
+}
+
+//
+//  Open an object or array
+//
+static void reply_open(struct reply_parser * parser, bool array) {
+    if (parser->depth == 1) {
+        strcpy(parser->top, parser->key);
+        if (strcmp(parser->key, "error") == 0) {
+            parser->reply.fields |= REPLY_ERROR;
+            parser->reply.error = 1;
+        }
+    }
+    parser->depth++;
+    if (parser->depth < 32) {
+        if (array)
+            parser->arrays |= 1u << parser->depth;
+        else
+            parser->arrays &= ~(1u << parser->depth);
+    }
+    parser->want_key = !array;
+}
+
+//
+//  One character, outside of strings and scalars
+//
+static void reply_structure(struct reply_parser * parser, char c) {
+    switch (c) {
+        case '{':
+        case '[':
+            reply_open(parser, c == '[');
+            break;
+        case '}':
+        case ']':
+            if (parser->depth > 0)
+                parser->depth--;
+            parser->want_key = false;
+            break;
+        case ':':
+            parser->want_key = false;
+            break;
+        case ',':
+            parser->want_key = parser->depth > 0 && parser->depth < 32 &&
+                               !(parser->arrays & (1u << parser->depth));
+            break;
+        case '"':
+            parser->token = TOKEN_STRING;
+            parser->length = 0;
+            break;
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+            break;
+        default:
+            parser->token = TOKEN_SCALAR;
+            parser->length = 0;
+            reply_char(parser, c);
+            break;
+    }
+}
+
+void reply_feed(struct reply_parser * parser, const char * data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        char c = data[i];
+        if (parser->token == TOKEN_STRING) {
+            if (parser->skip) {
+                parser->code = parser->code << 4 |
+                    (isdigit((unsigned char)c) ? c - '0' : (tolower((unsigned char)c) - 'a' + 10) & 0xf);
+                if (--parser->skip == 0)
+                    reply_code(parser, parser->code);
+            } else if (parser->escape) {
+                parser->escape = false;
+                if (c == 'u') {
+                    parser->skip = 4;
+                    parser->code = 0;
+                } else {
+                    reply_char(parser, (c == 'n') ? '\n' : (c == 't') ? '\t' : c);
+                }
+            } else if (c == '\\') {
+                parser->escape = true;
+            } else if (c == '"') {
+                parser->token = TOKEN_NONE;
+                parser->text[parser->length] = 0;
+                if (parser->want_key) {
+                    size_t length = parser->length < sizeof(parser->key) - 1 ?
+                                    parser->length : sizeof(parser->key) - 1;
+                    memcpy(parser->key, parser->text, length);
+                    parser->key[length] = 0;
+                }
+                else
+                    reply_value(parser, true);
+            } else {
+                reply_char(parser, c);
+            }
+            continue;
+        }
+        if (parser->token == TOKEN_SCALAR) {
+            if (!strchr(",}] \t\r\n", c)) {
+                reply_char(parser, c);
+                continue;
+            }
+            parser->token = TOKEN_NONE;
+            parser->text[parser->length] = 0;
+            reply_value(parser, false);
+        }
+        reply_structure(parser, c);
+    }
+}
+
+void reply_merge(struct lms_reply * into, const struct lms_reply * from) {
+    if (from->fields & REPLY_VOLUME) {
+        into->volume = from->volume;
+        into->muted = from->muted;
+    }
+    if (from->fields & REPLY_MODE)
+        into->mode = from->mode;
+    if (from->fields & REPLY_POWER)
+        into->power = from->power;
+    if (from->fields & REPLY_TITLE)
+        strcpy(into->title, from->title);
+    if (from->fields & REPLY_ERROR)
+        into->error = from->error;
+    into->fields |= from->fields;
+}
@@ -0,0 +1,109 @@
+//
+//  lmsreply.h
+//  SqueezeButtonPi
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef lmsreply_h
+#define lmsreply_h
+
+#include "sbpd.h"
+#include <stddef.h>
+
+//
+//  Server replies
+//  JSON-RPC replies to slim.request are parsed while they come in, a
+//  chunk at a time, without allocating. Only the result fields below
+//  are kept, all else is skipped:
+//      volume: _volume, mixer volume
+//      mode:   _mode, mode
+//      power:  _power, power
+//      title:  _title, current_title, title
+//      error:  an error member, its code if it has one
+//
+#define REPLY_VOLUME    0x1
+#define REPLY_MODE      0x2
+#define REPLY_POWER     0x4
+#define REPLY_TITLE     0x8
+#define REPLY_ERROR     0x10
+
+#define REPLY_TITLE_LEN 64
+#define REPLY_KEY_LEN   24
+#define REPLY_TEXT_LEN  REPLY_TITLE_LEN
+
+struct lms_reply {
+    uint32_t fields;        // REPLY_ bits of the fields found
+    int volume;             // 0..100
+    bool muted;             // reported as negative volume
+    int mode;               // PLAYER_MODE_, see playerstate.h
+    bool power;
+    int error;              // error code, 1 if the error has none
+    char title[REPLY_TITLE_LEN];    // truncated
+};
+
+//
+//  Parser state, one per reply
+//
+struct reply_parser {
+    int depth;                      // containers open
+    uint32_t arrays;                // bit n set if the container at depth n is an array
+    bool want_key;                  // in an object, before a member name
+    int token;                      // string or scalar being read
+    bool escape;
+    int skip;                       // hex digits of a \u escape left
+    unsigned int code;              // code point of the \u escape
+    char top[REPLY_KEY_LEN];        // member of the reply object being read
+    char key[REPLY_KEY_LEN];        // member name of the value being read
+    char text[REPLY_TEXT_LEN];      // string or scalar, truncated
+    size_t length;
+    struct lms_reply reply;
+};
+
+//
+//  Start parsing a new reply
+//
+void reply_start(struct reply_parser * parser);
+
+//
+//  Parse the next chunk of a reply
+//  The result is in parser->reply, complete after the last chunk.
+//
+void reply_feed(struct reply_parser * parser, const char * data, size_t length);
+
+//
+//  Take over the fields found in a reply
+//
+void reply_merge(struct lms_reply * into, const struct lms_reply * from);
+
+//
+//  Name of a PLAYER_MODE_
+//
+const char * reply_mode_name(int mode);
+
+#endif /* lmsreply_h */
@@ -0,0 +1,169 @@
+//
+//  playerstate.c
+//  SqueezeButtonPi
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "playerstate.h"
+#include "lmscli.h"
+#include "lmsreply.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+//
+//  Player state, main loop only
+//
+static struct player_state state;
+static struct lmscli * cli = NULL;
+static char * player = NULL;
+static uint32_t port = 0;              // 0 while the cache is disabled
+static char setup[256];
+
+//
+//  Subscription commands are not sent, nothing completes
+//
+static void status_done(void * ctx, bool ok, bool reached) {
+}
+
+//
+//  Update one field from a tag:value word
+//
+static void status_field(const char * key, const char * value) {
+    if (strcmp(key, "power") == 0)
+        state.power = atoi(value) != 0;
+    else if (strcmp(key, "player_connected") == 0)
+        state.connected = atoi(value) != 0;
+    else if (strcmp(key, "mode") == 0) {
+        if (strcmp(value, "play") == 0)
+            state.mode = PLAYER_MODE_PLAY;
+        else if (strcmp(value, "pause") == 0)
+            state.mode = PLAYER_MODE_PAUSE;
+        else
+            state.mode = PLAYER_MODE_STOP;
+    } else if (strcmp(key, "mixer volume") == 0) {
+        int volume = atoi(value);
+        state.muted = volume < 0;
+        state.volume = abs(volume);
+    } else if (strcmp(key, "playlist shuffle") == 0)
+        state.shuffle = atoi(value);
+    else if (strcmp(key, "playlist repeat") == 0)
+        state.repeat = atoi(value);
+    else if (strcmp(key, "playlist_cur_index") == 0)
+        state.track = atoi(value);
+    else if (strcmp(key, "playlist_tracks") == 0)
+        state.tracks = atoi(value);
+}
+
+//
+//  Status line of the player: MAC status - 1 subscribe:30 tag:value ...
+//  Fields not in the line keep their value, only changes are logged.
+//
+static void status_line(void * ctx, char * line) {
+    char * next = line;
+    char * word = strsep(&next, " ");
+    if (!word || strcasecmp(lmscli_unescape(word), player) != 0)
+        return;
+    word = strsep(&next, " ");
+    if (!word || strcmp(word, "status") != 0)
+        return;
+
+    struct player_state old = state;
+    while ((word = strsep(&next, " "))) {
+        lmscli_unescape(word);
+        char * value = strchr(word, ':');
+        if (!value)
+            continue;
+        *value++ = 0;
+        status_field(word, value);
+    }
+    state.valid = true;
+    state.updated = ms_timer();
+    if (!old.valid || old.power != state.power || old.mode != state.mode ||
+        old.volume != state.volume || old.muted != state.muted)
+        logdebug("Player state: power %d, mode %d, volume %d%s, track %d/%d",
+                 state.power, state.mode, state.volume, state.muted ? " muted" : "",
+                 state.track + 1, state.tracks);
+}
+
+//
+//
+//  Server found or changed
+//
+//
+void player_state_server(struct sbpd_server * server) {
+    if (!port || !server->host || !server->port)
+        return;     // disabled or no server yet
+    state.valid = false;
+    lmscli_server(cli, server->host, port, server->user, server->password,
+                  setup, PLAYER_STATE_STALE);
+}
+
+const struct player_state * player_state(void) {
+    if (state.valid && ms_timer() - state.updated > PLAYER_STATE_STALE)
+        state.valid = false;
+    return &state;
+}
+
+void player_state_reply(const struct lms_reply * reply) {
+    if (!port)
+        return;     // disabled
+    if (reply->fields & REPLY_VOLUME) {
+        state.volume = reply->volume;
+        state.muted = reply->muted;
+    }
+    if (reply->fields & REPLY_MODE)
+        state.mode = reply->mode;
+    if (reply->fields & REPLY_POWER)
+        state.power = reply->power;
+}
+
+int init_player_state(char * MAC, uint32_t cli_port, struct reactor * loop) {
+    if (!cli_port)
+        return 0;
+    char fragment[64];
+    snprintf(fragment, sizeof(fragment), "[\"status\",\"-\",\"1\",\"subscribe:%d\"]",
+             PLAYER_STATE_INTERVAL);
+    if (lmscli_compile(setup, sizeof(setup), MAC, fragment) < 0)
+        return -1;
+    cli = lmscli_create(loop, status_done, status_line, NULL);
+    if (!cli)
+        return -1;
+    player = MAC;
+    port = cli_port;
+    loginfo("Player state subscription on CLI port %u", cli_port);
+    return 0;
+}
+
+void shutdown_player_state(void) {
+    lmscli_destroy(cli);
+    cli = NULL;
+    port = 0;
+}
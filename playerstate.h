@@ -0,0 +1,101 @@
+//
+//  playerstate.h
+//  SqueezeButtonPi
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef playerstate_h
+#define playerstate_h
+
+#include "sbpd.h"
+#include "reactor.h"
+
+struct lms_reply;
+
+//
+//  Player state cache
+//  A second CLI connection subscribes to the status of the player,
+//  the server pushes a status line whenever it changes and at least
+//  every PLAYER_STATE_INTERVAL seconds. The cache is updated from each
+//  line on the main loop, without a round trip for queries.
+//  Requires the CLI port, see the -C option.
+//
+#define PLAYER_STATE_INTERVAL   30      // s between status lines at most
+#define PLAYER_STATE_STALE      65000   // ms without a status line before the cache is invalid
+
+#define PLAYER_MODE_STOP        0
+#define PLAYER_MODE_PLAY        1
+#define PLAYER_MODE_PAUSE       2
+
+struct player_state {
+    bool valid;             // a status line came within PLAYER_STATE_STALE ms
+    bool connected;         // the player is connected to the server
+    bool power;
+    int mode;               // PLAYER_MODE_
+    int volume;             // 0..100
+    bool muted;             // reported as negative volume
+    int shuffle;            // 0 off, 1 songs, 2 albums
+    int repeat;             // 0 off, 1 song, 2 playlist
+    int track;              // index of the current track in the playlist
+    int tracks;             // tracks in the playlist
+    long long updated;      // ms_timer() time of the last status line
+};
+
+//
+//  Set up the subscription on the main loop
+//  Parameters:
+//      MAC: the player
+//      cli_port: server CLI port, 0 disables the cache
+//      loop: main loop
+//  Returns: 0 on success or if disabled, -1 on error
+//
+int init_player_state(char * MAC, uint32_t cli_port, struct reactor * loop);
+
+//
+//  Server found or changed, (re)subscribe
+//  Does nothing while the cache is disabled, without CLI port.
+//
+void player_state_server(struct sbpd_server * server);
+
+//
+//  Current player state
+//  Returns: the cache, valid is false while unknown or stale
+//
+const struct player_state * player_state(void);
+
+//
+//  Take over the fields of a server reply, see lmsreply.h
+//  Replies come in between status lines, they don't make the cache valid.
+//  Ignored while the cache is disabled.
+//
+void player_state_reply(const struct lms_reply * reply);
+
+void shutdown_player_state(void);
+
+#endif /* playerstate_h */
@@ -0,0 +1,188 @@
+//
+//  reactor.c
+//  SqueezeButtonPi
+//
+//  epoll based event loop
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "reactor.h"
+#include "sbpd.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+struct reactor_handler {
+    int fd;
+    uint32_t generation;    // changes on every reuse, so stale epoll events are dropped
+    reactor_handler_t handler;
+    void * ctx;
+};
+
+struct reactor {
+    int epoll_fd;
+    volatile bool stop;
+    struct reactor_handler handlers[REACTOR_MAX_HANDLERS];
+};
+
+#define SLOT_DATA(slot, generation) (((uint64_t)(generation) << 32) | (uint32_t)(slot))
+
+struct reactor * reactor_create(void) {
+    struct reactor * reactor = calloc(1, sizeof(*reactor));
+    if (!reactor)
+        return NULL;
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd < 0) {
+        logerr("Could not create event loop: %s", strerror(errno));
+        free(reactor);
+        return NULL;
+    }
+    for (int slot = 0; slot < REACTOR_MAX_HANDLERS; slot++)
+        reactor->handlers[slot].fd = -1;
+    return reactor;
+}
+
+void reactor_destroy(struct reactor * reactor) {
+    if (!reactor)
+        return;
+    close(reactor->epoll_fd);
+    free(reactor);
+}
+
+static int find_slot(struct reactor * reactor, int fd) {
+    for (int slot = 0; slot < REACTOR_MAX_HANDLERS; slot++) {
+        if (reactor->handlers[slot].fd == fd)
+            return slot;
+    }
+    return -1;
+}
+
+int reactor_add(struct reactor * reactor, int fd, uint32_t events, reactor_handler_t handler, void * ctx) {
+    int slot = find_slot(reactor, -1);
+    if (slot < 0) {
+        logerr("Too many event loop handlers");
+        return -1;
+    }
+    struct reactor_handler * h = reactor->handlers + slot;
+    h->generation++;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = SLOT_DATA(slot, h->generation);
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        logerr("Could not add fd %d to event loop: %s", fd, strerror(errno));
+        return -1;
+    }
+    h->fd = fd;
+    h->handler = handler;
+    h->ctx = ctx;
+    return 0;
+}
+
+int reactor_mod(struct reactor * reactor, int fd, uint32_t events) {
+    int slot = find_slot(reactor, fd);
+    if (slot < 0)
+        return -1;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = SLOT_DATA(slot, reactor->handlers[slot].generation);
+    return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void reactor_del(struct reactor * reactor, int fd) {
+    int slot = find_slot(reactor, fd);
+    if (slot < 0 || fd < 0)
+        return;
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    reactor->handlers[slot].fd = -1;
+}
+
+//
+//  Timers
+//
+int reactor_timer(struct reactor * reactor, reactor_handler_t handler, void * ctx) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        logerr("Could not create timer: %s", strerror(errno));
+        return -1;
+    }
+    if (reactor_add(reactor, fd, EPOLLIN, handler, ctx) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void reactor_timer_set(int timer_fd, long first_ms, long interval_ms) {
+    struct itimerspec spec;
+    spec.it_value.tv_sec = first_ms / 1000;
+    spec.it_value.tv_nsec = (first_ms % 1000) * 1000000;
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+void reactor_timer_ack(int timer_fd) {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        logdebug("Timer read failed");
+}
+
+//
+//  Run the loop
+//
+void reactor_run(struct reactor * reactor) {
+    struct epoll_event ready[REACTOR_MAX_HANDLERS];
+
+    reactor->stop = false;
+    while (!reactor->stop) {
+        int count = epoll_wait(reactor->epoll_fd, ready, REACTOR_MAX_HANDLERS, -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            logerr("Event loop wait failed: %s", strerror(errno));
+            return;
+        }
+        for (int i = 0; i < count && !reactor->stop; i++) {
+            uint32_t slot = (uint32_t)ready[i].data.u64;
+            uint32_t generation = (uint32_t)(ready[i].data.u64 >> 32);
+            struct reactor_handler * h = reactor->handlers + slot;
+            //  removed or replaced by an earlier handler of this round
+            if (h->fd < 0 || h->generation != generation)
+                continue;
+            h->handler(h->fd, ready[i].events, h->ctx);
+        }
+    }
+}
+
+void reactor_stop(struct reactor * reactor) {
+    reactor->stop = true;
+}
@@ -0,0 +1,92 @@
+//
+//  reactor.h
+//  SqueezeButtonPi
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef reactor_h
+#define reactor_h
+
+#include "sbpd.h"
+#include <sys/epoll.h>
+
+//
+//  Event loop
+//  Waits on file descriptors through epoll and calls a handler for
+//  each one that is ready. Timers are timerfds, signals a signalfd,
+//  other threads wake the loop through an eventfd.
+//  Nothing runs unless one of the descriptors is ready.
+//
+
+struct reactor;
+
+//
+//  Handler for a ready file descriptor
+//  Parameters:
+//      fd: the file descriptor
+//      events: epoll events, e.g. EPOLLIN
+//      ctx: context pointer given when adding the descriptor
+//
+typedef void (*reactor_handler_t)(int fd, uint32_t events, void * ctx);
+
+//
+//  Maximum number of file descriptors per reactor
+//
+#define REACTOR_MAX_HANDLERS 32
+
+struct reactor * reactor_create(void);
+void reactor_destroy(struct reactor * reactor);
+
+//
+//  Add, modify and remove file descriptors
+//  reactor_del() may be called from any handler, also for its own descriptor.
+//  Returns: 0 on success, -1 on error
+//
+int reactor_add(struct reactor * reactor, int fd, uint32_t events, reactor_handler_t handler, void * ctx);
+int reactor_mod(struct reactor * reactor, int fd, uint32_t events);
+void reactor_del(struct reactor * reactor, int fd);
+
+//
+//  Timers
+//  reactor_timer() creates a timerfd and adds it with the handler,
+//  the handler has to call reactor_timer_ack() for periodic timers.
+//  reactor_timer_set() arms the timer, 0 ms for first disarms it,
+//  0 ms for interval makes a one-shot timer.
+//
+int reactor_timer(struct reactor * reactor, reactor_handler_t handler, void * ctx);
+void reactor_timer_set(int timer_fd, long first_ms, long interval_ms);
+void reactor_timer_ack(int timer_fd);
+
+//
+//  Run the loop until reactor_stop() is called
+//
+void reactor_run(struct reactor * reactor);
+void reactor_stop(struct reactor * reactor);
+
+#endif /* reactor_h */
@@ -0,0 +1,102 @@
+//
+//  registry.c
+//  SqueezeButtonPi
+//
+//  Element registry
+//  State of all configured elements and commands, allocated once from one arena
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "registry.h"
+#include "GPIO.h"
+#include "control.h"
+#include "eventqueue.h"
+#include "servercomm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//
+//  The arena
+//  Hot allocations grow up from the start, cold ones down from the end.
+//  While sizing there is no arena, only the sizes are summed up.
+//
+static char * arena = NULL;
+static size_t arena_size = 0;
+static size_t hot_used = 0;
+static size_t cold_used = 0;
+
+#define ALIGN(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+void * registry_alloc(int region, size_t count, size_t size) {
+    size_t bytes = count * size;
+    if (region == REGISTRY_HOT) {
+        size_t offset = ALIGN(hot_used, REGISTRY_LINE);
+        hot_used = offset + ALIGN(bytes, REGISTRY_LINE);
+        return arena ? arena + offset : NULL;
+    }
+    cold_used = ALIGN(cold_used + bytes, sizeof(void *));
+    return arena ? arena + arena_size - cold_used : NULL;
+}
+
+//
+//  Allocation functions of all modules
+//
+static void registry_allocate(const struct registry_counts * counts) {
+    hot_used = 0;
+    cold_used = 0;
+    alloc_GPIO(counts);
+    alloc_control(counts);
+    alloc_comm(counts);
+    int elements = REGISTRY_BUTTONS(counts);
+    if (REGISTRY_ENCODERS(counts) > elements)
+        elements = REGISTRY_ENCODERS(counts);
+    eventqueue_alloc(elements);
+}
+
+int registry_init(const struct registry_counts * counts) {
+    registry_allocate(counts);
+    arena_size = ALIGN(ALIGN(hot_used, REGISTRY_LINE) + cold_used, REGISTRY_LINE);
+    void * memory = NULL;
+    if (posix_memalign(&memory, REGISTRY_LINE, arena_size ? arena_size : REGISTRY_LINE)) {
+        logerr("Could not allocate %zu bytes for the elements", arena_size);
+        return -1;
+    }
+    arena = memory;
+    memset(arena, 0, arena_size);
+    registry_allocate(counts);
+    loginfo("Element registry: %zu bytes, %zu hot, %zu cold", arena_size, hot_used, cold_used);
+    return 0;
+}
+
+void registry_free(void) {
+    free(arena);
+    arena = NULL;
+    arena_size = 0;
+}
@@ -0,0 +1,101 @@
+//
+//  registry.h
+//  SqueezeButtonPi
+//
+//  Element registry
+//  State of all configured elements and commands, allocated once from one arena
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef registry_h
+#define registry_h
+
+#include "sbpd.h"
+#include <stddef.h>
+
+//
+//  Element registry
+//  All element and command state is allocated once at startup from a
+//  single arena sized from the configuration, there are no fixed limits
+//  on the number of elements besides those of the hardware.
+//
+//  Hot state, touched on every edge or input event, is allocated from the
+//  start of the arena, each array on its own cache lines. Cold configuration
+//  like names and command strings is allocated from the end, so it never
+//  shares cache lines with hot state.
+//
+
+//
+//  Number of configured elements by kind
+//
+struct registry_counts {
+    int buttons;        // GPIO buttons
+    int keys;           // key matrix keys
+    int input_keys;     // input device keys
+    int encoders;       // GPIO encoders
+    int input_axes;     // input device axes
+    int chords;
+    int commands;       // LMS commands of the config file
+};
+
+//
+//  Button and encoder ids of all kinds
+//
+#define REGISTRY_BUTTONS(counts)  ((counts)->buttons + (counts)->keys + (counts)->input_keys)
+#define REGISTRY_ENCODERS(counts) ((counts)->encoders + (counts)->input_axes)
+
+#define REGISTRY_HOT    0
+#define REGISTRY_COLD   1
+
+//
+//  Cache line size, alignment of hot arrays
+//
+#define REGISTRY_LINE   64
+
+//
+//  Size and allocate the arena, then hand out the state of all modules
+//  Returns: 0 on success, -1 if out of memory
+//
+int registry_init(const struct registry_counts * counts);
+
+//
+//  Allocate a zeroed array from the arena
+//  Only called from the allocation functions run by registry_init(). They
+//  run twice: in the first pass, which only sizes the arena, it returns
+//  NULL, in the second pass the memory. Allocation functions must not
+//  use the result in the first pass.
+//  Parameters:
+//      region: REGISTRY_HOT or REGISTRY_COLD
+//      count, size: number and size of the array elements
+//
+void * registry_alloc(int region, size_t count, size_t size);
+
+void registry_free(void);
+
+#endif /* registry_h */
@@ -47,10 +47,17 @@
 #include <argp.h>
 #include <sys/time.h>
 #include <sys/param.h>
+#include <sys/signalfd.h>
 #include "sbpd.h"
+#include "reactor.h"
+#include "eventqueue.h"
 #include "discovery.h"
 #include "servercomm.h"
+#include "lmscli.h"
+#include "playerstate.h"
+#include "serverset.h"
 #include "control.h"
+#include "registry.h"
 #include <linux/uinput.h>
 #include "uinput.h"
 
@@ -61,12 +68,19 @@ static sbpd_config_parameters_t configured_parameters = 0;
 static sbpd_config_parameters_t discovered_parameters = 0;
 static struct sbpd_server server;
 static char * MAC;
+static char * gpio_chip = NULL;
+static char * gpio_backend = NULL;
 
 //
 //  signal handling
 //
 static volatile int stop_signal;
-static void sigHandler( int sig, siginfo_t *siginfo, void *context );
+static void sigHandler( int fd, uint32_t events, void * ctx );
+
+//
+//  Main event loop handlers
+//
+static void inputHandler( int fd, uint32_t events, void * ctx );
 
 //
 //  Logging
@@ -93,8 +107,15 @@ static struct argp_option options[] =
     { "address",   'A', "Server-Address", 0,
         "Set server address. Default: autodetect", 0 },
     { "port",      'P', "xxxx", 0, "Set server control port. Default: autodetect", 0 },
+    { "server",    'S', "Server-Address[:port]", 0,
+        "Add a failover server, can be given several times. Default port: as -P", 0 },
     { "username",  'u', "user name", 0, "Set user name for server. Default: none", 0 },
     { "password",  'p', "password", 0, "Set password for server. Default: none", 0 },
+    { "cli",       'C', "port", OPTION_ARG_OPTIONAL,
+        "Send commands through the server CLI port instead of HTTP. Default port: 9090", 0 },
+    { "gpiochip",  'g', "/dev/gpiochipN", 0, "GPIO character device. Default: " GPIOCHIP_DEFAULT
+        ". For the sim backend the script or FIFO to read line changes from, - for stdin", 0 },
+    { "gpio-backend", 'B', "backend", 0, "GPIO backend: chardev, sim (simulated) or wiringpi. Default: " GPIO_BACKEND_DEFAULT, 0 },
     { "verbose",   'v', 0, 0, "Produce verbose output", 1 },
     { "silent",    's', 0, 0, "Don't produce output", 1 },
     { "daemonize", 'd', 0, 0, "Daemonize", 1 },
@@ -105,7 +126,7 @@ static struct argp_option options[] =
 //
 //  ARGS_DOC. Field 3 in ARGP.
 //  Non-Option arguments.
-static char args_doc[] = "[e,pin1,pin2,CMD,edge] [b,pin,CMD,resist,pressed...]";
+static char args_doc[] = "[e,pin1,pin2,CMD,mode,name=value...] [b,pin,CMD,resist,pressed,...,name=value...] [c,pin+pin,CMD...] [m,row+row...,col+col...] [k,row,col,CMD...] [i,device,code,CMD...]";
 //
 //
 //  DOC.  Field 4 in ARGP.
@@ -126,6 +147,12 @@ For rotary encoders):\n\
         mode: Optional. one of\n\
                 1 - Step mode (default)\n\
                 2-9 - Detent mode - Assumes 1 dial click is x steps.\n\
+        Settings: Optional, name=value\n\
+            res=quarter|half|full - steps per quadrature cycle: 4 (default), 2 or 1\n\
+            accel=lin[:ms[:max]] - speed up below ms between detents, up to max times\n\
+            accel=exp[:ms[:max]] - same, exponential curve\n\
+            accel=tab:ms/mult[:ms/mult...] - mult times below ms between detents\n\
+            abs[=ms] - VOLU: send absolute volume, at most every ms (default 100)\n\
 \n\
 For buttons:\n\
     b,pin,CMD[,resist,pressed]\n\
@@ -151,24 +178,82 @@ For buttons:\n\
               0 - state is 0 (default)\n\
               1 - state is 1\n\
          CMD_LONG: Command to be used for a long button push, see above list\n\
-         long_time: Number of milliseconds for a long button press\n";
+              Sent as soon as the button is held for long_time\n\
+         long_time: Number of milliseconds for a long button press\n\
+        Settings: Optional, name=value\n\
+            debounce=[integrator:|lockout:]ms - debounce algorithm and settle time\n\
+                integrator (default): change confirmed after ms on the new level\n\
+                lockout: change taken at once, then ignored for ms. Default 20 ms\n\
+            repeat=delay[/rate] - CMD on press, repeated every rate ms (default 100)\n\
+                once held for delay ms. No CMD_LONG\n\
+            dbl=CMD, tpl=CMD - commands for double and triple clicks\n\
+            click=ms - max time from a release to the next click. Default 300 ms\n\
+\n\
+For chords, buttons pressed together:\n\
+    c,pin+pin[+pin...],CMD\n\
+        \"c\" for \"Chord\"\n\
+         pin: GPIO PIN number of a button, kROW:COL of a matrix key or\n\
+              code of an input device key, up to 4\n\
+         CMD: Command, like for buttons. Sent instead of the button commands\n\
+        Settings: Optional, name=value\n\
+            window=ms - max time between the first and the last press. Default 100 ms\n\
+\n\
+For a key matrix (one):\n\
+    m,row+row[+row...],col+col[+col...]\n\
+        \"m\" for \"Matrix\"\n\
+         row, col: GPIO PIN numbers of up to 8 rows and 8 columns\n\
+        Settings: Optional, name=value\n\
+            scan=hz - scans per second. Default 100\n\
+            debounce=ms - time a key needs to read a new state. Default 20 ms\n\
+For keys of the key matrix:\n\
+    k,row,col,CMD[,CMD_LONG,long_time]\n\
+        \"k\" for \"Key\"\n\
+         row, col: position in the matrix, starting at 0\n\
+         CMD, CMD_LONG, long_time and settings like for buttons, except debounce\n\
+\n\
+For keys and axes of input devices (/dev/input):\n\
+    i,device,KEY_code,CMD[,CMD_LONG,long_time]\n\
+    i,device,REL_code,CMD[,mode]\n\
+        \"i\" for \"Input device\"\n\
+         device: /dev/input/eventN or another path, or the device name\n\
+         code: KEY_, BTN_ name or number of a key, REL_ name of an axis\n\
+         keys: CMD, CMD_LONG, long_time and settings like for buttons, except debounce\n\
+         axes: CMD, mode and accel setting like for encoders\n\
+        Settings: Optional, name=value\n\
+            grab=1 - take the device exclusively\n";
 //
 //  ARGP parsing structure
 //
 static struct argp argp = {options, parse_opt, args_doc, doc};
 static bool arg_daemonize = false;
-static char *arg_elements[max_buttons + max_encoders];
+static char **arg_elements = NULL;     // one slot per command line argument
+static int arg_element_max = 0;
 static int arg_element_count = 0;
 
+static void count_elements( struct registry_counts * counts );
+
 int main(int argc, char * argv[]) {
     //
     //  Parse Arguments
     //
+    arg_element_max = argc;
+    arg_elements = calloc( argc, sizeof(char *) );
+    if ( !arg_elements )
+        return -1;
     argp_parse (&argp, argc, argv, 0, 0, 0);
+
+    //
+    //  Allocate all elements and commands of the configuration at once
+    //
+    struct registry_counts counts;
+    count_elements( &counts );
+    counts.commands = parse_config( false );
+    if ( registry_init( &counts ) < 0 )
+        return -1;
     //
     //  Parse command config file
     //
-    parse_config();
+    parse_config( true );
 
     //
     //  Daemonize
@@ -197,11 +282,9 @@ int main(int argc, char * argv[]) {
 	//  Init GPIO
 	//  Done after daemonization becasue child process needs to have GPIO initilized
 	//
-	int pi_interface = init_GPIO();
-	if ( pi_interface < 0 ) {
-		logerr("Could not connect to pigpiod. Is it running?");
-		return -1;
-	}
+	int pi_interface = init_GPIO( gpio_backend, gpio_chip );
+	if ( pi_interface < 0 )
+		logwarn("Could not open GPIO device, only input devices can be used. Check permissions on /dev/gpiochip* or the -g option");
 
     //
     //  Now parse GPIO elements
@@ -213,6 +296,34 @@ int main(int argc, char * argv[]) {
        return -2;
    }
 
+    //
+    // Configure signal handling
+    // Signals are blocked and read from a signalfd in the main loop.
+    // Block them before any thread is started, so threads inherit the mask.
+    //
+    sigset_t signals;
+    sigemptyset( &signals );
+    sigaddset( &signals, SIGINT );
+    sigaddset( &signals, SIGTERM );
+    sigprocmask( SIG_BLOCK, &signals, NULL );
+    signal( SIGPIPE, SIG_IGN );
+    int signal_fd = signalfd( -1, &signals, SFD_NONBLOCK | SFD_CLOEXEC );
+
+    struct reactor * loop = reactor_create();
+    int input_fd = eventqueue_init();
+    if ( !loop || signal_fd < 0 || input_fd < 0 ) {
+        logerr("Could not set up main loop");
+        return -1;
+    }
+    init_control( loop, &server );
+    reactor_add( loop, signal_fd, EPOLLIN, sigHandler, loop );
+    reactor_add( loop, input_fd, EPOLLIN, inputHandler, &server );
+
+	if ( start_GPIO( pi_interface ) < 0 ) {
+		logerr("Could not start GPIO input");
+		return -1;
+	}
+
 	if (configured_parameters & SBPD_cfg_host) {
 		if (!(configured_parameters & SBPD_cfg_port)) {
 			server.port=9000;
@@ -221,17 +332,6 @@ int main(int argc, char * argv[]) {
 		}
 	}
 
-    //
-    // Configure signal handling
-    //
-    struct sigaction act;
-    memset( &act, 0, sizeof(act) );
-    act.sa_sigaction = &sigHandler;
-    act.sa_flags     = SA_SIGINFO;
-    sigaction( SIGINT, &act, NULL );
-    sigaction( SIGTERM, &act, NULL );
-
-
     //
     // Find MAC
     //
@@ -253,40 +353,46 @@ int main(int argc, char * argv[]) {
 		}
 	}
 
-    init_comm(MAC);
+    if ( init_comm( MAC, server.cli_port, loop, command_done ) < 0 )
+        logerr("Could not initialize server communication, only keyboard commands work");
+    else
+        comm_server( &server );
+    if ( init_player_state( MAC, server.cli_port, loop ) < 0 )
+        logerr("Could not subscribe to the player state");
+    else
+        player_state_server( &server );
+    if ( init_server_set( loop, &server ) < 0 )
+        logerr("Could not set up server failover");
 
     //
     //
     // Main Loop
     //
+    //  Wakes up only for input events, discovery and signals
     //
-
-	loginfo("Starting main loop polling");
-    while( !stop_signal ) {
-        //
-        //  Poll the server discovery
-        //
-        poll_discovery(configured_parameters,
-                       &discovered_parameters,
-                       &server);
-        handle_buttons(&server);
-        handle_encoders(&server);
-        //
-        // Just sleep...
-        //
-        usleep( SCD_SLEEP_TIMEOUT ); // 0.1s
-
-    } // end of: while( !stop_signal )
+	loginfo("Starting main loop");
+    start_discovery(loop,
+                    configured_parameters,
+                    &discovered_parameters,
+                    &server);
+    if ( !stop_signal )
+        reactor_run( loop );
 
     //
     //  Shutdown server communication
     //
+    shutdown_server_set();
     shutdown_comm();
+    shutdown_player_state();
 	if (keyboard_inuse) { 
 		disconnect_uinput();
 	}
 
 	shutdown_GPIO( pi_interface );
+    reactor_destroy( loop );
+    close( signal_fd );
+    registry_free();
+    free( arg_elements );
 
     return 0;
 }
@@ -355,6 +461,17 @@ parse_opt (int key, char *arg, struct argp_state *state)
             loginfo("Options parsing: Manually set http port %lu", server.port);
             configured_parameters |= SBPD_cfg_port;
             break;
+            //  Failover server
+        case 'S': {
+            char * port = strrchr(arg, ':');
+            if (port)
+                *port++ = 0;
+            if (server_set_add(arg, port ? (uint32_t)strtoul(port, NULL, 10) : 0, true) < 0)
+                logerr("Options parsing: Too many servers, %s ignored", arg);
+            else
+                loginfo("Options parsing: Failover server %s", arg);
+            break;
+        }
             //  Server user name
         case 'u':
             server.user = arg;
@@ -367,6 +484,21 @@ parse_opt (int key, char *arg, struct argp_state *state)
             loginfo("Options parsing: Manually set http password");
             configured_parameters |= SBPD_cfg_password;
             break;
+            //  Server CLI transport
+        case 'C':
+            server.cli_port = arg ? (uint32_t)strtoul(arg, NULL, 10) : LMSCLI_PORT;
+            loginfo("Options parsing: Send commands through CLI port %u", server.cli_port);
+            break;
+            //  GPIO character device
+        case 'g':
+            gpio_chip = arg;
+            loginfo("Options parsing: Set GPIO device %s", gpio_chip);
+            break;
+            //  GPIO backend
+        case 'B':
+            gpio_backend = arg;
+            loginfo("Options parsing: Set GPIO backend %s", gpio_backend);
+            break;
         // Server Configuration file for button commands
         case 'f':
             server.config_file = arg;
@@ -374,7 +506,7 @@ parse_opt (int key, char *arg, struct argp_state *state)
             configured_parameters |= SBPD_cfg_config;
             break;
         case ARGP_KEY_ARG:
-            if (arg_element_count == (max_encoders + max_buttons)) {
+            if (arg_element_count == arg_element_max) {
                 logerr("Too many control elements defined");
                 return ARGP_ERR_UNKNOWN;
             }
@@ -404,6 +536,10 @@ parse_opt (int key, char *arg, struct argp_state *state)
 //          mode: Optional. one of
 //                1 - Step mode (default)
 //                <2-9> - Detent mode - Assumes 1 dial click is x steps.
+//          Settings: Optional, name=value
+//                res=quarter|half|full - steps per quadrature cycle
+//                accel=lin|exp[:ms[:max]] or accel=tab:ms/mult[:ms/mult...] - acceleration
+//                abs[=ms] - absolute volume setpoint, sent at most every ms
 //  For buttons:
 //      b,pin,CMD[,resist,pressed,CMD_LONG]
 //          "b" for "Button"
@@ -425,26 +561,162 @@ parse_opt (int key, char *arg, struct argp_state *state)
 //                1 - state is 1
 //           CMD_LONG: Command to be used for a long button push, see above command list
 //           long_time: Number of millivoid seconds to define a long press
+//           Settings: Optional, name=value
+//                debounce=[integrator:|lockout:]ms - debounce algorithm and settle time
+//                repeat=delay[/rate] - auto-repeat while held
+//                dbl=CMD, tpl=CMD, click=ms - multi-click commands and click window
+//  For a key matrix:
+//      m,row+row[+row...],col+col[+col...]
+//          "m" for "Matrix"
+//           row, col: GPIO PIN numbers of the row and column lines
+//           Settings: Optional, name=value
+//                scan=hz - scans per second
+//                debounce=ms - time a key needs to read a new state
+//  For keys of the key matrix:
+//      k,row,col,CMD[,CMD_LONG,long_time]
+//          "k" for "Key"
+//           row, col: position in the matrix, starting at 0
+//           CMD, CMD_LONG, long_time, settings: as for buttons, no debounce
+//  For keys and axes of input devices:
+//      i,device,KEY_code,CMD[,CMD_LONG,long_time]
+//      i,device,REL_code,CMD[,mode]
+//          "i" for "Input device"
+//           device: device path, e.g. /dev/input/event0, or device name
+//           code: key (KEY_, BTN_ or number) or relative axis (REL_) code
+//           keys: CMD, CMD_LONG, long_time, settings: as for buttons, no debounce
+//           axes: CMD, mode, settings: as for encoders
+//           Settings: Optional, name=value
+//                grab=1 - take the device exclusively
+//  For chords:
+//      c,pin+pin[+pin...],CMD
+//          "c" for "Chord"
+//           pin: GPIO PIN numbers of configured buttons, kROW:COL of matrix
+//                keys or codes of input device keys
+//           CMD: Command, like for buttons
+//           Settings: Optional, name=value
+//                window=ms - max time between the first and the last press
+//
+//
+//  Element argument fields
+//  Positional fields come first, the first name=value field starts the
+//  optional settings. All following fields are settings, too.
+//
+static struct element_options element_opts;
+
+static void add_element_option( char * field ) {
+    if ( element_opts.count == MAX_ELEMENT_OPTIONS ) {
+        logerr("Too many settings, ignoring %s", field);
+        return;
+    }
+    char * value = strchr( field, '=' );
+    *value++ = 0;
+    element_opts.name[element_opts.count] = field;
+    element_opts.value[element_opts.count] = value;
+    element_opts.count++;
+}
+
+//
+//  Next positional field, NULL at the end or when the settings start
 //
+static char * next_field( void ) {
+    char * field = strtok(NULL, ",");
+    if ( field && strchr( field, '=' ) ) {
+        while ( field ) {
+            if ( strchr( field, '=' ) )
+                add_element_option( field );
+            else
+                logerr("Ignoring field %s after settings", field);
+            field = strtok(NULL, ",");
+        }
+    }
+    return field;
+}
+
+//
+//  Collect settings following the last positional field
+//
+static void end_fields( void ) {
+    char * field;
+    while ( (field = next_field()) )
+        logerr("Ignoring extra field %s", field);
+}
+
+//
+//  Count the configured elements by kind, the registry is sized from them
+//
+static void count_elements( struct registry_counts * counts ) {
+    memset( counts, 0, sizeof(*counts) );
+    for (int arg_num = 0; arg_num < arg_element_count; arg_num++) {
+        const char * arg = arg_elements[arg_num];
+        switch (arg[0]) {
+            case 'b':
+                counts->buttons++;
+                break;
+            case 'e':
+                counts->encoders++;
+                break;
+            case 'k':
+                counts->keys++;
+                break;
+            case 'c':
+                counts->chords++;
+                break;
+            case 'i': {
+                //  i,device,code,... relative axes have REL_ codes
+                const char * code = strchr( arg, ',' );
+                if ( code )
+                    code = strchr( code + 1, ',' );
+                if ( code && strncasecmp( code + 1, "REL_", 4 ) == 0 )
+                    counts->input_axes++;
+                else
+                    counts->input_keys++;
+            }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+//
+//  Elements are set up in passes: the key matrix before its keys,
+//  chords after the buttons they refer to.
+//  Only the element code is checked, the fields are cut up by strtok().
+//
+static int element_pass( const char * arg ) {
+    switch (arg[0]) {
+        case 'm':
+            return 0;
+        case 'c':
+            return 2;
+        default:
+            return 1;
+    }
+}
+
 static error_t parse_arg( int pi ) {
+    for (int pass = 0; pass < 3; pass++)
     for (int arg_num = 0; arg_num < arg_element_count; arg_num++) {
         char * arg = arg_elements[arg_num];
+        if ( element_pass(arg) != pass )
+            continue;
         {
             char * code = strtok(arg, ",");
             if (strlen(code) != 1)
                 return ARGP_ERR_UNKNOWN;
+            element_opts.count = 0;
             switch (code[0]) {
                 case 'e': {
-                    char * string = strtok(NULL, ",");
+                    char * string = next_field();
                     int p1 = 0;
                     if (string)
                         p1 = (int)strtol(string, NULL, 10);
-                    string = strtok(NULL, ",");
+                    string = next_field();
                     int p2 = 0;
 					if (string)
                         p2 = (int)strtol(string, NULL, 10);
-                    char * cmd = strtok(NULL, ",");
-					string = strtok(NULL, ",");
+                    char * cmd = next_field();
+					string = next_field();
                     int mode = 1;
 					if (string)
                         mode = (int)strtol(string, NULL, 10);
@@ -452,27 +724,28 @@ static error_t parse_arg( int pi ) {
                         logerr("Encoder argument error");
                         return ARGP_ERR_UNKNOWN;
                     }
-                    setup_encoder_ctrl( pi, cmd, p1, p2, mode);
+                    end_fields();
+                    setup_encoder_ctrl( pi, cmd, p1, p2, mode, &element_opts);
                 }
                     break;
                 case 'b': {
-                    char * string = strtok(NULL, ",");
+                    char * string = next_field();
                     int pin = 0;
                     if (string)
                         pin = (int)strtol(string, NULL, 10);
-                    char * cmd = strtok(NULL, ",");
+                    char * cmd = next_field();
                     int resist = 2;
-                    string = strtok(NULL, ",");
+                    string = next_field();
                     if (string)
                         resist = (int)strtol(string, NULL, 10);
                     bool pressed = 0;
-                    string = strtok(NULL, ",");
+                    string = next_field();
                     if (string)
                         pressed = (int)strtol(string, NULL, 10);
                     char * cmd_long = NULL;
                     if (string)
-                        cmd_long = strtok(NULL, ",");
-                    string = strtok(NULL, ",");
+                        cmd_long = next_field();
+                    string = next_field();
                     uint32_t long_time=3000;
                     if (string)
                         long_time = (int)strtol(string, NULL, 10);
@@ -480,7 +753,73 @@ static error_t parse_arg( int pi ) {
                         logerr("Button argument error");
                         return ARGP_ERR_UNKNOWN;
                     }
-                    setup_button_ctrl(pi, cmd, pin, resist, pressed, cmd_long, long_time);
+                    end_fields();
+                    setup_button_ctrl(pi, cmd, pin, resist, pressed, cmd_long, long_time, &element_opts);
+                }
+                    break;
+                case 'm': {
+                    char * rows = next_field();
+                    char * cols = next_field();
+                    if ( (rows == NULL) | (cols == NULL) ) {
+                        logerr("Key matrix argument error");
+                        return ARGP_ERR_UNKNOWN;
+                    }
+                    end_fields();
+                    setup_matrix_ctrl(pi, rows, cols, &element_opts);
+                }
+                    break;
+                case 'k': {
+                    char * string = next_field();
+                    int row = -1;
+                    if (string)
+                        row = (int)strtol(string, NULL, 10);
+                    string = next_field();
+                    int col = -1;
+                    if (string)
+                        col = (int)strtol(string, NULL, 10);
+                    char * cmd = next_field();
+                    char * cmd_long = NULL;
+                    if (cmd)
+                        cmd_long = next_field();
+                    string = next_field();
+                    uint32_t long_time=3000;
+                    if (string)
+                        long_time = (int)strtol(string, NULL, 10);
+                    if ( (row < 0) | (col < 0) | (cmd == NULL) ) {
+                        logerr("Key argument error");
+                        return ARGP_ERR_UNKNOWN;
+                    }
+                    end_fields();
+                    setup_key_ctrl(pi, cmd, row, col, cmd_long, long_time, &element_opts);
+                }
+                    break;
+                case 'i': {
+                    char * device = next_field();
+                    char * code = next_field();
+                    char * cmd = next_field();
+                    char * arg1 = NULL;
+                    char * arg2 = NULL;
+                    if (cmd)
+                        arg1 = next_field();
+                    if (arg1)
+                        arg2 = next_field();
+                    if ( (device == NULL) | (code == NULL) | (cmd == NULL) ) {
+                        logerr("Input device argument error");
+                        return ARGP_ERR_UNKNOWN;
+                    }
+                    end_fields();
+                    setup_input_ctrl(pi, device, code, cmd, arg1, arg2, &element_opts);
+                }
+                    break;
+                case 'c': {
+                    char * pins = next_field();
+                    char * cmd = next_field();
+                    if ( (pins == NULL) | (cmd == NULL) ) {
+                        logerr("Chord argument error");
+                        return ARGP_ERR_UNKNOWN;
+                    }
+                    end_fields();
+                    setup_chord_ctrl(cmd, pins, &element_opts);
                 }
                     break;
                     
@@ -492,14 +831,23 @@ static error_t parse_arg( int pi ) {
     return 0;
 }
 
-void parse_config() {
+//
+//  Read the command config file
+//  Parameters:
+//      add: add the commands, false to only count them
+//  Returns: number of commands
+//
+int parse_config( bool add ) {
     char *s, buff[256];
     FILE *fp = NULL;
+    int count = 0;
     if (configured_parameters & SBPD_cfg_config) {
         fp = fopen ( server.config_file, "r");
-        if (fp == NULL) loginfo("Config file %s : not found", server.config_file);
+        if (fp == NULL && add) loginfo("Config file %s : not found", server.config_file);
     }
     if (fp == NULL) {
+        if (!add)
+            return 6;
         loginfo("Using builtin button configuration");
         add_lms_command_frament ( "PLAY", "[\"pause\"]" );
         add_lms_command_frament ( "VOL+", "[\"button\",\"volup\"]" );
@@ -507,7 +855,7 @@ void parse_config() {
         add_lms_command_frament ( "PREV", "[\"button\",\"rew\"]" );
         add_lms_command_frament ( "NEXT", "[\"button\",\"fwd\"]" );
         add_lms_command_frament ( "POWR", "[\"button\",\"power\"]" );
-        return;
+        return 6;
     }
     //Start reading file, line by line
     while ((s = fgets (buff, sizeof buff, fp)) != NULL) {
@@ -532,17 +880,20 @@ void parse_config() {
         // Remove beginning and trailing whitespace
         trim (value);
 
-        loginfo ("name=%s, value=%s", name, value);
-        if (strlen(name) == 4) {  
-            if ( add_lms_command_frament ( name, value ) != 0 ) {  
-                loginfo ("Too many commands in config file, reduce the number of commands");
-                continue;
-            } 
-        } else {
-            loginfo ("Invalid or missing commands in config file.");
+        if (strlen(name) != 4) {
+            if (add)
+                loginfo ("Invalid or missing commands in config file.");
+            continue;
         }
+        count++;
+        if (!add)
+            continue;
+        loginfo ("name=%s, value=%s", name, value);
+        if ( add_lms_command_frament ( name, value ) != 0 )
+            logerr ("Config file changed while reading, ignoring command %s", name);
     }
     fclose (fp);
+    return count;
 }
 
 //
@@ -551,6 +902,19 @@ void parse_config() {
 //
 //
 
+//
+// element_option: value of an optional element setting
+//
+char * element_option(const struct element_options * options, const char * name) {
+    if ( !options )
+        return NULL;
+    for ( int i = 0; i < options->count; i++ ) {
+        if ( strcasecmp( options->name[i], name ) == 0 )
+            return options->value[i];
+    }
+    return NULL;
+}
+
 //
 // trim: get rid of trailing and leading whitespace, including the trailing "\n" from fgets()
 //
@@ -573,28 +937,38 @@ char * trim (char * s) {
 
 //
 // Handle signals
+// Read from the signalfd by the main loop
 //
-static void sigHandler( int sig, siginfo_t *siginfo, void *context )
+static void sigHandler( int fd, uint32_t events, void * ctx )
 {
+    struct signalfd_siginfo info;
+    if ( read( fd, &info, sizeof(info) ) != sizeof(info) )
+        return;
     //
     // What sort of signal is to be processed ?
     //
-    switch( sig ) {
+    switch( info.ssi_signo ) {
             //
             // A normal termination request
             //
         case SIGINT:
         case SIGTERM:
-            stop_signal = sig;
-            break;
-            //
-            // Ignore broken pipes
-            //
-        case SIGPIPE:
+            stop_signal = info.ssi_signo;
+            reactor_stop( (struct reactor *)ctx );
             break;
     }
 }
 
+//
+// Handle input events
+// The GPIO input thread signals queued events through an eventfd
+//
+static void inputHandler( int fd, uint32_t events, void * ctx )
+{
+    eventqueue_ack();
+    handle_input( (struct sbpd_server *)ctx );
+}
+
 //
 //  Logging facility
 //
@@ -651,9 +1025,13 @@ int loglevel() {
     return MAX(sysloglevel, streamloglevel);
 }
 
+//
+//  Milliseconds for intervals and deadlines
+//  CLOCK_MONOTONIC, a Pi without RTC steps the wall clock when NTP syncs.
+//
 long long ms_timer(void) {
     struct timespec tv;
 
-    clock_gettime(CLOCK_REALTIME, &tv);
-    return (((long long)tv.tv_sec)*1000)+(tv.tv_nsec/1e6);
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (((long long)tv.tv_sec)*1000)+(tv.tv_nsec/1000000);
 }
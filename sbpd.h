@@ -88,21 +88,32 @@ struct sbpd_server {
     char *      user;
     char *      password;
     char *      config_file;
+    uint32_t    cli_port;       // CLI port for commands, 0 for HTTP JSON-RPC
 };
 
 //
-//  Define scheduling behavior
-//  We use usleep so this is in µs
+//  Optional element settings
+//  Given as name=value after the positional fields of an element argument,
+//  e.g. e,23,24,VOLU,4,res=half
 //
-#define SCD_SLEEP_TIMEOUT   100000
-#define SCD_SECOND          1000000
+#define MAX_ELEMENT_OPTIONS 16
+struct element_options {
+    int count;
+    char * name[MAX_ELEMENT_OPTIONS];
+    char * value[MAX_ELEMENT_OPTIONS];
+};
+
+//
+//  Returns: value of the setting, NULL if not given
+//
+char * element_option(const struct element_options * options, const char * name);
 
 //
 //  Helpers
 //
 #define STRTOU32(x) (*((uint32_t *)x))  // make a 32 bit integer from a 4 char string
 
-void parse_config();
+int parse_config( bool add );
 char * trim (char * s);
 
 //
@@ -115,5 +126,5 @@ char * trim (char * s);
 #define logdebug( args... )    _mylog( __FILE__, __LINE__, LOG_DEBUG, args )
 void _mylog( const char *file, int line, int prio, const char *fmt, ... );
 int loglevel();
-long long ms_timer(void);
+long long ms_timer(void);   // CLOCK_MONOTONIC ms, for intervals only
 #endif /* sbpd_h */
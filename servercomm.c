@@ -36,169 +36,989 @@
 
 #include "servercomm.h"
 #include "sbpd.h"
+#include "registry.h"
+#include "lmscli.h"
+#include "lmsreply.h"
 #include <curl/curl.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 
-//
-// lock for asynchronous sending of commands - we don't do this right now
-//
-/*#include <pthread.h>
+extern char ** environ;
 
-static volatile bool commLock;
-static pthread_mutex_t lock;*/
-
-static CURL *curl;
+static CURLM * multi = NULL;
 static char * MAC = NULL;
 static struct curl_slist * headerList = NULL;
 
 #define JSON_CALL_MASK	"{\"id\":%ld,\"method\":\"slim.request\",\"params\":[\"%s\",%s]}"
 #define SERVER_ADDRESS_TEMPLATE "http://localhost/jsonrpc.js"
 
+//
+//  Network worker
+//  Requests are queued by the main loop and sent by the worker thread,
+//  results go back through the result ring and done_fd.
+//  outstanding counts requests from queuing until their result is
+//  handled, so the result ring can never overflow. Retry notices
+//  count as well while they are in the ring.
+//  The queue fields are protected by lock, the transfers and the
+//  worker event loop are used by the worker thread only.
+//
+struct comm_request {
+    uint32_t tag;
+    int32_t value;
+    int command;
+    int class;                  // COMM_CLASS_
+    int body;                   // precompiled body, -1 for fragment
+    long long queued;           // ms_timer() time, for the expiry of the class policy
+    long long not_before;       // ms_timer() time of the next retry, 0 for right away
+    int attempts;               // sent so far without reaching the server
+    bool probe;                 // sent while the circuit breaker is open
+    char fragment[COMM_FRAGMENT_LEN];
+};
+
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool worker_running = false;
+static bool worker_stop = false;
+static struct comm_request requests[COMM_QUEUE_SIZE];  // in queuing order
+static int request_count = 0;
+static struct comm_result results[COMM_QUEUE_SIZE];
+static int result_head = 0;
+static int result_count = 0;
+static int outstanding = 0;
+static struct lms_reply latest;     // fields of all replies so far, newest kept
+static int wake_fd = -1;
+static int done_fd = -1;
+static struct reactor * done_loop = NULL;
+static comm_handler_t done_handler = NULL;
+
+//
+//  Precompiled request bodies
+//  Static fragments are registered while the configuration is read and
+//  compiled into complete JSON-RPC bodies once the MAC is known, see
+//  init_comm(). Sending one of them only hands the body to curl.
+//
+struct comm_body {
+    const char * fragment;
+    int class;
+    size_t length;
+    char * body;                // COMM_BODY_LEN
+    int line_length;            // CLI line, -1 if the fragment can't be sent by CLI
+    char * line;                // COMM_LINE_LEN
+};
+#define COMM_BODY_LEN   (COMM_FRAGMENT_LEN + 80)
+#define COMM_LINE_LEN   (3 * COMM_FRAGMENT_LEN + 64)
+static struct comm_body * bodies = NULL;
+static char * body_text = NULL;
+static char * line_text = NULL;
+static int body_capacity = 0;
+static int numberofbodies = 0;
+
+//
+//  Server connection settings
+//  Compiled when the server changes, protected by lock.
+//  Each curl handle takes them over before its next command.
+//
+static struct {
+    char host[64];
+    uint32_t port;
+    uint32_t generation;        // changes with every new server
+    char target[100];           // "::host:port"
+    char secret[255];           // "user:password", empty for none
+    const char * user;
+    const char * password;
+} connection;
+
+//
+//  Keep-alive
+//  The connection stays open between commands, TCP keep-alive probes
+//  find a dead server while idle. A query warms up the connection when
+//  the server changes, so the first command goes out on an open socket.
+//
+#define COMM_KEEPIDLE   30
+#define COMM_KEEPINTVL  10
+#define COMM_WARMUP     "[\"version\",\"?\"]"
+
+//
+//  Transfers in flight
+//  A curl handle each for server commands. The buffers handed to curl
+//  have to stay until the transfer is done.
+//
+struct comm_transfer {
+    CURL * curl;
+    bool busy;
+    uint32_t generation;        // connection settings the handle has
+    struct comm_request request;
+    struct curl_slist * targetList;
+    char errbuf[CURL_ERROR_SIZE];
+    char jsonFragment[COMM_BODY_LEN];
+    struct reply_parser parser;
+};
+
+static struct reactor * worker_loop = NULL;
+static int worker_timer = -1;
+static int retry_timer = -1;            // next retry, expiry or probe due
+static struct comm_transfer transfers[COMM_HANDLES];
+static bool class_busy[COMM_CLASSES];
+
+//
+//  CLI transport
+//  With a CLI port set, LMS commands go through the CLI connection,
+//  see lmscli.c. Only fragments with parameter hashes still go by HTTP.
+//  The connection keeps the commands in order, they are completed
+//  in the order they were sent.
+//
+static uint32_t cli_port = 0;
+static struct lmscli * cli = NULL;
+static uint32_t cli_generation = 0;     // connection settings the CLI has
+static struct comm_request cli_requests[COMM_QUEUE_SIZE];
+static int cli_head = 0;
+static int cli_count = 0;
+
+//
+//  Script running, scripts are run one at a time
+//
+static struct {
+    pid_t pid;
+    int pidfd;
+    struct comm_request request;
+} script = { .pid = 0, .pidfd = -1 };
+
+//
+//  Delivery policies by command class
+//  Commands are dropped when they can't be sent before the expiry,
+//  transport commands that did not reach the server are retried until then.
+//
+static const struct {
+    long expiry_ms;
+    bool retry;
+} policies[COMM_CLASSES] = {
+    [COMM_CLASS_TRANSPORT] = { COMM_EXPIRY_TRANSPORT, true },
+    [COMM_CLASS_MIXER] = { COMM_EXPIRY_MIXER, false },
+    [COMM_CLASS_SCRIPT] = { 0, false },
+    [COMM_CLASS_OTHER] = { COMM_EXPIRY_OTHER, false },
+};
+
+//
+//  Circuit breaker, protected by lock
+//  Opens after COMM_BREAKER_FAILURES LMS commands in a row got no answer.
+//  While open, commands that can't wait fail right away and the others
+//  wait in the queue, only a probe is sent now and then. The first answer
+//  closes it. Discovery finding the server again probes right away.
+//
+static struct {
+    bool open;
+    int failures;               // LMS commands in a row without an answer
+    long long probe_at;         // ms_timer() time of the next probe
+    long probe_ms;              // probe interval, doubled up to the max
+    bool probing;               // probe in flight
+} breaker;
+
+//
+//  Count the outcome of an LMS command, call with lock held
+//  Returns: true if the breaker closed, waiting commands can go
+//
+static bool breaker_update(bool answered) {
+    if (answered) {
+        bool closed = breaker.open;
+        if (closed)
+            loginfo("Server answers again, circuit breaker closed");
+        breaker.open = false;
+        breaker.failures = 0;
+        return closed;
+    }
+    if (++breaker.failures < COMM_BREAKER_FAILURES || breaker.open)
+        return false;
+    logwarn("Server does not answer, circuit breaker open");
+    breaker.open = true;
+    breaker.probe_ms = COMM_BREAKER_PROBE_MIN;
+    breaker.probe_at = ms_timer() + breaker.probe_ms;
+    return false;
+}
+
+//
+//  Class of a command, by the first word of the fragment
+//
+static int comm_class(int command, const char * fragment) {
+    static const char * queries[] = { "status", "serverstatus", "players", "player",
+                                      "version", "syncgroups", NULL };
+    if (command == SCRIPT)
+        return COMM_CLASS_SCRIPT;
+    while (*fragment == '[' || *fragment == ' ' || *fragment == '"')
+        fragment++;
+    size_t len = strcspn(fragment, "\",] ");
+    if (len == 5 && strncmp(fragment, "mixer", len) == 0)
+        return COMM_CLASS_MIXER;
+    for (const char ** query = queries; *query; query++) {
+        if (strlen(*query) == len && strncmp(fragment, *query, len) == 0)
+            return COMM_CLASS_OTHER;
+    }
+    return COMM_CLASS_TRANSPORT;
+}
+
+//
+//  Hand a result to the main loop
+//  Fields of server replies are kept for scripts, see run_script().
+//  flags: RESULT_EXPIRED dropped by the delivery policy,
+//         RESULT_RETRIED queued again, only for the server health
+//
+#define RESULT_EXPIRED  0x1
+#define RESULT_RETRIED  0x2
+
+static void post_result(const struct comm_request * request, bool ok, bool reached,
+                        unsigned int flags, const struct lms_reply * reply) {
+    struct comm_result result = {
+        .tag = request->tag,
+        .value = request->value,
+        .command = request->command,
+        .ok = ok,
+        .reached = reached,
+        .expired = (flags & RESULT_EXPIRED) != 0,
+        .retried = (flags & RESULT_RETRIED) != 0,
+    };
+    if (reply)
+        result.reply = *reply;
+    pthread_mutex_lock(&lock);
+    if (reply)
+        reply_merge(&latest, reply);
+    results[(result_head + result_count) % COMM_QUEUE_SIZE] = result;
+    result_count++;
+    pthread_mutex_unlock(&lock);
+    uint64_t one = 1;
+    if (write(done_fd, &one, sizeof(one)) < 0)
+        logerr("Could not signal command result");
+}
+
+//
+//  Run dispatch() on the worker loop
+//
+static void wake_worker(void) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0)
+        logerr("Could not wake network worker");
+}
+
+//
+//  LMS command done, worker thread only
+//  Feeds the circuit breaker, queues the command again for a retry
+//  if its policy allows, otherwise hands the result to the main loop.
+//  answered: the server answered, even if with an error
+//
+static void deliver_result(const struct comm_request * request, bool ok, bool reached,
+                           bool answered, const struct lms_reply * reply) {
+    long long now = ms_timer();
+    pthread_mutex_lock(&lock);
+    if (request->probe)
+        breaker.probing = false;
+    bool closed = breaker_update(answered);
+    if (!reached && !worker_stop && policies[request->class].retry &&
+        now < request->queued + policies[request->class].expiry_ms) {
+        //  retried before all others, the class stays in order
+        memmove(requests + 1, requests, request_count * sizeof(*requests));
+        requests[0] = *request;
+        requests[0].probe = false;
+        requests[0].attempts++;
+        long backoff = COMM_RETRY_MIN << (requests[0].attempts - 1);
+        requests[0].not_before = now + ((backoff > COMM_RETRY_MAX) ? COMM_RETRY_MAX : backoff);
+        request_count++;
+        //  the main loop learns about the failure right away, if there is room
+        bool notify = outstanding < COMM_QUEUE_SIZE;
+        if (notify)
+            outstanding++;
+        pthread_mutex_unlock(&lock);
+        loginfo("Command not sent, retry %d", requests[0].attempts);
+        if (notify)
+            post_result(request, false, false, RESULT_RETRIED, NULL);
+        wake_worker();
+        return;
+    }
+    pthread_mutex_unlock(&lock);
+    if (closed)
+        wake_worker();
+    post_result(request, ok, reached, 0, reply);
+}
+
+//
+//  Take over new connection settings, worker thread only
+//
+static void connect_transfer(struct comm_transfer * transfer) {
+    char secret[sizeof(connection.secret)];
+
+    pthread_mutex_lock(&lock);
+    if (transfer->generation == connection.generation) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    transfer->generation = connection.generation;
+    curl_slist_free_all(transfer->targetList);
+    transfer->targetList = curl_slist_append(NULL, connection.target);
+    strcpy(secret, connection.secret);
+    pthread_mutex_unlock(&lock);
+
+    //
+    //  target setup. We call an IPv4 ip so we need to replace a default host
+    //
+    curl_easy_setopt(transfer->curl, CURLOPT_CONNECT_TO, transfer->targetList);
+    //
+    //  username/password?
+    //
+    curl_easy_setopt(transfer->curl, CURLOPT_USERPWD, secret[0] ? secret : NULL);
+}
+
 //
 //
-//  Send CLI command fragment to Logitech Media Server/Squeezebox Server
-//  This command blocks (synchronously communicates".
-//  In timing critical situations this should be called from a separate thread
+//  Start sending CLI command fragment to Logitech Media Server/Squeezebox Server
+//  All other options of the handle are set once in init_comm().
 //
 //  Parameters:
-//      server: the server information structure defining host, port etc.
-//      frament: the command fragment to be sent as JSON array
+//      transfer: a free transfer, request is the queued command
+//               with a precompiled body or a fragment to be sent as JSON array
 //               e.g. "[\"mixer\”,\"volume\",\"+2\"]"
 //               optionally: some CLI commands can take parameter hashes as "params:{}"
 //  Returns: success flag
 //
 //
-bool send_command(struct sbpd_server * server, int command, char * fragment) {
-    loginfo("Send Command:%d, Fragment:%s", command, fragment);
-    if ( command == LMS ) {
-        if (!curl)
-            return false;
+static bool send_command(struct comm_transfer * transfer) {
+    struct comm_request * request = &transfer->request;
+    CURL * curl = transfer->curl;
 
+    connect_transfer(transfer);
+    transfer->errbuf[0] = 0;
+    reply_start(&transfer->parser);
+    if (request->body >= 0) {
+        const struct comm_body * body = bodies + request->body;
+        loginfo("Send Command:%d, Fragment:%s", request->command, body->fragment);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)body->length);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body->body);
+    } else {
         //
-        //  Sending commands asynchronously? Secure with a mutex
-        //  But right now we are actually not doing that, so comment out
+        //  setup payload (JSON/RPC CLI command) for POST command
         //
-        /*pthread_mutex_lock(&lock);
-        if (commLock) {
-            pthread_mutex_unlock(&lock);
-            return false;
+        loginfo("Send Command:%d, Fragment:%s", request->command, request->fragment);
+        int length = snprintf(transfer->jsonFragment, sizeof(transfer->jsonFragment),
+                              JSON_CALL_MASK, 1l, MAC, request->fragment);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)length);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, transfer->jsonFragment);
+    }
+    if (curl_multi_add_handle(multi, curl) != CURLM_OK)
+        return false;
+    transfer->busy = true;
+    return true;
+}
+
+//
+//  Transfer done: log errors, post the result and free the transfer
+//
+static void command_sent(struct comm_transfer * transfer, CURLcode res) {
+    bool ok = false, reached = true;
+
+    if(res != CURLE_OK) {
+        size_t len = strlen(transfer->errbuf);
+        loginfo("Curl Error: (%d) ", res);
+        if(len)
+            loginfo( "%s%s", transfer->errbuf,
+                     ((transfer->errbuf[len - 1] != '\n') ? "\n" : ""));
+        else
+            loginfo( "%s\n", curl_easy_strerror(res));
+        //  nothing was sent if there was no connection, a timeout before
+        //  the connection was made is a server that is off or gone.
+        //  Later failures may come after the server ran the command, they
+        //  are not retried, a toggle like pause would run twice.
+        double connect_time = 0;
+        curl_easy_getinfo(transfer->curl, CURLINFO_CONNECT_TIME, &connect_time);
+        reached = (res != CURLE_COULDNT_CONNECT &&
+                   res != CURLE_COULDNT_RESOLVE_HOST &&
+                   res != CURLE_COULDNT_RESOLVE_PROXY &&
+                   !(res == CURLE_OPERATION_TIMEDOUT && connect_time <= 0));
+    } else {
+        long status = 0;
+        curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status);
+        if (status != 200)
+            loginfo("Server replied HTTP status %ld", status);
+        if (transfer->parser.reply.fields & REPLY_ERROR)
+            loginfo("Server replied error %d", transfer->parser.reply.error);
+        ok = (status == 200 && !(transfer->parser.reply.fields & REPLY_ERROR));
+    }
+    curl_multi_remove_handle(multi, transfer->curl);
+    transfer->busy = false;
+    class_busy[transfer->request.class] = false;
+    deliver_result(&transfer->request, ok, reached, res == CURLE_OK,
+                   (res == CURLE_OK) ? &transfer->parser.reply : NULL);
+}
+
+static void dispatch(void);
+
+//
+//  Script done
+//  fd is -1 when called right after the script ended
+//
+static void script_done(int fd, uint32_t events, void * ctx) {
+    int status = 0;
+    if (waitpid(script.pid, &status, 0) < 0)
+        logerr("Could not get exit status of %s", script.request.fragment);
+    if (script.pidfd >= 0) {
+        reactor_del(worker_loop, script.pidfd);
+        close(script.pidfd);
+        script.pidfd = -1;
+    }
+    script.pid = 0;
+    int err = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    if (err != 0)
+        loginfo ("%s exit status = %d\n", script.request.fragment, err);
+    class_busy[COMM_CLASS_SCRIPT] = false;
+    post_result(&script.request, err == 0, true, 0, NULL);
+    if (fd >= 0)
+        dispatch();
+}
+
+//
+//  Start a script command line through the shell
+//  The player state known from server replies is passed in the
+//  environment: SBPD_VOLUME, SBPD_MUTED, SBPD_MODE, SBPD_POWER, SBPD_TITLE,
+//  each only once a reply had it.
+//  The worker waits for it through a pidfd, without one
+//  (kernels before 5.3) it blocks until the script ends.
+//
+static bool run_script(const struct comm_request * request) {
+    char * argv[] = { "sh", "-c", (char *)request->fragment, NULL };
+    static char env_text[5][REPLY_TITLE_LEN + 16];
+    int count = 0;
+
+    while (environ[count])
+        count++;
+    char * envp[count + 6];
+    memcpy(envp, environ, count * sizeof(*envp));
+
+    pthread_mutex_lock(&lock);
+    struct lms_reply known = latest;
+    pthread_mutex_unlock(&lock);
+    if (known.fields & REPLY_VOLUME) {
+        snprintf(env_text[0], sizeof(env_text[0]), "SBPD_VOLUME=%d", known.volume);
+        envp[count++] = env_text[0];
+        snprintf(env_text[1], sizeof(env_text[1]), "SBPD_MUTED=%d", known.muted);
+        envp[count++] = env_text[1];
+    }
+    if (known.fields & REPLY_MODE) {
+        snprintf(env_text[2], sizeof(env_text[2]), "SBPD_MODE=%s", reply_mode_name(known.mode));
+        envp[count++] = env_text[2];
+    }
+    if (known.fields & REPLY_POWER) {
+        snprintf(env_text[3], sizeof(env_text[3]), "SBPD_POWER=%d", known.power);
+        envp[count++] = env_text[3];
+    }
+    if (known.fields & REPLY_TITLE) {
+        snprintf(env_text[4], sizeof(env_text[4]), "SBPD_TITLE=%s", known.title);
+        envp[count++] = env_text[4];
+    }
+    envp[count] = NULL;
+
+    loginfo("Sending commandline: %s\n", request->fragment);
+    script.request = *request;
+    if (posix_spawn(&script.pid, "/bin/sh", NULL, NULL, argv, envp) != 0) {
+        logerr("Could not run %s", request->fragment);
+        return false;
+    }
+#ifdef SYS_pidfd_open
+    script.pidfd = (int)syscall(SYS_pidfd_open, script.pid, 0);
+    if (script.pidfd >= 0 &&
+        reactor_add(worker_loop, script.pidfd, EPOLLIN, script_done, NULL) == 0)
+        return true;
+    if (script.pidfd >= 0)
+        close(script.pidfd);
+    script.pidfd = -1;
+#endif
+    script_done(-1, 0, NULL);
+    return true;
+}
+
+//
+//  CLI command done, the oldest sent
+//  Can be called from lmscli_send(), dispatch() runs again through wake_fd.
+//
+static void cli_sent(void * ctx, bool ok, bool reached) {
+    if (!cli_count)
+        return;
+    struct comm_request request = cli_requests[cli_head];
+    cli_head = (cli_head + 1) % COMM_QUEUE_SIZE;
+    cli_count--;
+    deliver_result(&request, ok, reached, ok, NULL);
+}
+
+//
+//  CLI line of a command
+//  Returns: length, -1 if the command has to go by HTTP
+//
+static int cli_line(const struct comm_request * request, char * buffer, size_t size,
+                    const char ** line) {
+    if (request->body >= 0) {
+        *line = bodies[request->body].line;
+        return bodies[request->body].line_length;
+    }
+    *line = buffer;
+    return lmscli_compile(buffer, size, MAC, request->fragment);
+}
+
+//
+//  Send a command through the CLI connection, call with lock held
+//  The command is taken off the queue already. The lock is released
+//  while the CLI works: a new server fails the commands in flight, their
+//  results take the lock, and connecting resolves the server name.
+//
+static void cli_command(const struct comm_request * request, const char * line, int length) {
+    char host[sizeof(connection.host)];
+    const char * user = connection.user;
+    const char * password = connection.password;
+    bool changed = (cli_generation != connection.generation);
+    if (changed) {
+        cli_generation = connection.generation;
+        strcpy(host, connection.host);
+    }
+    loginfo("Send Command:%d, Fragment:%s", request->command,
+            (request->body >= 0) ? bodies[request->body].fragment : request->fragment);
+    pthread_mutex_unlock(&lock);
+
+    if (changed)
+        lmscli_server(cli, host, cli_port, user, password, NULL, 0);
+    //  completions can come right away, when the connection fails
+    cli_requests[(cli_head + cli_count) % COMM_QUEUE_SIZE] = *request;
+    cli_count++;
+    if (lmscli_send(cli, line, (size_t)length) < 0) {
+        logwarn("Server CLI busy, command not sent");
+        cli_count--;
+        post_result(request, false, false, 0, NULL);
+    }
+    pthread_mutex_lock(&lock);
+}
+
+//
+//  Check an LMS command against its policy and the circuit breaker,
+//  call with lock held
+//  Returns: COMM_SEND, COMM_WAIT with *due set to the time to look again,
+//           or COMM_DROP
+//
+#define COMM_SEND   0
+#define COMM_WAIT   1
+#define COMM_DROP   2
+
+static int deliver_check(struct comm_request * request, long long now, long long * due) {
+    long long expiry = request->queued + policies[request->class].expiry_ms;
+    if (now >= expiry)
+        return COMM_DROP;
+    if (breaker.open) {
+        if (!breaker.probing && now >= breaker.probe_at && now >= request->not_before) {
+            breaker.probing = true;
+            request->probe = true;
+            breaker.probe_ms *= 2;
+            if (breaker.probe_ms > COMM_BREAKER_PROBE_MAX)
+                breaker.probe_ms = COMM_BREAKER_PROBE_MAX;
+            breaker.probe_at = now + breaker.probe_ms;
+            loginfo("Circuit breaker open, probing the server");
+            return COMM_SEND;
         }
-        commLock = true;
-        pthread_mutex_unlock(&lock);*/
+        if (!policies[request->class].retry)
+            return COMM_DROP;
+        *due = breaker.probing ? expiry : MIN(expiry, MAX(breaker.probe_at, request->not_before));
+        return COMM_WAIT;
+    }
+    if (now < request->not_before) {
+        *due = request->not_before;
+        return COMM_WAIT;
+    }
+    return COMM_SEND;
+}
 
-        //
-        //  target setup. We call an IPv4 ip so we need to replace a default host
-        //
-        struct curl_slist * targetList = NULL;
-        
-        curl_easy_setopt(curl, CURLOPT_URL, SERVER_ADDRESS_TEMPLATE);
-        char target[100];
-        snprintf(target, sizeof(target), "::%s:%d", server->host, server->port);
-        //logdebug("Command Target: %s", target);
-        targetList = curl_slist_append(targetList, target);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-        curl_easy_setopt(curl, CURLOPT_CONNECT_TO, targetList);
+//
+//  Start queued commands
+//  In queuing order, skipping commands of classes with a command in flight
+//  or waiting for a retry, so commands of one class never overtake each other.
+//
+static void dispatch(void) {
+    bool held[COMM_CLASSES] = { false };
+    long long now = ms_timer();
+    long long wake = 0;         // earliest retry, expiry or probe of waiting commands
 
-        // Setup an error buffer to log errors
-        char errbuf[CURL_ERROR_SIZE];
-        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
-        errbuf[0] = 0;
-        //
-        //  username/password?
-        //
-        char secret[255];
-        if (server->user && server->password) {
-            snprintf(secret, sizeof(secret), "%s:%s", server->user, server->password);
-            curl_easy_setopt(curl, CURLOPT_USERPWD, secret);
+    pthread_mutex_lock(&lock);
+    int cnt = 0;
+    while (cnt < request_count) {
+        struct comm_request * request = requests + cnt;
+        bool ordered = (request->class != COMM_CLASS_OTHER);
+        if (ordered && (class_busy[request->class] || held[request->class])) {
+            cnt++;
+            continue;
+        }
+        if (request->command == LMS) {
+            long long due = 0;
+            int check = deliver_check(request, now, &due);
+            if (check == COMM_WAIT) {
+                held[request->class] = true;
+                if (!wake || due < wake)
+                    wake = due;
+                cnt++;
+                continue;
+            }
+            if (check == COMM_DROP) {
+                struct comm_request dropped = *request;
+                request_count--;
+                memmove(request, request + 1, (request_count - cnt) * sizeof(*request));
+                pthread_mutex_unlock(&lock);
+                loginfo("Command dropped, server not answering: %s",
+                        (dropped.body >= 0) ? bodies[dropped.body].fragment : dropped.fragment);
+                post_result(&dropped, false, false, RESULT_EXPIRED, NULL);
+                pthread_mutex_lock(&lock);
+                continue;
+            }
+        }
+        char buffer[COMM_LINE_LEN];
+        const char * line = NULL;
+        int length = (cli_port && request->command == LMS) ?
+            cli_line(request, buffer, sizeof(buffer), &line) : -1;
+        if (length >= 0) {
+            struct comm_request started = *request;
+            request_count--;
+            memmove(request, request + 1, (request_count - cnt) * sizeof(*request));
+            cli_command(&started, line, length);
+            continue;
         }
+        struct comm_transfer * transfer = NULL;
+        if (request->command == LMS) {
+            for (int i = 0; i < COMM_HANDLES && !transfer; i++) {
+                if (!transfers[i].busy)
+                    transfer = transfers + i;
+            }
+            if (!transfer) {
+                cnt++;
+                continue;
+            }
+        }
+        struct comm_request started = *request;
+        request_count--;
+        memmove(request, request + 1, (request_count - cnt) * sizeof(*request));
+        pthread_mutex_unlock(&lock);
 
-        //
-        //  setup payload (JSON/RPC CLI command) for POST command
-        //
-        char jsonFragment[256];
-        snprintf(jsonFragment, sizeof(jsonFragment), JSON_CALL_MASK, 1l, MAC, fragment);
-        logdebug("Server %s command: %s", target, jsonFragment);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonFragment);
-        if (headerList)
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerList);
+        if (ordered)
+            class_busy[started.class] = true;
+        bool sent;
+        if (transfer) {
+            transfer->request = started;
+            sent = send_command(transfer);
+        } else {
+            sent = run_script(&started);
+        }
+        if (!sent)
+            post_result(&started, false, false, 0, NULL);
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    if (retry_timer >= 0)
+        reactor_timer_set(retry_timer, wake ? MAX(wake - now, 1) : 0, 0);
+}
 
-        //
-        //  Send command and clean up
-        //  Note: one could retrieve a result here since all communication is synchronous!
-        //
-        CURLcode res = curl_easy_perform(curl);
-        if(res != CURLE_OK) {
-            size_t len = strlen(errbuf);
-            loginfo("Curl Error: (%d) ", res);
-            if(len)
-                loginfo( "%s%s", errbuf,((errbuf[len - 1] != '\n') ? "\n" : ""));
-            else
-                loginfo( "%s\n", curl_easy_strerror(res));
+static void retry_timeout(int fd, uint32_t events, void * ctx) {
+    reactor_timer_ack(fd);
+    dispatch();
+}
+
+//
+//  Collect finished transfers
+//
+static void check_done(void) {
+    CURLMsg * msg;
+    int pending;
+    bool done = false;
+
+    while ((msg = curl_multi_info_read(multi, &pending))) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        struct comm_transfer * transfer = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+        if (transfer) {
+            command_sent(transfer, msg->data.result);
+            done = true;
         }
-        curl_slist_free_all(targetList);
-        targetList = NULL;
+    }
+    if (done)
+        dispatch();
+}
 
-        //commLock = false;
-        return true;
-    } else if ( command == SCRIPT ) {
-        char * cmdline = (char *) malloc(strlen(fragment)*( sizeof(char)) );
-        int err;
-        strncpy( cmdline, fragment, strlen(fragment));
-        loginfo("Sending commandline: %s\n", cmdline);
-        if ((err = system(cmdline)) != 0){
-            loginfo ("%s exit status = %d\n", cmdline, err);
-                return false;
+//
+//  curl multi socket interface
+//  curl tells which of its sockets to wait on and when to call it back,
+//  the worker event loop does the waiting.
+//
+static void comm_socket(int fd, uint32_t events, void * ctx) {
+    int flags = 0, running;
+    if (events & EPOLLIN)
+        flags |= CURL_CSELECT_IN;
+    if (events & EPOLLOUT)
+        flags |= CURL_CSELECT_OUT;
+    if (events & (EPOLLERR | EPOLLHUP))
+        flags |= CURL_CSELECT_ERR;
+    curl_multi_socket_action(multi, fd, flags, &running);
+    check_done();
+}
+
+static void comm_timeout(int fd, uint32_t events, void * ctx) {
+    int running;
+    reactor_timer_ack(fd);
+    curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    check_done();
+}
+
+static int socket_callback(CURL * easy, curl_socket_t s, int what, void * userp, void * socketp) {
+    if (what == CURL_POLL_REMOVE) {
+        reactor_del(worker_loop, s);
+        return 0;
+    }
+    uint32_t events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) |
+                      ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+    if (reactor_mod(worker_loop, s, events) < 0 &&
+        reactor_add(worker_loop, s, events, comm_socket, NULL) < 0)
+        return -1;
+    return 0;
+}
+
+static int timer_callback(CURLM * multi, long timeout_ms, void * userp) {
+    //  0 ms would disarm the timer, 1 ms is as good as right away
+    reactor_timer_set(worker_timer, (timeout_ms < 0) ? 0 : (timeout_ms ? timeout_ms : 1), 0);
+    return 0;
+}
+
+//
+//  New commands queued or stop requested
+//
+static void comm_wake(int fd, uint32_t events, void * ctx) {
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) < 0)
+        return;
+    pthread_mutex_lock(&lock);
+    bool stop = worker_stop;
+    pthread_mutex_unlock(&lock);
+    if (stop) {
+        reactor_stop(worker_loop);
+        return;
+    }
+    dispatch();
+}
+
+//
+//  Worker thread: run the worker event loop
+//
+static void * comm_loop(void * arg) {
+    reactor_run(worker_loop);
+    return NULL;
+}
+
+//
+//  Main loop handler: pass results of sent commands to the completion handler
+//
+static void comm_done(int fd, uint32_t events, void * ctx) {
+    uint64_t value;
+    struct comm_result done[COMM_QUEUE_SIZE];
+    int count = 0;
+
+    if (read(fd, &value, sizeof(value)) < 0)
+        return;
+    pthread_mutex_lock(&lock);
+    while (result_count) {
+        done[count++] = results[result_head];
+        result_head = (result_head + 1) % COMM_QUEUE_SIZE;
+        result_count--;
+    }
+    outstanding -= count;
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < count; i++)
+        if (done_handler)
+            done_handler(done + i);
+}
+
+//
+//  Compile the connection settings if the server changed, call with lock held
+//  Returns: true if changed
+//
+static bool compile_connection(const struct sbpd_server * server) {
+    const char * host = server->host ? server->host : "";
+    if (server->port == connection.port && strcmp(host, connection.host) == 0)
+        return false;
+    snprintf(connection.host, sizeof(connection.host), "%s", host);
+    connection.port = server->port;
+    snprintf(connection.target, sizeof(connection.target), "::%s:%d", host, server->port);
+    connection.secret[0] = 0;
+    connection.user = server->user;
+    connection.password = server->password;
+    if (server->user && server->password)
+        snprintf(connection.secret, sizeof(connection.secret), "%s:%s",
+                 server->user, server->password);
+    connection.generation++;
+    return true;
+}
+
+//
+//
+//  Server found or changed
+//
+//
+void comm_server(struct sbpd_server * server) {
+    if (!server->host || !server->port)
+        return;
+    pthread_mutex_lock(&lock);
+    bool changed = compile_connection(server);
+    if (changed)
+        memset(&breaker, 0, sizeof(breaker));
+    pthread_mutex_unlock(&lock);
+    if (changed) {
+        loginfo("Server connection %s:%d", server->host, server->port);
+        queue_command(server, LMS, COMM_WARMUP, 0, 0);
+    }
+}
+
+//
+//
+//  Discovery found the server again
+//
+//
+void comm_server_seen(struct sbpd_server * server) {
+    pthread_mutex_lock(&lock);
+    bool probe = breaker.open && !breaker.probing;
+    if (probe)
+        breaker.probe_at = 0;
+    pthread_mutex_unlock(&lock);
+    if (probe) {
+        loginfo("Server seen again, probing");
+        queue_command(server, LMS, COMM_WARMUP, 0, 0);
+    }
+}
+
+//
+//
+//  Register a static fragment for a precompiled body
+//
+//
+int comm_register(const char * fragment) {
+    if (numberofbodies >= body_capacity || strlen(fragment) >= COMM_FRAGMENT_LEN)
+        return -1;
+    struct comm_body * body = bodies + numberofbodies;
+    body->fragment = fragment;
+    body->class = comm_class(LMS, fragment);
+    body->body = body_text + numberofbodies * COMM_BODY_LEN;
+    body->length = 0;
+    body->line = line_text + numberofbodies * COMM_LINE_LEN;
+    body->line_length = -1;
+    return numberofbodies++;
+}
+
+//
+//
+//  Queue a command for the worker
+//
+//
+bool queue_command(struct sbpd_server * server, int command, const char * fragment,
+                   uint32_t tag, int32_t value) {
+    if ( (command != LMS && command != SCRIPT) || !fragment || !worker_running )
+        return false;
+    int body = -1;
+    if (command == LMS) {
+        for (int cnt = 0; cnt < numberofbodies && body < 0; cnt++) {
+            if (bodies[cnt].fragment == fragment && bodies[cnt].length)
+                body = cnt;
         }
-        free (cmdline);
     }
+    if ( body < 0 && strlen(fragment) >= COMM_FRAGMENT_LEN ) {
+        logerr("Command too long: %s", fragment);
+        return false;
+    }
+    pthread_mutex_lock(&lock);
+    if (outstanding >= COMM_QUEUE_SIZE) {
+        pthread_mutex_unlock(&lock);
+        logwarn("Command queue full, server too slow: %s", fragment);
+        return false;
+    }
+    compile_connection(server);
+    struct comm_request * request = requests + request_count;
+    request->tag = tag;
+    request->value = value;
+    request->command = command;
+    request->body = body;
+    request->queued = ms_timer();
+    request->not_before = 0;
+    request->attempts = 0;
+    request->probe = false;
+    if (body >= 0) {
+        request->class = bodies[body].class;
+    } else {
+        request->class = comm_class(command, fragment);
+        strcpy(request->fragment, fragment);
+    }
+    request_count++;
+    outstanding++;
+    pthread_mutex_unlock(&lock);
+    wake_worker();
     return true;
 }
 
 //
 //  Curl reply callback
-//  Replies from the server go here.
-//  We could handle return values here but we just log.
+//  Replies from the server go here, a chunk at a time, into the reply
+//  parser of the transfer.
 //
 size_t write_data(char *buffer, size_t size, size_t nmemb, void *userp) {
+    struct comm_transfer * transfer = userp;
     if (size)
-        logdebug("Server reply %s", buffer);
+        logdebug("Server reply %.*s", (int)(size * nmemb), buffer);
+    reply_feed(&transfer->parser, buffer, size * nmemb);
     return size * nmemb;
 }
 
 //
 //
-//  Initialize CURL for server communication and set MAC address
+//  Initialize CURL for server communication, set MAC address
+//  and start the network worker
 //
 //
-int init_comm(char * use_mac) {
+void alloc_comm(const struct registry_counts * counts) {
+    body_capacity = counts->commands;
+    bodies = registry_alloc(REGISTRY_COLD, body_capacity, sizeof(*bodies));
+    body_text = registry_alloc(REGISTRY_COLD, body_capacity, COMM_BODY_LEN);
+    line_text = registry_alloc(REGISTRY_COLD, body_capacity, COMM_LINE_LEN);
+}
+
+int init_comm(char * use_mac, uint32_t use_cli_port, struct reactor * loop, comm_handler_t handler) {
     loginfo("Initializing CURL");
     MAC = use_mac;
+    cli_port = use_cli_port;
+    done_handler = handler;
+
     //
-    //  Setup mutex lock for comm - unused
+    //  Compile the bodies of static fragments
     //
-    /*if (pthread_mutex_init(&lock, NULL) != 0) {
-        logerr("comm lock mutex init failed");
-        return -1;
-    }*/
+    for (int cnt = 0; cnt < numberofbodies; cnt++) {
+        int length = snprintf(bodies[cnt].body, COMM_BODY_LEN, JSON_CALL_MASK,
+                              1l, MAC, bodies[cnt].fragment);
+        if (length > 0 && length < COMM_BODY_LEN)
+            bodies[cnt].length = (size_t)length;
+        if (cli_port) {
+            bodies[cnt].line_length = lmscli_compile(bodies[cnt].line, COMM_LINE_LEN,
+                                                     MAC, bodies[cnt].fragment);
+            if (bodies[cnt].line_length < 0)
+                loginfo("Command %s is sent by HTTP, not by CLI", bodies[cnt].fragment);
+        }
+    }
     
     //
     //  Initialize curl comm
     //
     curl_global_init(CURL_GLOBAL_ALL);
-    curl = curl_easy_init();
-    if (!curl) {
+    multi = curl_multi_init();
+    if (!multi) {
         curl_global_cleanup();
         return -1;
     }
-    
-    //
-    //  Set verbose mode for communication debugging
-    //
-    if (loglevel() == LOG_DEBUG)
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
     headerList = curl_slist_append(headerList, "Content-Type: application/json");
     char userAgent[50];
     snprintf(userAgent, sizeof(userAgent), "User-Agent: %s/%s)", USER_AGENT, VERSION);
@@ -207,17 +1027,109 @@ int init_comm(char * use_mac) {
     //  Add session-ID? Only needed for MySB which is not supported
     //
     //headerList = curl_slist_append(headerList, "x-sdi-squeezenetwork-session: ...")
+
+    for (int i = 0; i < COMM_HANDLES; i++) {
+        CURL * curl = curl_easy_init();
+        if (!curl)
+            return -1;
+        //
+        //  Set verbose mode for communication debugging
+        //
+        if (loglevel() == LOG_DEBUG)
+            curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
+        //  no signals for timeouts, we are not in the main thread
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, transfers + i);
+        curl_easy_setopt(curl, CURLOPT_URL, SERVER_ADDRESS_TEMPLATE);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)COMM_CONNECT_TIMEOUT);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerList);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, (long)COMM_KEEPIDLE);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, (long)COMM_KEEPINTVL);
+        // Setup an error buffer to log errors
+        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, transfers[i].errbuf);
+        curl_easy_setopt(curl, CURLOPT_PRIVATE, transfers + i);
+        transfers[i].curl = curl;
+    }
+
+    //
+    //  Start the network worker
+    //
+    worker_loop = reactor_create();
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!worker_loop || wake_fd < 0 || done_fd < 0 ||
+        reactor_add(worker_loop, wake_fd, EPOLLIN, comm_wake, NULL) < 0 ||
+        (worker_timer = reactor_timer(worker_loop, comm_timeout, NULL)) < 0 ||
+        (retry_timer = reactor_timer(worker_loop, retry_timeout, NULL)) < 0 ||
+        !(cli = lmscli_create(worker_loop, cli_sent, NULL, NULL)) ||
+        reactor_add(loop, done_fd, EPOLLIN, comm_done, NULL) < 0) {
+        logerr("Could not set up network worker");
+        return -1;
+    }
+    done_loop = loop;
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)COMM_HANDLES);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+
+    worker_stop = false;
+    if (pthread_create(&worker, NULL, comm_loop, NULL) != 0) {
+        logerr("Could not start network worker");
+        return -1;
+    }
+    worker_running = true;
     return 0;
 }
 
 //
 //
-//  Shutdown CURL
+//  Stop the worker and shutdown CURL
 //
 //
 void shutdown_comm() {
+    if (worker_running) {
+        pthread_mutex_lock(&lock);
+        worker_stop = true;
+        if (request_count)
+            loginfo("Dropping %d queued commands", request_count);
+        pthread_mutex_unlock(&lock);
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0)
+            logerr("Could not stop network worker");
+        pthread_join(worker, NULL);
+        worker_running = false;
+    }
+    lmscli_destroy(cli);
+    cli = NULL;
+    for (int i = 0; i < COMM_HANDLES; i++) {
+        if (transfers[i].busy)
+            curl_multi_remove_handle(multi, transfers[i].curl);
+        curl_easy_cleanup(transfers[i].curl);
+        curl_slist_free_all(transfers[i].targetList);
+        transfers[i] = (struct comm_transfer){ .curl = NULL };
+    }
+    if (script.pidfd >= 0)
+        close(script.pidfd);
+    if (done_fd >= 0) {
+        if (done_loop)
+            reactor_del(done_loop, done_fd);
+        close(done_fd);
+    }
+    done_fd = -1;
+    if (worker_timer >= 0)
+        close(worker_timer);
+    if (retry_timer >= 0)
+        close(retry_timer);
+    worker_timer = retry_timer = -1;
+    if (wake_fd >= 0)
+        close(wake_fd);
+    reactor_destroy(worker_loop);
+    worker_loop = NULL;
+    curl_multi_cleanup(multi);
+    multi = NULL;
     curl_slist_free_all(headerList);
-    curl_easy_cleanup(curl);
+    headerList = NULL;
     curl_global_cleanup();
 }
-
@@ -36,34 +36,152 @@
 #define servercomm_h
 
 #include "sbpd.h"
+#include "reactor.h"
+#include "registry.h"
+#include "lmsreply.h"
 
 //
+//  Commands are sent by a network worker thread.
+//  The main loop queues them and never blocks on the server, the worker
+//  reports each result back to the main loop through a completion handler.
 //
-//  Initialize CURL for server communication and set MAC address
+//  The worker runs its own event loop driving the curl multi interface,
+//  so several commands can be in flight at once. Commands of the same
+//  class are sent in order, one at a time, see comm_class().
+//  Alternatively LMS commands go through a persistent connection to the
+//  server CLI port, see lmscli.h
 //
+
+//
+//  Number of commands waiting for the worker or in flight.
+//  Queuing fails while the queue is full.
+//
+#define COMM_QUEUE_SIZE     32
+#define COMM_FRAGMENT_LEN   256
+
+//
+//  Number of curl handles, commands in flight at most
+//
+#define COMM_HANDLES        4
+
+//
+//  Command classes
+//  Transport and mixer commands and scripts are each kept in order,
+//  other commands, e.g. queries, are sent as soon as a handle is free.
+//
+#define COMM_CLASS_TRANSPORT    0
+#define COMM_CLASS_MIXER        1
+#define COMM_CLASS_SCRIPT       2
+#define COMM_CLASS_OTHER        3
+#define COMM_CLASSES            4
+
+//
+//  Delivery
+//  A command waits in the queue at most its class expiry (ms), then it
+//  is dropped. Transport commands that did not reach the server are
+//  retried, waiting COMM_RETRY_MIN ms doubled for each retry up to the max.
+//  Mixer changes are not retried, they are stale by then.
+//
+#define COMM_EXPIRY_TRANSPORT   10000
+#define COMM_EXPIRY_MIXER       2000
+#define COMM_EXPIRY_OTHER       5000
+#define COMM_RETRY_MIN          500
+#define COMM_RETRY_MAX          4000
+#define COMM_CONNECT_TIMEOUT    2       // s
+
+//
+//  Circuit breaker
+//  Opens after this many LMS commands in a row got no answer, probes
+//  the server after COMM_BREAKER_PROBE_MIN ms, doubled up to the max.
+//
+#define COMM_BREAKER_FAILURES   3
+#define COMM_BREAKER_PROBE_MIN  2000
+#define COMM_BREAKER_PROBE_MAX  30000
+
+//
+//  Result of a queued command
+//
+struct comm_result {
+    uint32_t tag;           // given when queued, identifies the sender
+    int32_t value;          // given when queued, e.g. an encoder delta
+    int command;            // LMS or SCRIPT
+    bool ok;                // command done, script exit status 0
+    bool reached;           // false if the server could not be reached
+    bool expired;           // dropped by the delivery policy, not sent
+    bool retried;           // not sent, queued again, the command's result comes later
+    struct lms_reply reply; // fields of the server reply, none for CLI commands
+};
+
+//
+//  Completion handler, called in the main loop
+//
+typedef void (*comm_handler_t)(const struct comm_result * result);
+
+//
+//
+//  Initialize CURL for server communication, set MAC address
+//  and start the network worker
+//  Parameters:
+//      use_mac: player MAC address
+//      use_cli_port: server CLI port to send LMS commands to, 0 for HTTP JSON-RPC
+//      loop: main loop the completion handler is called from
+//      handler: completion handler, can be NULL
+//  Returns: 0 on success, -1 on error
+//
+//
+int init_comm(char * use_mac, uint32_t use_cli_port, struct reactor * loop, comm_handler_t handler);
+
+//
+//  Allocate the precompiled bodies from the registry, see registry_alloc()
+//
+void alloc_comm(const struct registry_counts * counts);
+
+//
+//  Register a static LMS fragment
+//  Its JSON-RPC body is compiled once in init_comm(), queue_command()
+//  sends it for this fragment pointer. The fragment has to stay.
+//  Returns: body id, -1 if there is no room
+//
+int comm_register(const char * fragment);
+
+//
+//  Server found or changed
+//  Compiles the connection settings and opens the connection.
+//  queue_command() checks for changes as well.
+//
+void comm_server(struct sbpd_server * server);
+
+//
+//  Discovery found the server again, e.g. the player reconnected
+//  Probes right away if the circuit breaker is open.
 //
-int init_comm(char * use_mac);
+void comm_server_seen(struct sbpd_server * server);
 
 //
 //
-//  Shutdown CURL
+//  Stop the worker and shutdown CURL
+//  Commands still queued are dropped.
 //
 //
 void shutdown_comm();
 
 //
 //
-//  Send CLI command fragment to Logitech Media Server/Squeezebox Server
-//  This command blocks (synchronously communicates".
-//  In timing critical situations this should be called from a separate thread
+//  Queue CLI command fragment for Logitech Media Server/Squeezebox Server
+//  or a script command line. Returns right away.
+//  The server address is taken when queuing.
 //
 //  Parameters:
 //      server: the server information structure defining host, port etc.
-//      frament: the command fragment to be sent as JSON array
+//      command: LMS or SCRIPT
+//      fragment: the command fragment to be sent as JSON array
 //               e.g. "[\"mixer\”,\"volume\",\"+2\"]"
-//  Returns: success flag
+//               or the script command line
+//      tag, value: passed back in the result
+//  Returns: false if the queue is full or the command is not sent
 //
 //
-bool send_command(struct sbpd_server * server, int command, char * fragment);
+bool queue_command(struct sbpd_server * server, int command, const char * fragment,
+                   uint32_t tag, int32_t value);
 
 #endif /* servercomm_h */
@@ -0,0 +1,332 @@
+//
+//  serverset.c
+//  SqueezeButtonPi
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "serverset.h"
+#include "playerstate.h"
+#include "discovery.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+//
+//  Server set state, main loop only
+//
+static struct server_entry servers[SERVER_SET_MAX];
+static int numberofservers = 0;
+static struct reactor * set_loop = NULL;
+static struct sbpd_server * set_server = NULL;
+static int probe_timer = -1;
+static bool probing = false;            // probe_timer armed
+static int deadline_timer = -1;         // first open probe timing out
+
+//
+//  Server by host and port, any port for 0
+//
+static struct server_entry * find_server(const char * host, uint32_t port) {
+    for (int cnt = 0; host && cnt < numberofservers; cnt++) {
+        if (strcmp(servers[cnt].host, host) == 0 && (!port || servers[cnt].port == port))
+            return servers + cnt;
+    }
+    return NULL;
+}
+
+//
+//  The active server, the one in the server configuration
+//
+static struct server_entry * active_server(void) {
+    if (!set_server)
+        return NULL;
+    return find_server(set_server->host, set_server->port);
+}
+
+static bool server_up(const struct server_entry * entry) {
+    return entry->port && entry->failures < SERVER_DOWN_FAILURES;
+}
+
+//
+//  Pick the active server
+//  A server that is up is kept unless the player attached to another one.
+//
+static void select_server(void) {
+    struct server_entry * active = active_server();
+    struct server_entry * best = NULL;
+
+    for (int cnt = 0; cnt < numberofservers; cnt++) {
+        struct server_entry * entry = servers + cnt;
+        if (!server_up(entry) || !(entry->attached || entry->configured))
+            continue;
+        if (!best || (entry->attached && !best->attached) ||
+            (entry->attached == best->attached && entry->rtt_ms >= 0 &&
+             (best->rtt_ms < 0 || entry->rtt_ms < best->rtt_ms)))
+            best = entry;
+    }
+    if (!best || best == active)
+        return;
+    if (active && server_up(active) && (active->attached || !best->attached))
+        return;
+    loginfo("Server %s:%u selected%s, round trip %d ms", best->host, best->port,
+            best->attached ? ", player attached" : "", best->rtt_ms);
+    set_server->host = best->host;
+    set_server->port = best->port;
+    comm_server(set_server);
+    player_state_server(set_server);
+}
+
+//
+//  Probe failed or a command did not reach the server
+//
+static void server_failed(struct server_entry * entry, const char * reason) {
+    entry->failures++;
+    if (entry->failures == SERVER_DOWN_FAILURES)
+        logwarn("Server %s:%u down: %s", entry->host, entry->port, reason);
+    if (entry == active_server() && entry->failures >= SERVER_DOWN_FAILURES) {
+        //  the player may have moved already
+        discovery_search();
+        select_server();
+    }
+}
+
+//
+//  Arm the deadline timer for the oldest open probe
+//
+static void arm_deadline(void) {
+    long long due = 0;
+    for (int cnt = 0; cnt < numberofservers; cnt++) {
+        long long probe_due = servers[cnt].probe_start + SERVER_PROBE_TIMEOUT;
+        if (servers[cnt].probe_fd >= 0 && (!due || probe_due < due))
+            due = probe_due;
+    }
+    if (deadline_timer < 0)
+        return;
+    long long now = ms_timer();
+    reactor_timer_set(deadline_timer, !due ? 0 : (due > now) ? (long)(due - now) : 1, 0);
+}
+
+static void probe_close(struct server_entry * entry) {
+    if (entry->probe_fd < 0)
+        return;
+    reactor_del(set_loop, entry->probe_fd);
+    close(entry->probe_fd);
+    entry->probe_fd = -1;
+}
+
+//
+//  Probe connection done
+//
+static void probe_done(int fd, uint32_t events, void * ctx) {
+    struct server_entry * entry = ctx;
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    int rtt = (int)(ms_timer() - entry->probe_start);
+    probe_close(entry);
+    arm_deadline();
+    if (error || (events & (EPOLLERR | EPOLLHUP))) {
+        server_failed(entry, error ? strerror(error) : "connection failed");
+        return;
+    }
+    if (entry->failures >= SERVER_DOWN_FAILURES)
+        loginfo("Server %s:%u up again", entry->host, entry->port);
+    entry->failures = 0;
+    entry->rtt_ms = (entry->rtt_ms < 0) ? rtt : (3 * entry->rtt_ms + rtt) / 4;
+    select_server();
+}
+
+//
+//  Start a probe connection
+//
+static void probe_server(struct server_entry * entry) {
+    if (entry->probe_fd >= 0 || !entry->port)
+        return;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)entry->port);
+    if (!entry->resolved) {
+        server_failed(entry, "not found");
+        return;
+    }
+    addr.sin_addr = entry->addr;
+    entry->probe_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (entry->probe_fd < 0)
+        return;
+    entry->probe_start = ms_timer();
+    if ((connect(entry->probe_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+         errno != EINPROGRESS) ||
+        reactor_add(set_loop, entry->probe_fd, EPOLLOUT, probe_done, entry) < 0) {
+        const char * reason = strerror(errno);
+        close(entry->probe_fd);
+        entry->probe_fd = -1;
+        server_failed(entry, reason);
+        return;
+    }
+    arm_deadline();
+}
+
+//
+//  Timer: probes not connected in time failed
+//
+static void probe_deadline(int fd, uint32_t events, void * ctx) {
+    reactor_timer_ack(fd);
+    long long now = ms_timer();
+    for (int cnt = 0; cnt < numberofservers; cnt++) {
+        struct server_entry * entry = servers + cnt;
+        if (entry->probe_fd >= 0 && now - entry->probe_start >= SERVER_PROBE_TIMEOUT) {
+            probe_close(entry);
+            server_failed(entry, "timed out");
+        }
+    }
+    arm_deadline();
+}
+
+//
+//  Timer: probe all servers
+//
+static void probe_timeout(int fd, uint32_t events, void * ctx) {
+    reactor_timer_ack(fd);
+    for (int cnt = 0; cnt < numberofservers; cnt++)
+        probe_server(servers + cnt);
+}
+
+//
+//  Probe only with a server to choose from, a single server is left
+//  to the command breaker without waking up
+//
+static void arm_probes(void) {
+    bool needed = numberofservers >= 2;
+    if (probe_timer < 0 || needed == probing)
+        return;
+    probing = needed;
+    reactor_timer_set(probe_timer, needed ? 1 : 0, needed ? SERVER_PROBE_INTERVAL : 0);
+}
+
+//
+//  Resolve a server name, blocks for names, so only when a server is added
+//
+static void resolve_server(struct server_entry * entry) {
+    entry->resolved = (inet_pton(AF_INET, entry->host, &entry->addr) == 1);
+    if (entry->resolved)
+        return;
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo * found = NULL;
+    if (getaddrinfo(entry->host, NULL, &hints, &found) != 0 || !found) {
+        logwarn("Server %s not found, it is not probed", entry->host);
+        return;
+    }
+    entry->addr = ((struct sockaddr_in *)found->ai_addr)->sin_addr;
+    entry->resolved = true;
+    freeaddrinfo(found);
+}
+
+int server_set_add(const char * host, uint32_t port, bool configured) {
+    struct server_entry * entry = find_server(host, port);
+    if (!entry) {
+        if (numberofservers >= SERVER_SET_MAX || strlen(host) >= sizeof(entry->host))
+            return -1;
+        entry = servers + numberofservers++;
+        strcpy(entry->host, host);
+        entry->rtt_ms = -1;
+        entry->probe_fd = -1;
+        loginfo("Server %s:%u added%s", host, port, configured ? "" : " by discovery");
+        resolve_server(entry);
+        arm_probes();
+    }
+    if (port)
+        entry->port = port;
+    entry->configured |= configured;
+    return 0;
+}
+
+uint32_t server_set_port(const char * host) {
+    struct server_entry * entry = find_server(host, 0);
+    return entry ? entry->port : 0;
+}
+
+void server_set_attached(const char * host) {
+    for (int cnt = 0; cnt < numberofservers; cnt++)
+        servers[cnt].attached = (host && strcmp(servers[cnt].host, host) == 0);
+    if (set_server)
+        select_server();
+}
+
+void server_set_result(bool reached, bool answered) {
+    struct server_entry * entry = active_server();
+    if (!entry || numberofservers < 2)
+        return;
+    if (answered) {
+        entry->failures = 0;
+        return;
+    }
+    if (!reached)
+        server_failed(entry, "command not sent");
+    probe_server(entry);
+}
+
+int init_server_set(struct reactor * loop, struct sbpd_server * server) {
+    set_loop = loop;
+    set_server = server;
+    if (server->host)
+        server_set_add(server->host, server->port, true);
+    for (int cnt = 0; cnt < numberofservers; cnt++) {
+        if (!servers[cnt].port)
+            servers[cnt].port = server->port ? server->port : 9000;
+    }
+    probe_timer = reactor_timer(loop, probe_timeout, NULL);
+    deadline_timer = reactor_timer(loop, probe_deadline, NULL);
+    if (probe_timer < 0 || deadline_timer < 0)
+        return -1;
+    arm_probes();
+    if (!server->host)
+        select_server();
+    return 0;
+}
+
+void shutdown_server_set(void) {
+    for (int cnt = 0; cnt < numberofservers; cnt++)
+        probe_close(servers + cnt);
+    if (probe_timer >= 0) {
+        reactor_del(set_loop, probe_timer);
+        close(probe_timer);
+    }
+    if (deadline_timer >= 0) {
+        reactor_del(set_loop, deadline_timer);
+        close(deadline_timer);
+    }
+    probe_timer = deadline_timer = -1;
+    probing = false;
+}
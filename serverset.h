@@ -0,0 +1,120 @@
+//
+//  serverset.h
+//  SqueezeButtonPi
+//
+//
+//  Copyright (c) 2025, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef serverset_h
+#define serverset_h
+
+#include "sbpd.h"
+#include "reactor.h"
+#include "servercomm.h"
+
+#include <netinet/in.h>
+
+//
+//  Server set
+//  Servers configured by hand (-A and -S) and found by discovery
+//  broadcasts. Commands go to one of them, the active server, which is
+//  written to the server configuration.
+//
+//  With more than one server each is probed every SERVER_PROBE_INTERVAL ms
+//  by opening a TCP connection to its port, the connect time is kept as
+//  round trip time. A probe not connected within SERVER_PROBE_TIMEOUT ms
+//  failed. A server is down after SERVER_DOWN_FAILURES failed probes or
+//  commands in a row. Names are resolved once, when the server is added.
+//
+//  The active server is the one the player is attached to, found by
+//  discovery, as long as it is up. Otherwise, or while it is down, the
+//  configured server that is up with the shortest round trip time.
+//  Servers found by broadcast only serve the player once it attaches to
+//  them, but their port is known right away then.
+//
+#define SERVER_SET_MAX          8
+#define SERVER_PROBE_INTERVAL   5000
+#define SERVER_PROBE_TIMEOUT    (COMM_CONNECT_TIMEOUT * 1000)
+#define SERVER_DOWN_FAILURES    2
+
+struct server_entry {
+    char host[64];
+    uint32_t port;
+    struct in_addr addr;        // resolved host
+    bool resolved;
+    bool configured;            // set by hand, selectable without the player
+    bool attached;              // the player is connected to it
+    int rtt_ms;                 // smoothed connect time, -1 while unknown
+    int failures;               // failed probes or commands in a row
+    int probe_fd;               // probe connection, -1 if none
+    long long probe_start;      // ms_timer() time the probe started
+};
+
+//
+//  Add a server or update its port
+//  Parameters:
+//      host: address or name, copied
+//      port: server port, 0 for the configured one
+//      configured: set by hand
+//  Returns: 0 on success, -1 if the set is full
+//
+int server_set_add(const char * host, uint32_t port, bool configured);
+
+//
+//  Port of a server in the set
+//  Returns: port, 0 if not known
+//
+uint32_t server_set_port(const char * host);
+
+//
+//  The player is attached to host, NULL for none, from discovery
+//
+void server_set_attached(const char * host);
+
+//
+//  Outcome of a command sent to the active server
+//  Parameters:
+//      reached: the command was sent, false counts as a failure
+//      answered: the server replied, only then the failures are reset
+//  A failure or a command without reply probes right away, so a dead
+//  server is left quickly.
+//
+void server_set_result(bool reached, bool answered);
+
+//
+//  Start probing, with the active server taken from server
+//  Parameters:
+//      loop: main loop
+//      server: server configuration, rewritten when the active server changes
+//  Returns: 0 on success, -1 on error
+//
+int init_server_set(struct reactor * loop, struct sbpd_server * server);
+
+void shutdown_server_set(void);
+
+#endif /* serverset_h */